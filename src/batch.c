@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nezvm.h"
+#include "batch.h"
+#include "perf.h"
+#include "output.h"
+
+typedef struct mininez_batch_deque_t {
+  size_t *items;
+  size_t top;    /* thieves steal from here */
+  size_t bottom; /* the owner pops from here */
+  pthread_mutex_t lock;
+} mininez_batch_deque_t;
+
+struct mininez_batch_pool_t;
+
+typedef struct mininez_batch_worker_t {
+  pthread_t thread;
+  int id;
+  unsigned seed;
+  struct mininez_batch_pool_t *pool;
+  mininez_batch_deque_t deque;
+  mininez_runtime_t *r;
+  char *buf;
+  size_t buf_size;
+  mininez_batch_result_t result;
+  mininez_batch_latency_t *latency;
+  int insn_fd;
+  mininez_writer_t out;
+} mininez_batch_worker_t;
+
+typedef struct mininez_batch_pool_t {
+  mininez_runtime_t *r;
+  mininez_inst_t *inst;
+  mininez_batch_t *batch;
+  mininez_batch_worker_t *workers;
+  int size;
+  int format; /* -1: no trees */
+  FILE *status;
+  int shared; /* the trees go to the file of the status lines */
+  pthread_mutex_t out_lock;
+} mininez_batch_pool_t;
+
+static uint64_t batch_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* File Collection */
+
+mininez_batch_t *mininez_batch_create() {
+  mininez_batch_t *b = (mininez_batch_t *) VM_MALLOC(sizeof(mininez_batch_t));
+  b->files = NULL;
+  b->size = 0;
+  b->capacity = 0;
+  return b;
+}
+
+void mininez_batch_dispose(mininez_batch_t *b) {
+  for (size_t i = 0; i < b->size; i++) {
+    VM_FREE(b->files[i].path);
+  }
+  VM_FREE(b->files);
+  VM_FREE(b);
+}
+
+static void batch_add(mininez_batch_t *b, const char *path, size_t size) {
+  if (b->size == b->capacity) {
+    b->capacity = b->capacity == 0 ? 64 : b->capacity * 2;
+    b->files = (mininez_batch_file_t *) realloc(b->files, sizeof(mininez_batch_file_t) * b->capacity);
+  }
+  b->files[b->size].path = strdup(path);
+  b->files[b->size].size = size;
+  b->files[b->size].parse_ns = 0;
+  b->files[b->size].instructions = 0;
+  b->size++;
+}
+
+static int batch_add_path(mininez_batch_t *b, const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    /* keep it, the worker reports the error as the file status */
+    batch_add(b, path, 0);
+    return 1;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  batch_add(b, path, (size_t)st.st_size);
+  return 1;
+}
+
+static int batch_collect_dir(mininez_batch_t *b, const char *dir) {
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  int count = 0;
+  if (d == NULL) {
+    return -1;
+  }
+  while ((e = readdir(d)) != NULL) {
+    struct stat st;
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+      continue;
+    }
+    size_t len = strlen(dir) + strlen(e->d_name) + 2;
+    char *path = (char *) VM_MALLOC(len);
+    snprintf(path, len, "%s/%s", dir, e->d_name);
+    if (lstat(path, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        int n = batch_collect_dir(b, path);
+        count += n > 0 ? n : 0;
+      } else {
+        count += batch_add_path(b, path);
+      }
+    }
+    VM_FREE(path);
+  }
+  closedir(d);
+  return count;
+}
+
+static int batch_collect_list(mininez_batch_t *b, const char *list) {
+  FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int count = 0;
+  if (fp == NULL) {
+    return -1;
+  }
+  while ((len = getline(&line, &cap, fp)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = 0;
+    }
+    if (len > 0) {
+      count += batch_add_path(b, line);
+    }
+  }
+  free(line);
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  return count;
+}
+
+static int batch_collect_glob(mininez_batch_t *b, const char *pattern) {
+  glob_t g;
+  int count = 0;
+  int ret = glob(pattern, 0, NULL, &g);
+  if (ret == GLOB_NOMATCH) {
+    return 0;
+  }
+  if (ret != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < g.gl_pathc; i++) {
+    count += batch_add_path(b, g.gl_pathv[i]);
+  }
+  globfree(&g);
+  return count;
+}
+
+int mininez_batch_collect(mininez_batch_t *b, const char *source) {
+  struct stat st;
+  if (source[0] == '@') {
+    return batch_collect_list(b, source + 1);
+  }
+  if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+    return batch_collect_dir(b, source);
+  }
+  return batch_collect_glob(b, source);
+}
+
+/* Work-Stealing Deque */
+
+static int deque_pop(mininez_batch_deque_t *q, size_t *item) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->bottom > q->top) {
+    *item = q->items[--q->bottom];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+static int deque_steal(mininez_batch_deque_t *q, size_t *item) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->bottom > q->top) {
+    *item = q->items[q->top++];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+static int batch_next(mininez_batch_worker_t *w, size_t *item) {
+  mininez_batch_pool_t *pool = w->pool;
+  if (deque_pop(&w->deque, item)) {
+    return 1;
+  }
+  /* no new work is ever produced, so one empty sweep means we are done */
+  int start = rand_r(&w->seed) % pool->size;
+  for (int i = 0; i < pool->size; i++) {
+    mininez_batch_worker_t *victim = &pool->workers[(start + i) % pool->size];
+    if (victim != w && deque_steal(&victim->deque, item)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Worker */
+
+static const char *batch_read(mininez_batch_worker_t *w, const char *path, size_t *len) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size + 1 > w->buf_size) {
+    w->buf_size = size + 1;
+    w->buf = (char *) realloc(w->buf, w->buf_size);
+  }
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, w->buf + done, size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      close(fd);
+      return NULL;
+    }
+    done += (size_t)n;
+  }
+  close(fd);
+  w->buf[size] = '\0';
+  *len = size;
+  return w->buf;
+}
+
+/* One document at a time, whole, so the trees of the workers do not mix */
+static void batch_write_tree(mininez_batch_worker_t *w, const char *path, Tree *t) {
+  mininez_batch_pool_t *pool = w->pool;
+  size_t len = strlen(path);
+  pthread_mutex_lock(&pool->out_lock);
+  if (pool->shared) {
+    fflush(pool->status);
+  }
+  switch (pool->format) {
+  case MININEZ_OUTPUT_TEXT:
+    mininez_writer_write(&w->out, "# ", 2);
+    mininez_writer_write(&w->out, path, len);
+    mininez_writer_write(&w->out, "\n", 1);
+    mininez_write_tree(&w->out, t, MININEZ_OUTPUT_TEXT);
+    break;
+  case MININEZ_OUTPUT_JSON:
+    mininez_writer_write(&w->out, "{\"file\":", 8);
+    mininez_write_json_string(&w->out, (const unsigned char *)path, len);
+    mininez_writer_write(&w->out, ",\"tree\":", 8);
+    mininez_write_json(&w->out, t);
+    mininez_writer_write(&w->out, "}\n", 2);
+    break;
+  case MININEZ_OUTPUT_BINARY: {
+    uint16_t n = len < UINT16_MAX ? (uint16_t)len : UINT16_MAX;
+    mininez_writer_write(&w->out, &n, sizeof(n));
+    mininez_writer_write(&w->out, path, n);
+    mininez_write_tree(&w->out, t, MININEZ_OUTPUT_BINARY);
+    break;
+  }
+  }
+  mininez_writer_flush(&w->out);
+  pthread_mutex_unlock(&pool->out_lock);
+}
+
+static void batch_parse(mininez_batch_worker_t *w, mininez_batch_file_t *file) {
+  mininez_batch_pool_t *pool = w->pool;
+  const char *status;
+  size_t len = 0;
+  uint64_t start = batch_now();
+  const char *text = batch_read(w, file->path, &len);
+  if (text == NULL) {
+    w->result.io_error++;
+    status = "error";
+  } else {
+    ParserContext *ctx;
+    mininez_reset_runtime(w->r, (const unsigned char *)text, len);
+    ctx = w->r->ctx;
+    mininez_init_vm(ctx);
+    uint64_t parse_start = w->latency != NULL ? batch_now() : 0;
+    uint64_t insn_start = mininez_perf_thread_read(w->insn_fd);
+    int parsed = mininez_parse(w->r, pool->inst);
+    if (w->latency != NULL) {
+      file->parse_ns = batch_now() - parse_start;
+      mininez_histogram_record(&w->latency->time, file->parse_ns);
+      if (w->insn_fd >= 0) {
+        file->instructions = mininez_perf_thread_read(w->insn_fd) - insn_start;
+        mininez_histogram_record(&w->latency->instructions, file->instructions);
+      }
+    }
+    if (parsed == MININEZ_ABORTED) {
+      w->result.aborted++;
+      status = "aborted";
+    } else if (parsed) {
+      if ((size_t)(ctx->pos - ctx->inputs) != ctx->length) {
+        w->result.unconsumed++;
+        status = "unconsume";
+      } else {
+        w->result.success++;
+        status = "success";
+      }
+      if (pool->format != -1) {
+        batch_write_tree(w, file->path, ctx->left);
+      }
+    } else {
+      w->result.syntax_error++;
+      status = "syntax error";
+    }
+    w->result.bytes += len;
+  }
+  w->result.files++;
+  if (pool->status != NULL) {
+    double msec = (double)(batch_now() - start) / 1000000.0;
+    if (pool->shared) {
+      pthread_mutex_lock(&pool->out_lock);
+    }
+    fprintf(pool->status, "%s\t%zu\t%.3f\t%s\n", status, len, msec, file->path);
+    if (pool->shared) {
+      pthread_mutex_unlock(&pool->out_lock);
+    }
+  }
+}
+
+static void *batch_worker(void *arg) {
+  mininez_batch_worker_t *w = (mininez_batch_worker_t *)arg;
+  size_t item;
+  /* the counter follows the thread that opens it */
+  if (w->latency != NULL) {
+    w->insn_fd = mininez_perf_thread_open(MININEZ_PERF_INSTRUCTIONS);
+    w->latency->error = w->insn_fd < 0 ? errno : 0;
+  }
+  while (batch_next(w, &item)) {
+    batch_parse(w, &w->pool->batch->files[item]);
+  }
+  if (w->insn_fd >= 0) {
+    close(w->insn_fd);
+    w->insn_fd = -1;
+  }
+  return NULL;
+}
+
+static mininez_batch_t *sort_target;
+
+static int batch_compare_size(const void *a, const void *b) {
+  size_t sa = sort_target->files[*(const size_t *)a].size;
+  size_t sb = sort_target->files[*(const size_t *)b].size;
+  return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+int mininez_batch_run(mininez_runtime_t *r, mininez_inst_t *inst,
+                      mininez_batch_t *b, int nthreads, int format, int out_fd,
+                      FILE *status, mininez_batch_latency_t *latency,
+                      mininez_batch_result_t *result) {
+  mininez_batch_pool_t pool;
+  int out_error = 0;
+  size_t *order = (size_t *) VM_MALLOC(sizeof(size_t) * (b->size + 1));
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  pool.r = r;
+  pool.inst = inst;
+  pool.batch = b;
+  pool.size = nthreads;
+  pool.format = format;
+  pool.status = status;
+  pool.shared = format != -1 && status != NULL && fileno(status) == out_fd;
+  pthread_mutex_init(&pool.out_lock, NULL);
+  pool.workers = (mininez_batch_worker_t *) VM_MALLOC(sizeof(mininez_batch_worker_t) * nthreads);
+
+  /* largest files first, dealt round-robin so every deque gets a fair share */
+  for (size_t i = 0; i < b->size; i++) {
+    order[i] = i;
+  }
+  sort_target = b;
+  qsort(order, b->size, sizeof(size_t), batch_compare_size);
+
+  for (int i = 0; i < nthreads; i++) {
+    mininez_batch_worker_t *w = &pool.workers[i];
+    size_t share = 0;
+    w->id = i;
+    w->seed = (unsigned)i * 2654435761U + 1;
+    w->pool = &pool;
+    w->r = mininez_fork_runtime(r, NULL, 0);
+    w->buf = NULL;
+    w->buf_size = 0;
+    memset(&w->result, 0, sizeof(w->result));
+    w->latency = NULL;
+    w->insn_fd = -1;
+    if (format != -1) {
+      mininez_writer_init(&w->out, out_fd);
+    }
+    if (latency != NULL) {
+      w->latency = (mininez_batch_latency_t *) VM_MALLOC(sizeof(mininez_batch_latency_t));
+      mininez_histogram_init(&w->latency->time);
+      mininez_histogram_init(&w->latency->instructions);
+      w->latency->error = 0;
+    }
+    w->deque.items = (size_t *) VM_MALLOC(sizeof(size_t) * (b->size / nthreads + 1));
+    for (size_t j = i; j < b->size; j += nthreads) {
+      share++;
+    }
+    /* the owner pops from the bottom, so the largest share goes last */
+    for (size_t j = i, k = share; j < b->size; j += nthreads) {
+      w->deque.items[--k] = order[j];
+    }
+    w->deque.top = 0;
+    w->deque.bottom = share;
+    pthread_mutex_init(&w->deque.lock, NULL);
+  }
+
+  memset(result, 0, sizeof(*result));
+  if (latency != NULL) {
+    mininez_histogram_init(&latency->time);
+    mininez_histogram_init(&latency->instructions);
+    latency->error = 0;
+  }
+  uint64_t start = batch_now();
+  for (int i = 1; i < nthreads; i++) {
+    pthread_create(&pool.workers[i].thread, NULL, batch_worker, &pool.workers[i]);
+  }
+  batch_worker(&pool.workers[0]);
+  for (int i = 1; i < nthreads; i++) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+  result->elapsed_ns = batch_now() - start;
+
+  for (int i = 0; i < nthreads; i++) {
+    mininez_batch_worker_t *w = &pool.workers[i];
+    result->files += w->result.files;
+    result->bytes += w->result.bytes;
+    result->success += w->result.success;
+    result->unconsumed += w->result.unconsumed;
+    result->syntax_error += w->result.syntax_error;
+    result->aborted += w->result.aborted;
+    result->io_error += w->result.io_error;
+    if (w->latency != NULL) {
+      mininez_histogram_merge(&latency->time, &w->latency->time);
+      mininez_histogram_merge(&latency->instructions, &w->latency->instructions);
+      latency->error = latency->error != 0 ? latency->error : w->latency->error;
+      VM_FREE(w->latency);
+    }
+    if (format != -1) {
+      out_error |= mininez_writer_flush(&w->out);
+      mininez_writer_dispose(&w->out);
+    }
+    pthread_mutex_destroy(&w->deque.lock);
+    VM_FREE(w->deque.items);
+    free(w->buf);
+    mininez_dispose_runtime(w->r);
+  }
+  pthread_mutex_destroy(&pool.out_lock);
+  VM_FREE(pool.workers);
+  VM_FREE(order);
+  return out_error;
+}
+
+void mininez_batch_report(mininez_batch_result_t *result, FILE *fp) {
+  double sec = (double)result->elapsed_ns / 1000000000.0;
+  double mb = (double)result->bytes / (1024.0 * 1024.0);
+  fprintf(fp, "Files: %zu (success %zu, unconsume %zu, syntax error %zu, aborted %zu, io error %zu)\n",
+          result->files, result->success, result->unconsumed,
+          result->syntax_error, result->aborted, result->io_error);
+  fprintf(fp, "Bytes: %zu\n", result->bytes);
+  fprintf(fp, "ErapsedTime: %llu msec\n", (unsigned long long)(result->elapsed_ns / 1000000));
+  if (sec > 0) {
+    fprintf(fp, "Throughput: %.2f MB/s, %.1f files/s\n", mb / sec, (double)result->files / sec);
+  }
+}
+
+static int batch_compare_time(const void *a, const void *b) {
+  uint64_t ta = sort_target->files[*(const size_t *)a].parse_ns;
+  uint64_t tb = sort_target->files[*(const size_t *)b].parse_ns;
+  return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+void mininez_batch_latency_report(mininez_batch_t *b, mininez_batch_latency_t *latency, FILE *fp) {
+  mininez_histogram_report(&latency->time, "Parse time", 1000000.0, "msec", fp);
+  if (latency->error != 0) {
+    fprintf(fp, "Instructions: unavailable (%s)\n", strerror(latency->error));
+  } else {
+    mininez_histogram_report(&latency->instructions, "Instructions", 1000.0, "k", fp);
+  }
+
+  /* outliers: the slowest parses at or above p99 */
+  uint64_t p99 = mininez_histogram_percentile(&latency->time, 99);
+  size_t *order = (size_t *) VM_MALLOC(sizeof(size_t) * (b->size + 1));
+  size_t size = 0;
+  for (size_t i = 0; i < b->size; i++) {
+    if (b->files[i].parse_ns != 0 && b->files[i].parse_ns >= p99) {
+      order[size++] = i;
+    }
+  }
+  sort_target = b;
+  qsort(order, size, sizeof(size_t), batch_compare_time);
+  if (size > 0) {
+    fprintf(fp, "Slowest (p99 %.3f msec):\n", p99 / 1000000.0);
+  }
+  for (size_t k = 0; k < size && k < MININEZ_BATCH_OUTLIERS; k++) {
+    mininez_batch_file_t *file = &b->files[order[k]];
+    fprintf(fp, "  %.3f msec\t%zu bytes\t%.1f ns/byte", file->parse_ns / 1000000.0, file->size,
+            file->size == 0 ? 0.0 : (double)file->parse_ns / file->size);
+    if (latency->error == 0) {
+      fprintf(fp, "\t%llu instructions", (unsigned long long)file->instructions);
+    }
+    fprintf(fp, "\t%s\n", file->path);
+  }
+  VM_FREE(order);
+}
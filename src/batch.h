@@ -0,0 +1,68 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include "nezvm.h"
+#include "histogram.h"
+
+typedef struct mininez_batch_file_t {
+  char *path;
+  size_t size;
+  uint64_t parse_ns;     /* with latency recorded; 0 if it was not read */
+  uint64_t instructions;
+} mininez_batch_file_t;
+
+typedef struct mininez_batch_t {
+  mininez_batch_file_t *files;
+  size_t size;
+  size_t capacity;
+} mininez_batch_t;
+
+typedef struct mininez_batch_result_t {
+  size_t files;
+  size_t bytes;
+  size_t success;
+  size_t unconsumed;
+  size_t syntax_error;
+  size_t aborted;
+  size_t io_error;
+  uint64_t elapsed_ns;
+} mininez_batch_result_t;
+
+/* Per-document latency: the wall time of every parse (the file read and
+ * tree output left out) and the CPU instructions it ran (a perf counter per
+ * worker thread; none where the counter cannot be opened) */
+#define MININEZ_BATCH_OUTLIERS 10
+
+typedef struct mininez_batch_latency_t {
+  mininez_histogram_t time;
+  mininez_histogram_t instructions;
+  int error; /* errno of the instruction counter, 0 if counted */
+} mininez_batch_latency_t;
+
+/* Collect Input Files
+ *   <dir>       every regular file below the directory
+ *   @<list>     one path per line ("@-" reads stdin)
+ *   <pattern>   a glob(3) pattern
+ */
+mininez_batch_t *mininez_batch_create();
+int mininez_batch_collect(mininez_batch_t *b, const char *source);
+void mininez_batch_dispose(mininez_batch_t *b);
+
+/* Parse all files on a work-stealing pool of nthreads workers; latency is
+ * recorded when not NULL. The tree of every parsed file is written to out_fd
+ * in format (a mininez_output_format_t, -1 for none), one whole document at a
+ * time and led by the path of the file:
+ *   text    "# <path>" line, then the tree
+ *   json    {"file":<path>,"tree":<tree>} per line
+ *   binary  str(path) tree, as in output.h
+ * Returns -1 when the trees could not all be written */
+int mininez_batch_run(mininez_runtime_t *r, mininez_inst_t *inst,
+                      mininez_batch_t *b, int nthreads, int format, int out_fd,
+                      FILE *status, mininez_batch_latency_t *latency,
+                      mininez_batch_result_t *result);
+void mininez_batch_report(mininez_batch_result_t *result, FILE *fp);
+/* Percentiles, then the slowest files at or above p99 with their sizes */
+void mininez_batch_latency_report(mininez_batch_t *b, mininez_batch_latency_t *latency, FILE *fp);
+
+#endif
@@ -0,0 +1,830 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "loader.h"
+#include "program.h"
+#include "profile.h"
+#include "flat.h"
+#include "optimize.h"
+
+#ifndef MININEZ_BENCH_GRAMMARS
+#define MININEZ_BENCH_GRAMMARS "sample/bytecode"
+#endif
+
+/* Benchmark Suite
+ * Inputs are generated in memory from a fixed seed, so every run parses the
+ * same bytes. Each (grammar, shape, size) case is parsed warmup times, then
+ * timed for reps runs; results go to stdout as one JSON document.
+ * --dispatch runs every case under each dispatch of the VM (nezvm.h), and
+ * --opcodes times single instructions instead (bench_opcodes). --optimize
+ * also runs every case on the grammar after mininez_optimize, once it has
+ * checked that both programs parse the input the same (bench_equivalent),
+ * and checks every pass on a fixture first (bench_optimize_fixture).
+ */
+typedef struct bench_buf_t {
+  char *data;
+  size_t size;
+  size_t capacity;
+} bench_buf_t;
+
+static void bench_reserve(bench_buf_t *b, size_t n) {
+  if (b->size + n > b->capacity) {
+    while (b->size + n > b->capacity) {
+      b->capacity = b->capacity == 0 ? 4096 : b->capacity * 2;
+    }
+    b->data = (char *) realloc(b->data, b->capacity);
+  }
+}
+
+static void bench_puts(bench_buf_t *b, const char *s) {
+  size_t n = strlen(s);
+  bench_reserve(b, n);
+  memcpy(b->data + b->size, s, n);
+  b->size += n;
+}
+
+static void bench_putc(bench_buf_t *b, char c) {
+  bench_reserve(b, 1);
+  b->data[b->size++] = c;
+}
+
+static void bench_printf(bench_buf_t *b, const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  bench_puts(b, buf);
+}
+
+/* xorshift64* */
+static uint64_t bench_seed;
+/* length of a long string: a quarter of the input, from 64 bytes to 16 KB */
+static size_t bench_long;
+
+static uint64_t bench_random(uint64_t n) {
+  bench_seed ^= bench_seed >> 12;
+  bench_seed ^= bench_seed << 25;
+  bench_seed ^= bench_seed >> 27;
+  return (bench_seed * 0x2545F4914F6CDD1DULL) % n;
+}
+
+static void bench_word(bench_buf_t *b, size_t len) {
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+  bench_reserve(b, len);
+  for (size_t i = 0; i < len; i++) {
+    b->data[b->size++] = letters[bench_random(sizeof(letters) - 1)];
+  }
+}
+
+static void bench_spaces(bench_buf_t *b, const char *set, size_t max) {
+  size_t n = bench_random(max + 1);
+  for (size_t i = 0; i < n; i++) {
+    bench_putc(b, set[bench_random(strlen(set))]);
+  }
+}
+
+/* Shapes: every generator appends one item, at least one byte long */
+typedef void (*bench_item_f)(bench_buf_t *b);
+
+#define BENCH_DEPTH 64
+
+static void json_scalar(bench_buf_t *b) {
+  switch (bench_random(5)) {
+  case 0: bench_printf(b, "%llu", (unsigned long long)bench_random(1000000)); break;
+  case 1: bench_printf(b, "-%llu.%02llu", (unsigned long long)bench_random(1000), (unsigned long long)bench_random(100)); break;
+  case 2: bench_puts(b, "true"); break;
+  case 3: bench_puts(b, "null"); break;
+  default: bench_putc(b, '"'); bench_word(b, 1 + bench_random(12)); bench_putc(b, '"');
+  }
+}
+
+static void json_deep(bench_buf_t *b) {
+  int depth = 1 + (int)bench_random(BENCH_DEPTH);
+  for (int i = 0; i < depth; i++) {
+    bench_puts(b, i % 2 == 0 ? "{\"k\":" : "[");
+  }
+  json_scalar(b);
+  for (int i = depth - 1; i >= 0; i--) {
+    bench_puts(b, i % 2 == 0 ? "}" : "]");
+  }
+}
+
+static void json_wide(bench_buf_t *b) {
+  json_scalar(b);
+}
+
+static void json_string(bench_buf_t *b) {
+  size_t len = bench_long / 2 + bench_random(bench_long / 2);
+  bench_putc(b, '"');
+  while (len > 0) {
+    size_t n = 1 + bench_random(64);
+    n = n > len ? len : n;
+    bench_word(b, n);
+    len -= n;
+    bench_puts(b, bench_random(4) == 0 ? "\\\"" : " ");
+  }
+  bench_putc(b, '"');
+}
+
+static void json_whitespace(bench_buf_t *b) {
+  bench_puts(b, "{");
+  for (int i = 0; i < 4; i++) {
+    bench_spaces(b, " \t\r\n", 16);
+    bench_printf(b, "%s\"f%d\"", i == 0 ? "" : ",", i);
+    bench_spaces(b, " \t\n", 8);
+    bench_puts(b, ":");
+    bench_spaces(b, " \t\n", 8);
+    json_scalar(b);
+  }
+  bench_spaces(b, " \t\r\n", 16);
+  bench_puts(b, "}");
+}
+
+static void xml_deep(bench_buf_t *b) {
+  int depth = 1 + (int)bench_random(BENCH_DEPTH);
+  for (int i = 0; i < depth; i++) {
+    bench_printf(b, "<n d=\"%d\">", i);
+  }
+  bench_word(b, 1 + bench_random(8));
+  for (int i = 0; i < depth; i++) {
+    bench_puts(b, "</n>");
+  }
+}
+
+static void xml_wide(bench_buf_t *b) {
+  bench_printf(b, "<item id=\"%llu\" kind=\"", (unsigned long long)bench_random(1000000));
+  bench_word(b, 1 + bench_random(6));
+  bench_puts(b, "\">");
+  bench_word(b, 1 + bench_random(16));
+  bench_puts(b, "</item>");
+}
+
+static void xml_string(bench_buf_t *b) {
+  size_t len = bench_long / 2 + bench_random(bench_long / 2);
+  bench_puts(b, bench_random(4) == 0 ? "<c><![CDATA[" : "<p>");
+  size_t start = b->size;
+  while (b->size - start < len) {
+    bench_word(b, 1 + bench_random(12));
+    bench_putc(b, bench_random(8) == 0 ? '\n' : ' ');
+  }
+  bench_puts(b, b->data[start - 1] == '[' ? "]]></c>" : "</p>");
+}
+
+static void xml_whitespace(bench_buf_t *b) {
+  bench_puts(b, "\n");
+  bench_spaces(b, " \t", 16);
+  bench_puts(b, "<e");
+  for (int i = 0; i < 3; i++) {
+    bench_spaces(b, " \t\n", 8);
+    bench_printf(b, " a%d", i);
+    bench_spaces(b, " \t", 4);
+    bench_puts(b, "=");
+    bench_spaces(b, " \t", 4);
+    bench_printf(b, "\"%llu\"", (unsigned long long)bench_random(1000));
+  }
+  bench_spaces(b, " \t\n", 8);
+  bench_puts(b, "/>");
+  bench_spaces(b, " \t\r\n", 16);
+}
+
+static void math_value(bench_buf_t *b) {
+  if (bench_random(3) == 0) {
+    bench_word(b, 1 + bench_random(6));
+  } else {
+    bench_printf(b, "%llu", (unsigned long long)bench_random(100000));
+  }
+}
+
+static const char *math_op(void) {
+  static const char *ops[] = { "+", "-", "*", "/", "%" };
+  return ops[bench_random(5)];
+}
+
+static void math_deep(bench_buf_t *b) {
+  int depth = 1 + (int)bench_random(BENCH_DEPTH);
+  for (int i = 0; i < depth; i++) {
+    bench_putc(b, '(');
+  }
+  math_value(b);
+  for (int i = 0; i < depth; i++) {
+    bench_puts(b, math_op());
+    math_value(b);
+    bench_putc(b, ')');
+  }
+}
+
+static void math_wide(bench_buf_t *b) {
+  math_value(b);
+}
+
+static void math_string(bench_buf_t *b) {
+  bench_word(b, bench_long / 2 + bench_random(bench_long / 2));
+}
+
+static void math_whitespace(bench_buf_t *b) {
+  math_value(b);
+  bench_spaces(b, " \t", 16);
+}
+
+typedef struct bench_shape_t {
+  const char *name;
+  bench_item_f item;
+} bench_shape_t;
+
+/* math folds every operator into one left spine as long as the input, which
+ * the recursive tree release cannot free at these sizes: it is recognised */
+typedef struct bench_grammar_t {
+  const char *name;
+  const char *open;
+  const char *separator;
+  const char *close;
+  int recognize;
+  bench_shape_t shapes[4];
+} bench_grammar_t;
+
+static const bench_grammar_t bench_grammars[] = {
+  { "json", "[", ",", "]", 0,
+    { { "deep", json_deep }, { "wide", json_wide }, { "strings", json_string }, { "whitespace", json_whitespace } } },
+  { "xml-classic", "<root>", "", "</root>", 0,
+    { { "deep", xml_deep }, { "wide", xml_wide }, { "strings", xml_string }, { "whitespace", xml_whitespace } } },
+  { "math", "0", NULL, "", 1,
+    { { "deep", math_deep }, { "wide", math_wide }, { "strings", math_string }, { "whitespace", math_whitespace } } },
+};
+
+static void bench_generate(bench_buf_t *b, const bench_grammar_t *g, const bench_shape_t *s, size_t size) {
+  bench_seed = 0x9E3779B97F4A7C15ULL ^ size;
+  bench_long = size / 4 < 64 ? 64 : size / 4 > 16384 ? 16384 : size / 4;
+  b->size = 0;
+  bench_puts(b, g->open);
+  for (int first = 1; b->size + strlen(g->close) < size; first = 0) {
+    if (g->separator != NULL) {
+      bench_puts(b, first ? "" : g->separator);
+    } else {
+      bench_puts(b, math_op());
+    }
+    s->item(b);
+  }
+  bench_puts(b, g->close);
+  bench_reserve(b, 1);
+  b->data[b->size] = 0; /* the VM reads the terminator at the end */
+}
+
+static uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Sorts times; with an even count the median is the mean of the middle two */
+static uint64_t bench_median(uint64_t *times, int reps) {
+  qsort(times, reps, sizeof(uint64_t), bench_compare);
+  if (reps % 2 == 0) {
+    return times[reps / 2 - 1] + (times[reps / 2] - times[reps / 2 - 1]) / 2;
+  }
+  return times[reps / 2];
+}
+
+static uint64_t bench_instructions(mininez_runtime_t *r) {
+#if MININEZ_PROFILE
+  uint64_t total = 0;
+  for (int i = 0; i < MININEZ_PROFILE_OPCODES; i++) {
+    total += r->profile->counts[i];
+  }
+  return total;
+#else
+  return 0;
+#endif
+}
+
+/* The VM as built, and every dispatch of it */
+static const mininez_dispatch_variant_t bench_default[] = {
+  { NULL, mininez_parse_from, mininez_recognize_from },
+  { NULL, NULL, NULL }
+};
+
+static int bench_run(mininez_runtime_t *r, const mininez_dispatch_variant_t *v, mininez_inst_t *code,
+                     int recognize, const bench_buf_t *b) {
+  mininez_reset_runtime(r, (const unsigned char *)b->data, b->size);
+  mininez_init_vm(r->ctx);
+  r->ctx->pos = r->ctx->inputs;
+  int result = recognize ? v->recognize_from(r, code, mininez_code_start(code))
+                         : v->parse_from(r, code, mininez_code_start(code));
+  return result && (size_t)(r->ctx->pos - r->ctx->inputs) == b->size;
+}
+
+static int bench_same_tree(mininez_flat_tree_t *x, mininez_flat_tree_t *y) {
+  size_t n = x->size;
+  return x->size == y->size && x->root == y->root
+      && !memcmp(x->tags, y->tags, n * sizeof(uint32_t)) && !memcmp(x->starts, y->starts, n * sizeof(uint32_t))
+      && !memcmp(x->lens, y->lens, n * sizeof(uint32_t)) && !memcmp(x->firsts, y->firsts, n * sizeof(uint32_t))
+      && !memcmp(x->nexts, y->nexts, n * sizeof(uint32_t)) && !memcmp(x->labels, y->labels, n * sizeof(uint16_t));
+}
+
+/* The grammar as loaded (code) and optimized (opt) give the same result,
+ * stop at the same position and build the same tree */
+static int bench_equivalent(mininez_runtime_t *r, mininez_inst_t *code, mininez_inst_t *opt,
+                            int recognize, const bench_buf_t *b) {
+  mininez_runtime_t *f = mininez_fork_runtime(r, (const unsigned char *)b->data, b->size);
+  mininez_runtime_t *g = mininez_fork_runtime(r, (const unsigned char *)b->data, b->size);
+  int same;
+  if (recognize) {
+    mininez_init_vm(f->ctx);
+    mininez_init_vm(g->ctx);
+    f->ctx->pos = f->ctx->inputs;
+    g->ctx->pos = g->ctx->inputs;
+    same = mininez_recognize(f, code) == mininez_recognize(g, opt);
+  } else {
+    mininez_flat_tree_t x, y;
+    mininez_flat_init(&x);
+    mininez_flat_init(&y);
+    same = mininez_flat_parse(f, code, &x) == mininez_flat_parse(g, opt, &y) && bench_same_tree(&x, &y);
+    mininez_flat_dispose(&x);
+    mininez_flat_dispose(&y);
+  }
+  same = same && f->ctx->pos - f->ctx->inputs == g->ctx->pos - g->ctx->inputs;
+  mininez_dispose_runtime(f);
+  mininez_dispose_runtime(g);
+  return same;
+}
+
+static const char *bench_dispatch(const mininez_dispatch_variant_t *v) {
+  return v->name != NULL ? v->name : mininez_dispatch_name(MININEZ_DISPATCH);
+}
+
+/* Opcode Microbenchmarks
+ * Each instruction under test (X) runs once per iteration of
+ *   Alt E; L: Byte 'a'; X; Step; Jump L; E: Ret
+ * over N bytes of 'a', with X balanced so that the loop stays the same (Pos
+ * with Back, Call with a production that only returns, ...). Every case
+ * reports its time per iteration; the cost of X is the time over the loop
+ * without X, divided by N, and is left out as noise when it is within the
+ * spread of the loop's min and median. The programs are built with mininez_program_t on
+ * a sample grammar (json unless -g), whose sets, strings and productions
+ * they borrow; an instruction it has no operand for is left out.
+ */
+#define BENCH_OPCODE_MAX 4
+
+typedef struct bench_opcode_t {
+  const char *name;
+  uint8_t opcodes[BENCH_OPCODE_MAX];
+  int size;
+} bench_opcode_t;
+
+static const bench_opcode_t bench_opcode_cases[] = {
+  { "(loop)", { 0 }, 0 },
+  { "Jump", { Jump }, 1 },
+  { "Cov", { Cov }, 1 },
+  { "OByte", { OByte }, 1 },
+  { "NByte", { NByte }, 1 },
+  { "RByte", { RByte }, 1 },
+  { "OSet", { OSet }, 1 },
+  { "OStr", { OStr }, 1 },
+  { "Dispatch", { Dispatch }, 1 },
+  { "Pos+Back", { Pos, Back }, 2 },
+  { "Alt+Succ", { Alt, Succ }, 2 },
+  { "Call+Ret", { Call }, 1 },
+  { "TPush+TPop", { TPush, TPop }, 2 },
+};
+
+static mininez_insn_t *bench_emit(mininez_program_t *p, uint8_t opcode) {
+  mininez_insn_t *insn = &p->insns[p->size++];
+  memset(insn, 0, sizeof(*insn));
+  insn->opcode = opcode;
+  return insn;
+}
+
+/* Operands that leave the input alone: -1 where the grammar has none */
+static int bench_operand(mininez_runtime_t *r, uint8_t opcode) {
+  mininez_constant_t *C = r->C;
+  switch (opcode) {
+  case OSet:
+    for (uint16_t i = 0; i < C->set_size; i++) {
+      if (!bitset_get(&C->sets[i], 'a')) {
+        return i;
+      }
+    }
+    return -1;
+  case OStr:
+    for (uint16_t i = 0; i < C->str_size; i++) {
+      if (C->strs[i] != NULL && C->strs[i][0] != 'a') {
+        return i;
+      }
+    }
+    return -1;
+  case Dispatch: {
+    uint8_t *index = (uint8_t *) calloc(256, sizeof(uint8_t));
+    uint16_t *table = (uint16_t *) calloc(1, sizeof(uint16_t));
+    return mininez_add_table(C, index, table);
+  }
+  case Call:
+    return C->prod_size > 1 ? 1 : -1;
+  }
+  return 0;
+}
+
+static mininez_inst_t *bench_opcode_code(mininez_runtime_t *r, const bench_opcode_t *c) {
+  mininez_program_t p;
+  mininez_insn_t *insn;
+  uint64_t alt, loop, call = 0;
+  p.insns = (mininez_insn_t *) VM_MALLOC(sizeof(mininez_insn_t) * (BENCH_OPCODE_MAX + 10));
+  p.size = 0;
+  bench_emit(&p, Exit)->operand[0] = 0;
+  bench_emit(&p, Exit)->operand[0] = 1;
+  p.start = p.size;
+  bench_emit(&p, Nop);
+  alt = p.size;
+  bench_emit(&p, Alt);
+  loop = p.size;
+  bench_emit(&p, Byte)->operand[0] = 'a';
+  for (int i = 0; i < c->size; i++) {
+    int operand = bench_operand(r, c->opcodes[i]);
+    if (operand < 0) {
+      VM_FREE(p.insns);
+      return NULL;
+    }
+    insn = bench_emit(&p, c->opcodes[i]);
+    switch (insn->opcode) {
+    case Jump:
+      insn->target = p.size;
+      break;
+    case OByte: case NByte: case RByte:
+      insn->operand[0] = 'b';
+      continue;
+    case Alt:
+      insn->target = p.size + 1; /* past its Succ */
+      break;
+    case Call:
+      call = p.size - 1;
+      insn->ret = p.size;
+      break;
+    case Dispatch:
+      insn->case_size = 1;
+      insn->cases = (uint64_t *) VM_MALLOC(sizeof(uint64_t));
+      insn->cases[0] = p.size;
+      break;
+    }
+    *(uint16_t *)insn->operand = (uint16_t)operand;
+  }
+  bench_emit(&p, Step);
+  bench_emit(&p, Jump)->target = loop;
+  p.insns[alt].target = p.size;
+  bench_emit(&p, Ret);
+  /* production 1: Ret */
+  *(uint16_t *)bench_emit(&p, Nop)->operand = 1;
+  if (c->size != 0 && c->opcodes[0] == Call) {
+    p.insns[call].target = p.size;
+  }
+  bench_emit(&p, Ret);
+  mininez_inst_t *code = mininez_program_encode(&p, r);
+  mininez_program_dispose(&p);
+  return code;
+}
+
+static void bench_opcodes(const char *dir, const char *grammar, const mininez_dispatch_variant_t *variants,
+                          size_t n, int reps) {
+  char path[4096];
+  bench_buf_t b = { NULL, 0, 0 };
+  uint64_t *times = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * reps);
+  int first = 1;
+  snprintf(path, sizeof(path), "%s/%s.bin", dir, grammar);
+  mininez_runtime_t *r = mininez_create_runtime(NULL, 0);
+  mininez_inst_t *inst = mininez_load_code(r, path);
+  bench_reserve(&b, n + 64); /* pstring_starts_with may read 32 bytes ahead */
+  memset(b.data, 'a', n);
+  memset(b.data + n, 0, 64);
+  b.size = n;
+  for (const mininez_dispatch_variant_t *v = variants; v->parse_from != NULL; v++) {
+    uint64_t loop = 0, spread = 0;
+    for (size_t k = 0; k < sizeof(bench_opcode_cases) / sizeof(bench_opcode_cases[0]); k++) {
+      const bench_opcode_t *c = &bench_opcode_cases[k];
+      mininez_inst_t *code = bench_opcode_code(r, c);
+      int ok = 1;
+      if (code == NULL) {
+        continue;
+      }
+      ok &= bench_run(r, v, code, 0, &b);
+      for (int i = 0; i < reps; i++) {
+        uint64_t start = bench_now();
+        ok &= bench_run(r, v, code, 0, &b);
+        times[i] = bench_now() - start;
+      }
+      uint64_t median = bench_median(times, reps), best = times[0];
+      if (c->size == 0) {
+        loop = best;
+        spread = median - best;
+      }
+      int noise = c->size != 0 && best < loop + spread;
+      printf("%s\n{\"opcode\":\"%s\",\"dispatch\":\"%s\",\"iterations\":%zu,\"result\":\"%s\","
+             "\"min_ns\":%llu,\"median_ns\":%llu,\"ns_per_iteration\":%.3f,\"noise\":%s,\"ns_per_op\":",
+             first ? "" : ",", c->name, bench_dispatch(v), n, ok ? "success" : "failure",
+             (unsigned long long)best, (unsigned long long)median, (double)best / n, noise ? "true" : "false");
+      if (noise) {
+        printf("null}");
+      } else {
+        printf("%.3f}", c->size == 0 ? (double)best / n : (double)(best - loop) / n);
+      }
+      fflush(stdout);
+      mininez_dispose_instructions(code);
+      first = 0;
+    }
+  }
+  mininez_dispose_runtime(r);
+  mininez_dispose_instructions(inst);
+  VM_FREE(times);
+  VM_FREE(b.data);
+}
+
+/* Optimizer Fixture
+ * The sample grammars leave most passes of mininez_optimize with nothing to
+ * do, so --optimize first runs it on a production built to give each pass
+ * some work (on the json grammar's constants):
+ *       Nop                      header
+ *       TBegin 0
+ *       Alt A
+ *       Alt L                    choices: the body cannot fail
+ *       OByte 'x'
+ *       Succ
+ *   L:  Nop                      nops
+ *       Byte 'a'
+ *       Succ
+ *       Jump J                   threading: J is a Jump
+ *       Fail                     dead
+ *   J:  Jump T
+ *       Fail                     dead
+ *   T:  Byte 'b'                 tails: copied over the Jump to J
+ *       Jump B
+ *   A:  Fail
+ *   B:  TTag 0                   straight: entered by the Jump only
+ *       RByte 'z'
+ *       TEnd 0
+ *       Ret
+ * Every pass must fire, and both programs must parse the inputs the same.
+ */
+static const char *bench_fixture_inputs[] = { "abzzz", "ab", "axb", "b", "" };
+
+static mininez_inst_t *bench_fixture_code(mininez_runtime_t *r) {
+  mininez_program_t p;
+  uint64_t alt, choice, jump, chain, tail, jump_b;
+  p.insns = (mininez_insn_t *) VM_MALLOC(sizeof(mininez_insn_t) * 24);
+  p.size = 0;
+  bench_emit(&p, Exit)->operand[0] = 0;
+  bench_emit(&p, Exit)->operand[0] = 1;
+  p.start = p.size;
+  bench_emit(&p, Nop);
+  bench_emit(&p, TBegin);
+  alt = p.size;
+  bench_emit(&p, Alt);
+  choice = p.size;
+  bench_emit(&p, Alt);
+  bench_emit(&p, OByte)->operand[0] = 'x';
+  bench_emit(&p, Succ);
+  p.insns[choice].target = p.size;
+  bench_emit(&p, Nop);
+  bench_emit(&p, Byte)->operand[0] = 'a';
+  bench_emit(&p, Succ);
+  jump = p.size;
+  bench_emit(&p, Jump);
+  bench_emit(&p, Fail);
+  chain = p.size;
+  p.insns[jump].target = chain;
+  bench_emit(&p, Jump);
+  bench_emit(&p, Fail);
+  tail = p.size;
+  p.insns[chain].target = tail;
+  bench_emit(&p, Byte)->operand[0] = 'b';
+  jump_b = p.size;
+  bench_emit(&p, Jump);
+  p.insns[alt].target = p.size;
+  bench_emit(&p, Fail);
+  p.insns[jump_b].target = p.size;
+  bench_emit(&p, TTag);
+  bench_emit(&p, RByte)->operand[0] = 'z';
+  bench_emit(&p, TEnd);
+  bench_emit(&p, Ret);
+  mininez_inst_t *code = mininez_program_encode(&p, r);
+  mininez_program_dispose(&p);
+  return code;
+}
+
+/* Returns 0 when a pass did not fire or the programs differ */
+static int bench_optimize_fixture(const char *dir) {
+  char path[4096];
+  bench_buf_t b = { NULL, 0, 0 };
+  mininez_optimize_stats_t stats;
+  snprintf(path, sizeof(path), "%s/json.bin", dir);
+  mininez_runtime_t *r = mininez_create_runtime(NULL, 0);
+  mininez_inst_t *inst = mininez_load_code(r, path);
+  mininez_inst_t *code = bench_fixture_code(r);
+  mininez_inst_t *opt = mininez_optimize(r, code, &stats);
+  int ok = stats.choices > 0 && stats.nops > 0 && stats.threaded > 0 && stats.tails > 0
+        && stats.dead > 0 && stats.straight > 0;
+  for (size_t i = 0; i < sizeof(bench_fixture_inputs) / sizeof(bench_fixture_inputs[0]); i++) {
+    size_t len = strlen(bench_fixture_inputs[i]);
+    b.size = 0;
+    bench_reserve(&b, len + 64); /* pstring_starts_with may read 32 bytes ahead */
+    memcpy(b.data, bench_fixture_inputs[i], len);
+    memset(b.data + len, 0, 64);
+    b.size = len;
+    ok &= bench_equivalent(r, code, opt, 0, &b);
+  }
+  fprintf(stderr, "fixture: ");
+  mininez_optimize_report(&stats, stderr);
+  if (!ok) {
+    fprintf(stderr, "fixture: a pass did not fire or the optimized code parses differently\n");
+  }
+  mininez_dispose_instructions(opt);
+  mininez_dispose_instructions(code);
+  mininez_dispose_runtime(r);
+  mininez_dispose_instructions(inst);
+  VM_FREE(b.data);
+  return ok;
+}
+
+static size_t bench_size(const char *s) {
+  char *end;
+  double v = strtod(s, &end);
+  switch (*end) {
+  case 'k': case 'K': v *= 1024; break;
+  case 'm': case 'M': v *= 1024 * 1024; break;
+  case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+  }
+  return (size_t)v;
+}
+
+static void bench_usage(void) {
+  fprintf(stderr, "Usage: mininez-bench [options]\n");
+  fprintf(stderr, "  -d <dir>      Directory of the sample bytecode (default: " MININEZ_BENCH_GRAMMARS ")\n");
+  fprintf(stderr, "  -g <name>     Only this grammar (json, xml-classic, math)\n");
+  fprintf(stderr, "  -s <shape>    Only this shape (deep, wide, strings, whitespace)\n");
+  fprintf(stderr, "  --min-size <n> Smallest input (default: 1K)\n");
+  fprintf(stderr, "  --max-size <n> Largest input, up to 1G (default: 4M)\n");
+  fprintf(stderr, "  -w <n>        Warmup runs per case (default: 1)\n");
+  fprintf(stderr, "  -r <n>        Timed runs per case (default: 5)\n");
+  fprintf(stderr, "  --dispatch    Run every case under each dispatch of the VM\n");
+  fprintf(stderr, "  --opcodes <n> Time single instructions over n iterations instead (e.g. 4M)\n");
+  fprintf(stderr, "  --optimize    Run every case on the optimized grammar as well, checked against the original\n");
+  fprintf(stderr, "Sizes go up by 16x from 1K; results are printed as JSON on stdout.\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *const argv[]) {
+  const char *dir = MININEZ_BENCH_GRAMMARS;
+  const char *only_grammar = NULL;
+  const char *only_shape = NULL;
+  size_t min_size = 1024, max_size = 4 * 1024 * 1024;
+  int warmup = 1, reps = 5;
+  const mininez_dispatch_variant_t *variants = bench_default;
+  size_t opcodes = 0;
+  int optimize = 0;
+  int mismatches = 0;
+  static const struct option long_options[] = {
+    {"min-size", required_argument, NULL, 'm'},
+    {"max-size", required_argument, NULL, 'M'},
+    {"dispatch", no_argument, NULL, 'D'},
+    {"opcodes", required_argument, NULL, 'O'},
+    {"optimize", no_argument, NULL, 'Z'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "d:g:s:w:r:h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'd': dir = optarg; break;
+    case 'g': only_grammar = optarg; break;
+    case 's': only_shape = optarg; break;
+    case 'm': min_size = bench_size(optarg); break;
+    case 'M': max_size = bench_size(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'r': reps = atoi(optarg); break;
+    case 'D': variants = mininez_dispatch_variants; break;
+    case 'O': opcodes = bench_size(optarg); break;
+    case 'Z': optimize = 1; break;
+    default: bench_usage();
+    }
+  }
+  if (reps < 1 || warmup < 0 || min_size == 0) {
+    bench_usage();
+  }
+
+  printf("{\"suite\":\"mininez-bench\",\"profile\":%s,\"warmup\":%d,\"reps\":%d,\"results\":[",
+         MININEZ_PROFILE ? "true" : "false", warmup, reps);
+  fflush(stdout);
+  if (opcodes != 0) {
+    bench_opcodes(dir, only_grammar != NULL ? only_grammar : "json", variants, opcodes, reps);
+    printf("\n]}\n");
+    return 0;
+  }
+
+  if (optimize && !bench_optimize_fixture(dir)) {
+    mismatches++;
+  }
+  bench_buf_t b = { NULL, 0, 0 };
+  uint64_t *times = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * reps);
+  int first = 1;
+  for (size_t g = 0; g < sizeof(bench_grammars) / sizeof(bench_grammars[0]); g++) {
+    const bench_grammar_t *grammar = &bench_grammars[g];
+    char path[4096];
+    if (only_grammar != NULL && strcmp(only_grammar, grammar->name) != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s.bin", dir, grammar->name);
+    mininez_runtime_t *r = mininez_create_runtime(NULL, 0);
+    mininez_inst_t *inst = mininez_load_code(r, path);
+    mininez_inst_t *code = grammar->recognize ? mininez_strip_tree(r, inst) : inst;
+    mininez_inst_t *opt = NULL;
+    if (optimize) {
+      mininez_optimize_stats_t stats;
+      opt = mininez_optimize(r, code, &stats);
+      fprintf(stderr, "%s: ", grammar->name);
+      mininez_optimize_report(&stats, stderr);
+    }
+    for (int k = 0; k < 4; k++) {
+      const bench_shape_t *shape = &grammar->shapes[k];
+      if (only_shape != NULL && strcmp(only_shape, shape->name) != 0) {
+        continue;
+      }
+      for (size_t size = 1024; size <= max_size; size *= 16) {
+        if (size < min_size) {
+          continue;
+        }
+        bench_generate(&b, grammar, shape, size);
+        int equivalent = !optimize || bench_equivalent(r, code, opt, grammar->recognize, &b);
+        mismatches += !equivalent;
+        for (int optimized = 0; optimized <= optimize; optimized++) {
+          for (const mininez_dispatch_variant_t *v = variants; v->parse_from != NULL; v++) {
+            mininez_inst_t *run = optimized ? opt : code;
+            /* a fresh context per case, so that its peaks are the case's */
+            mininez_runtime_t *f = mininez_fork_runtime(r, NULL, 0);
+            int ok = 1;
+            for (int i = 0; i < warmup; i++) {
+              ok &= bench_run(f, v, run, grammar->recognize, &b);
+            }
+            uint64_t insns = bench_instructions(f);
+            size_t trees = mininez_tree_count();
+            for (int i = 0; i < reps; i++) {
+              uint64_t start = bench_now();
+              ok &= bench_run(f, v, run, grammar->recognize, &b);
+              times[i] = bench_now() - start;
+            }
+            insns = bench_instructions(f) - insns;
+            trees = mininez_tree_count() - trees;
+            uint64_t median = bench_median(times, reps);
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            printf("%s\n{\"grammar\":\"%s\",\"shape\":\"%s\",\"mode\":\"%s\",\"dispatch\":\"%s\",\"optimized\":%s,"
+                   "\"bytes\":%zu,\"result\":\"%s\",\"min_ns\":%llu,\"median_ns\":%llu,\"max_ns\":%llu,\"mb_per_s\":%.2f,"
+                   "\"ns_per_byte\":%.3f,",
+                   first ? "" : ",", grammar->name, shape->name, grammar->recognize ? "recognize" : "tree",
+                   bench_dispatch(v), optimized ? "true" : "false", b.size,
+                   optimized && !equivalent ? "mismatch" : ok ? "success" : "failure",
+                   (unsigned long long)times[0], (unsigned long long)median, (unsigned long long)times[reps - 1],
+                   median == 0 ? 0.0 : (b.size / 1048576.0) / (median / 1e9), (double)median / b.size);
+            if (MININEZ_PROFILE) {
+              printf("\"instructions_per_byte\":%.3f,", (double)insns / reps / b.size);
+            } else {
+              printf("\"instructions_per_byte\":null,");
+            }
+            printf("\"tree_allocations\":%zu,\"peak_rss_kb\":%ld,\"peak_bytes\":{", trees / reps, (long)ru.ru_maxrss);
+            MemoryUsage usage[MEMORY_KINDS];
+            mininez_memory(f, usage);
+            for (int i = 0; i < MEMORY_KINDS; i++) {
+              printf("%s\"", i == 0 ? "" : ",");
+              for (const char *p = mininez_memory_name((MemoryKind)i); *p != 0; p++) {
+                putchar(*p == ' ' ? '_' : *p);
+              }
+              printf("\":%zu", usage[i].peak);
+            }
+            printf("}}");
+            fflush(stdout);
+            mininez_dispose_runtime(f);
+            first = 0;
+          }
+        }
+      }
+    }
+    if (code != inst) {
+      mininez_dispose_instructions(code);
+    }
+    if (optimize) {
+      mininez_dispose_instructions(opt);
+    }
+    mininez_dispose_runtime(r);
+    mininez_dispose_instructions(inst);
+  }
+  printf("\n]}\n");
+  VM_FREE(times);
+  VM_FREE(b.data);
+  return mismatches == 0 ? 0 : 1;
+}
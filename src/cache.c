@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "pstring.h"
+#include "cache.h"
+
+#define CACHE_BYTE_ORDER 0x01020304
+#define CACHE_SUFFIX ".mnzc"
+
+#define HASH_K1 0x9E3779B97F4A7C15ULL
+#define HASH_K2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t hash_rotl(uint64_t v, int n) {
+  return (v << n) | (v >> (64 - n));
+}
+
+static inline uint64_t hash_word(uint64_t h, uint64_t v) {
+  v *= HASH_K2;
+  v = hash_rotl(v, 31);
+  v *= HASH_K1;
+  h ^= v;
+  return hash_rotl(h, 27) * HASH_K1 + HASH_K2;
+}
+
+/* 64-bit content hash, eight bytes per step */
+uint64_t mininez_hash(const void *p, size_t len, uint64_t seed) {
+  const unsigned char *s = (const unsigned char *)p;
+  uint64_t h = seed ^ (len * HASH_K1);
+  uint64_t v;
+  for (; len >= 8; s += 8, len -= 8) {
+    memcpy(&v, s, 8);
+    h = hash_word(h, v);
+  }
+  v = 0;
+  memcpy(&v, s, len);
+  h = hash_word(h, v);
+  h ^= h >> 33;
+  h *= HASH_K2;
+  h ^= h >> 29;
+  return h;
+}
+
+static uint64_t hash_strings(uint64_t h, const char **strs, uint16_t size) {
+  for (uint16_t i = 0; i < size; i++) {
+    h = strs[i] == NULL ? hash_word(h, 0) : mininez_hash(strs[i], pstring_length(strs[i]), h);
+  }
+  return h;
+}
+
+uint64_t mininez_grammar_hash(mininez_runtime_t *r, mininez_inst_t *inst) {
+  mininez_constant_t *C = r->C;
+  uint64_t h = mininez_hash(inst, mininez_code_size(r, inst), mininez_code_start(inst));
+  h = mininez_hash(C->sets, sizeof(bitset_t) * C->set_size, h);
+  h = hash_strings(h, C->strs, C->str_size);
+  h = hash_strings(h, C->tags, C->tag_size);
+  for (uint16_t i = 0; i < C->table_size; i++) {
+    h = mininez_hash(C->jump_indexs[i], 256, h);
+    h = mininez_hash(C->jump_tables[i], sizeof(uint16_t) * mininez_table_length(C->jump_indexs[i]), h);
+  }
+  return h;
+}
+
+void mininez_cache_init(mininez_cache_t *c, const char *dir, size_t limit, mininez_runtime_t *r, mininez_inst_t *inst) {
+  c->dir = dir;
+  c->limit = limit;
+  c->grammar_hash = mininez_grammar_hash(r, inst);
+  mkdir(dir, 0755);
+}
+
+static void cache_path(mininez_cache_t *c, uint64_t input_hash, char *buf, size_t size) {
+  snprintf(buf, size, "%s/%016llx-%016llx" CACHE_SUFFIX, c->dir,
+           (unsigned long long)c->grammar_hash, (unsigned long long)input_hash);
+}
+
+/* n items of width bytes at offset lie within a file of size bytes */
+static int cache_fits(uint64_t offset, uint64_t n, uint64_t width, uint64_t size) {
+  return offset <= size && offset % sizeof(uint32_t) == 0 && n <= (size - offset) / width;
+}
+
+/* Every section, symbol and node reference of a mapped entry lies within the
+ * file and the input; anything else is a stale or damaged entry */
+static int cache_valid(const char *base, uint64_t size, size_t len) {
+  const mininez_cache_header_t *h = (const mininez_cache_header_t *)base;
+  if (h->size == 0 || h->root >= h->size
+      || !cache_fits(h->node_offset, h->size, 5 * sizeof(uint32_t) + sizeof(uint16_t), size)
+      || !cache_fits(h->symbol_offset, h->symbol_size, sizeof(uint64_t), size)
+      || h->symbol_offset % sizeof(uint64_t) != 0) {
+    return 0;
+  }
+  const uint64_t *offsets = (const uint64_t *)(base + h->symbol_offset);
+  for (uint32_t i = 0; i < h->symbol_size; i++) {
+    if (offsets[i] != 0 && (offsets[i] >= size || memchr(base + offsets[i], 0, size - offsets[i]) == NULL)) {
+      return 0;
+    }
+  }
+  uint32_t n = h->size;
+  const uint32_t *tags = (const uint32_t *)(base + h->node_offset);
+  const uint32_t *starts = tags + n, *lens = starts + n, *firsts = lens + n, *nexts = firsts + n;
+  const uint16_t *labels = (const uint16_t *)(nexts + n);
+  for (uint32_t i = 0; i < n; i++) {
+    int symbol = (lens[i] & MININEZ_FLAT_SYMBOL) != 0;
+    if (tags[i] >= h->symbol_size || labels[i] >= h->symbol_size || firsts[i] >= n || nexts[i] >= n
+        || (symbol ? starts[i] >= h->symbol_size : starts[i] > len || lens[i] > len - starts[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int mininez_cache_load(mininez_cache_t *c, const unsigned char *text, size_t len, mininez_flat_tree_t *t) {
+  char path[4096];
+  struct stat st;
+  uint64_t input_hash = mininez_hash(text, len, 0);
+  cache_path(c, input_hash, path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(mininez_cache_header_t)) {
+    close(fd);
+    return 0;
+  }
+  char *base = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  mininez_cache_header_t *h = (mininez_cache_header_t *)base;
+  if (memcmp(h->magic, MININEZ_CACHE_MAGIC, sizeof(h->magic)) != 0
+      || h->version != MININEZ_CACHE_VERSION
+      || h->byte_order != CACHE_BYTE_ORDER
+      || h->grammar_hash != c->grammar_hash
+      || h->input_hash != input_hash
+      || h->input_length != len
+      || h->file_size != (uint64_t)st.st_size
+      || !cache_valid(base, st.st_size, len)) {
+    munmap(base, st.st_size);
+    close(fd);
+    return 0;
+  }
+  /* a hit makes the entry the most recently used */
+  futimens(fd, NULL);
+  close(fd);
+
+  uint32_t size = h->size;
+  t->block = base;
+  t->mapped = st.st_size;
+  t->tags = (uint32_t *)(base + h->node_offset);
+  t->starts = t->tags + size;
+  t->lens = t->starts + size;
+  t->firsts = t->lens + size;
+  t->nexts = t->firsts + size;
+  t->labels = (uint16_t *)(t->nexts + size);
+  t->size = t->capacity = size;
+  t->root = h->root;
+  t->inputs = text;
+  t->length = len;
+  t->symbol_size = t->symbol_capacity = h->symbol_size;
+  t->symbols = (const char **) VM_MALLOC(sizeof(const char *) * (h->symbol_size + 1));
+  uint64_t *offsets = (uint64_t *)(base + h->symbol_offset);
+  for (uint32_t i = 0; i < h->symbol_size; i++) {
+    t->symbols[i] = offsets[i] == 0 ? NULL : base + offsets[i];
+  }
+  t->symbol_keys = NULL;
+  t->symbol_ids = NULL;
+  t->symbol_hash_size = 0;
+  t->last_child = 0;
+  return 1;
+}
+
+typedef struct cache_entry_t {
+  char *path;
+  off_t size;
+  struct timespec mtime;
+} cache_entry_t;
+
+static int cache_entry_compare(const void *a, const void *b) {
+  const cache_entry_t *x = (const cache_entry_t *)a;
+  const cache_entry_t *y = (const cache_entry_t *)b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec) {
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  }
+  return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+/* Removes the least recently used entries until the directory fits */
+static void cache_evict(mininez_cache_t *c) {
+  DIR *d = opendir(c->dir);
+  struct dirent *e;
+  cache_entry_t *entries = NULL;
+  size_t size = 0, capacity = 0;
+  size_t total = 0;
+  if (d == NULL) {
+    return;
+  }
+  while ((e = readdir(d)) != NULL) {
+    size_t n = strlen(e->d_name);
+    struct stat st;
+    char path[4096];
+    if (n < sizeof(CACHE_SUFFIX) || strcmp(e->d_name + n - (sizeof(CACHE_SUFFIX) - 1), CACHE_SUFFIX) != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", c->dir, e->d_name);
+    if (stat(path, &st) < 0) {
+      continue;
+    }
+    if (size == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      entries = (cache_entry_t *) realloc(entries, sizeof(cache_entry_t) * capacity);
+    }
+    entries[size].path = strdup(path);
+    entries[size].size = st.st_size;
+    entries[size].mtime = st.st_mtim;
+    total += st.st_size;
+    size++;
+  }
+  closedir(d);
+  qsort(entries, size, sizeof(cache_entry_t), cache_entry_compare);
+  for (size_t i = 0; i < size; i++) {
+    if (total > c->limit && unlink(entries[i].path) == 0) {
+      total -= entries[i].size;
+    }
+    free(entries[i].path);
+  }
+  free(entries);
+}
+
+static int cache_write(int fd, const void *p, size_t len) {
+  const char *s = (const char *)p;
+  while (len > 0) {
+    ssize_t n = write(fd, s, len);
+    if (n <= 0) {
+      return -1;
+    }
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int mininez_cache_store(mininez_cache_t *c, mininez_flat_tree_t *t) {
+  static const char zeros[8] = { 0 };
+  mininez_cache_header_t h;
+  char path[4096], tmp[4096 + 32];
+  size_t nodes = sizeof(uint32_t) * 5 * t->size + sizeof(uint16_t) * t->size;
+  size_t pad = (8 - nodes % 8) % 8;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MININEZ_CACHE_MAGIC, sizeof(h.magic));
+  h.version = MININEZ_CACHE_VERSION;
+  h.byte_order = CACHE_BYTE_ORDER;
+  h.grammar_hash = c->grammar_hash;
+  h.input_hash = mininez_hash(t->inputs, t->length, 0);
+  h.input_length = t->length;
+  h.size = t->size;
+  h.root = t->root;
+  h.symbol_size = t->symbol_size;
+  h.node_offset = sizeof(h);
+  h.symbol_offset = h.node_offset + nodes + pad;
+  uint64_t *offsets = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (t->symbol_size + 1));
+  uint64_t pos = h.symbol_offset + sizeof(uint64_t) * t->symbol_size;
+  for (uint32_t i = 0; i < t->symbol_size; i++) {
+    offsets[i] = t->symbols[i] == NULL ? 0 : pos;
+    if (t->symbols[i] != NULL) {
+      pos += pstring_length(t->symbols[i]) + 1;
+    }
+  }
+  h.file_size = pos;
+
+  cache_path(c, h.input_hash, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    VM_FREE(offsets);
+    return -1;
+  }
+  int failed = cache_write(fd, &h, sizeof(h))
+    || cache_write(fd, t->tags, sizeof(uint32_t) * t->size)
+    || cache_write(fd, t->starts, sizeof(uint32_t) * t->size)
+    || cache_write(fd, t->lens, sizeof(uint32_t) * t->size)
+    || cache_write(fd, t->firsts, sizeof(uint32_t) * t->size)
+    || cache_write(fd, t->nexts, sizeof(uint32_t) * t->size)
+    || cache_write(fd, t->labels, sizeof(uint16_t) * t->size)
+    || cache_write(fd, zeros, pad)
+    || cache_write(fd, offsets, sizeof(uint64_t) * t->symbol_size);
+  for (uint32_t i = 0; i < t->symbol_size && !failed; i++) {
+    if (t->symbols[i] != NULL) {
+      failed = cache_write(fd, t->symbols[i], pstring_length(t->symbols[i]) + 1);
+    }
+  }
+  VM_FREE(offsets);
+  failed = close(fd) != 0 || failed;
+  /* readers only ever see complete files */
+  if (failed || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  cache_evict(c);
+  return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "nezvm.h"
+#include "flat.h"
+
+#define MININEZ_CACHE_MAGIC   "MININEZC"
+#define MININEZ_CACHE_VERSION 2
+#define MININEZ_CACHE_DEFAULT_LIMIT (256 * 1024 * 1024)
+
+/* Parse Cache
+ * Flat trees of accepted inputs are kept in a directory, one file per
+ * (grammar hash, input hash) pair. Files hold offsets only and are mapped
+ * read-only on a hit. Once the directory grows over its limit, the least
+ * recently used files (by mtime, refreshed on every hit) are removed.
+ *
+ *   header | tags | starts | lens | firsts | nexts | labels | symbols
+ */
+typedef struct mininez_cache_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t grammar_hash;
+  uint64_t input_hash;
+  uint64_t input_length;
+  uint32_t size;         /* nodes, including node 0 */
+  uint32_t root;
+  uint32_t symbol_size;
+  uint32_t reserved;
+  uint64_t node_offset;
+  uint64_t symbol_offset; /* uint64_t offsets of NUL terminated strings */
+  uint64_t file_size;
+} mininez_cache_header_t;
+
+typedef struct mininez_cache_t {
+  const char *dir;
+  size_t limit;
+  uint64_t grammar_hash;
+} mininez_cache_t;
+
+uint64_t mininez_hash(const void *p, size_t len, uint64_t seed);
+uint64_t mininez_grammar_hash(mininez_runtime_t *r, mininez_inst_t *inst);
+
+void mininez_cache_init(mininez_cache_t *c, const char *dir, size_t limit, mininez_runtime_t *r, mininez_inst_t *inst);
+/* Returns 1 and fills t (mapped) on a hit */
+int mininez_cache_load(mininez_cache_t *c, const unsigned char *text, size_t len, mininez_flat_tree_t *t);
+/* Stores t and evicts old entries; returns 0 on success */
+int mininez_cache_store(mininez_cache_t *c, mininez_flat_tree_t *t);
+
+#endif
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include "trace.h"
+
 struct Tree;
 struct TreeLog;
 struct MemoEntry;
@@ -13,6 +15,29 @@ struct MemoEntry;
 // typedef unsigned long int symbol_t;
 typedef char* symbol_t;
 
+/* Memory accounting
+ * A context counts the bytes each of its structures holds, the most they
+ * ever held, and the allocations made for them. Trees are counted by the
+ * default tree functions. The constant pool and the input are not the
+ * context's to allocate; the runtime fills them in (mininez_memory).
+ */
+typedef enum MemoryKind {
+  MEMORY_STACK,
+  MEMORY_LOG,
+  MEMORY_MEMO,
+  MEMORY_SYMBOL,
+  MEMORY_TREE,
+  MEMORY_CONSTANT,
+  MEMORY_INPUT,
+  MEMORY_KINDS
+} MemoryKind;
+
+typedef struct MemoryUsage {
+  size_t current;
+  size_t peak;
+  size_t allocs;
+} MemoryUsage;
+
 typedef struct ParserContext {
   const unsigned char  *inputs;
   size_t length;
@@ -42,6 +67,8 @@ typedef struct ParserContext {
   void* (*fnew)(symbol_t, const unsigned char *, size_t, size_t, void *);
   void (*fsub)(void *, size_t, symbol_t, void *, void *);
   void (*fgc)(void *, int, void*);
+  // Memory
+  MemoryUsage memory[MEMORY_KINDS];
 } ParserContext;
 
 #ifdef CNEZ_NOGC
@@ -71,7 +98,14 @@ typedef struct TreeLog {
 
 static const char* ops[5] = {"link", "tag", "value", "new"};
 
-static size_t cnez_used = 0;
+/* allocation counters are per thread so that runtimes may live on workers */
+#if defined(_MSC_VER)
+#define CNEZ_TLS __declspec(thread)
+#else
+#define CNEZ_TLS __thread
+#endif
+
+static CNEZ_TLS size_t cnez_used = 0;
 
 static void *_malloc(size_t t)
 {
@@ -94,6 +128,38 @@ static void _free(void *p)
   free(d-1);
 }
 
+static void ParserContext_account(ParserContext *c, MemoryKind kind, size_t add, size_t sub)
+{
+  MemoryUsage *m = c->memory + kind;
+  m->current = m->current + add - sub;
+  if(m->current > m->peak) {
+    m->peak = m->current;
+  }
+  m->allocs += add > 0;
+}
+
+/* The input is the caller's; it is counted by length, without allocations */
+static void ParserContext_accountInput(ParserContext *c, size_t len)
+{
+  MemoryUsage *m = c->memory + MEMORY_INPUT;
+  m->current = len;
+  if(len > m->peak) {
+    m->peak = len;
+  }
+}
+
+static void *ParserContext_alloc(ParserContext *c, MemoryKind kind, size_t items, size_t size)
+{
+  ParserContext_account(c, kind, items * size, 0);
+  return _calloc(items, size);
+}
+
+static void ParserContext_release(ParserContext *c, MemoryKind kind, void *p)
+{
+  ParserContext_account(c, kind, 0, ((size_t*)p)[-1]);
+  _free(p);
+}
+
 // stack
 
 typedef struct Wstack {
@@ -104,11 +170,12 @@ typedef struct Wstack {
 
 static Wstack *unusedStack(ParserContext *c)
 {
-  if (c->stack_size == c->unused_stack) {
-    Wstack *newstack = (Wstack *)_calloc(c->stack_size * 2, sizeof(struct Wstack));
-    memcpy(newstack, c->stacks, sizeof(struct Wstack) * c->stack_size);
-    _free(c->stacks);
-    c->stacks = newstack;
+  if (c->stack_size == c->unused_stack + 1) {
+    Wstack *newstack = (Wstack *)ParserContext_alloc(c, MEMORY_STACK, c->stack_size * 2, sizeof(struct Wstack));
+    Wstack *oldstack = c->stacks;
+    memcpy(newstack, oldstack, sizeof(struct Wstack) * c->stack_size);
+    c->stacks = newstack; /* before the release: sample.h reads stacks from a signal handler */
+    ParserContext_release(c, MEMORY_STACK, oldstack);
     c->stack_size *= 2;
   }
   c->unused_stack++;
@@ -171,44 +238,51 @@ typedef struct Tree {
   struct Tree  **childs;
 } Tree;
 
-static size_t t_used = 0;
-static size_t t_newcount = 0;
-static size_t t_gccount = 0;
+static CNEZ_TLS size_t t_used = 0;
+static CNEZ_TLS size_t t_newcount = 0;
+static CNEZ_TLS size_t t_gccount = 0;
 
-static void *tree_malloc(size_t t)
+/* thunk is the context of the default tree functions (NULL: none) */
+static void *tree_malloc(size_t t, void *thunk)
 {
   size_t *d = (size_t*)malloc(sizeof(size_t) + t);
   t_used += t;
   d[0] = t;
+  if(thunk != NULL) {
+    ParserContext_account((ParserContext*)thunk, MEMORY_TREE, t, 0);
+  }
   return (void*)(d+1);
 }
 
-static void *tree_calloc(size_t items, size_t size)
+static void *tree_calloc(size_t items, size_t size, void *thunk)
 {
-  void *d = tree_malloc(items * size);
+  void *d = tree_malloc(items * size, thunk);
   memset(d, 0, items * size);
   return d;
 }
 
-static void tree_free(void *p)
+static void tree_free(void *p, void *thunk)
 {
   size_t *d = (size_t*)p;
   t_used -= d[-1];
+  if(thunk != NULL) {
+    ParserContext_account((ParserContext*)thunk, MEMORY_TREE, 0, d[-1]);
+  }
   free(d-1);
 }
 
 static
 void *NEW(symbol_t tag, const unsigned char *text, size_t len, size_t n, void *thunk)
 {
-  Tree *t = (Tree*)tree_malloc(sizeof(struct Tree));
+  Tree *t = (Tree*)tree_malloc(sizeof(struct Tree), thunk);
   t->refc = 0;
   t->tag = tag;
   t->text = text;
   t->len = len;
   t->size = n;
   if(n > 0) {
-    t->labels = (symbol_t*)tree_calloc(n, sizeof(symbol_t));
-    t->childs = (struct Tree**)tree_calloc(n, sizeof(struct Tree*));
+    t->labels = (symbol_t*)tree_calloc(n, sizeof(symbol_t), thunk);
+    t->childs = (struct Tree**)tree_calloc(n, sizeof(struct Tree*), thunk);
   }
   else {
     t->labels = NULL;
@@ -231,10 +305,10 @@ void GC(void *parent, int c, void *thunk)
     for(i = 0; i < t->size; i++) {
       GC(t->childs[i], -1, thunk);
     }
-    tree_free(t->labels);
-    tree_free(t->childs);
+    tree_free(t->labels, thunk);
+    tree_free(t->childs, thunk);
   }
-  tree_free(t);
+  tree_free(t, thunk);
 #else
   if(c == 1) {
     t->refc++;
@@ -247,10 +321,10 @@ void GC(void *parent, int c, void *thunk)
       for(i = 0; i < t->size; i++) {
         GC(t->childs[i], -1, thunk);
       }
-      tree_free(t->labels);
-      tree_free(t->childs);
+      tree_free(t->labels, thunk);
+      tree_free(t->childs, thunk);
     }
-    tree_free(t);
+    tree_free(t, thunk);
     t_gccount++;
   }
 #endif
@@ -305,10 +379,10 @@ static void ParserContext_initTreeFunc(ParserContext *c,
     c->fgc  = fgc;
   }
   else {
-    c->thunk = c;
     c->fnew = NEW;
     c->fsub = LINK;
     c->fgc  = GC;
+    thunk = NULL; /* NEW and GC account to c */
   }
   c->thunk = thunk == NULL ? c : thunk;
 }
@@ -346,13 +420,14 @@ static ParserContext *ParserContext_new(const unsigned char *text, size_t len)
   c->length = len;
   c->pos = text;
   c->left = NULL;
+  ParserContext_accountInput(c, len);
   // tree
   c->log_size = 64;
-  c->logs = (struct TreeLog*) _calloc(c->log_size, sizeof(struct TreeLog));
+  c->logs = (struct TreeLog*) ParserContext_alloc(c, MEMORY_LOG, c->log_size, sizeof(struct TreeLog));
   c->unused_log = 0;
   // stack
   c->stack_size = 64;
-  c->stacks = (struct Wstack*) _calloc(c->stack_size, sizeof(struct Wstack));
+  c->stacks = (struct Wstack*) ParserContext_alloc(c, MEMORY_STACK, c->stack_size, sizeof(struct Wstack));
   c->unused_stack = 0;
   c->fail_stack   = 0;
   // symbol table
@@ -532,9 +607,9 @@ static
 void _log(ParserContext *c, int op, void *value, struct Tree *tree)
 {
   if(!(c->unused_log < c->log_size)) {
-    TreeLog *newlogs = (TreeLog *)_calloc(c->log_size * 2, sizeof(TreeLog));
+    TreeLog *newlogs = (TreeLog *)ParserContext_alloc(c, MEMORY_LOG, c->log_size * 2, sizeof(TreeLog));
     memcpy(newlogs, c->logs, c->log_size * sizeof(TreeLog));
-    _free(c->logs);
+    ParserContext_release(c, MEMORY_LOG, c->logs);
     c->logs = newlogs;
     c->log_size *= 2;
   }
@@ -645,6 +720,7 @@ static void ParserContext_endTree(ParserContext *c, int shift, symbol_t tag, con
     len = ((c->pos + shift) - text);
   }
   Tree *t = c->fnew(tag, text, len, objectSize, c->thunk);
+  MININEZ_TRACE4(tree__new, tag, text - c->inputs, len, objectSize);
 
   GCSET(c, c->left, t);
   c->left = t;
@@ -695,10 +771,10 @@ static
 void _push(ParserContext *c, symbol_t table, const unsigned char * utf8, size_t length)
 {
   if (!(c->tableSize < c->tableMax)) {
-    SymbolTableEntry* newtable = (SymbolTableEntry*)_calloc(sizeof(SymbolTableEntry), (c->tableMax + 256));
+    SymbolTableEntry* newtable = (SymbolTableEntry*)ParserContext_alloc(c, MEMORY_SYMBOL, sizeof(SymbolTableEntry), (c->tableMax + 256));
     if(c->tables != NULL) {
       memcpy(newtable, c->tables, sizeof(SymbolTableEntry) * (c->tableMax));
-      _free(c->tables);
+      ParserContext_release(c, MEMORY_SYMBOL, c->tables);
     }
     c->tables = newtable;
     c->tableMax += 256;
@@ -857,7 +933,7 @@ void ParserContext_initMemo(ParserContext *c, int w, int n)
 {
   int i;
   c->memoSize = w * n + 1;
-  c->memoArray = (MemoEntry *)_calloc(sizeof(MemoEntry), c->memoSize);
+  c->memoArray = (MemoEntry *)ParserContext_alloc(c, MEMORY_MEMO, sizeof(MemoEntry), c->memoSize);
   for (i = 0; i < c->memoSize; i++) {
     c->memoArray[i].key = -1LL;
   }
@@ -867,6 +943,13 @@ static uniquekey_t longkey( uniquekey_t pos, int memoPoint) {
   return ((pos << 12) | memoPoint);
 }
 
+/* The slot a (position, memo point) pair hashes to */
+static inline MemoEntry *ParserContext_memoSlot(ParserContext *c, int memoPoint, const unsigned char *pos, uniquekey_t *key)
+{
+  *key = longkey((pos - c->inputs), memoPoint);
+  return c->memoArray + (unsigned int) (*key % c->memoSize);
+}
+
 static
 int ParserContext_memoLookup(ParserContext *c, int memoPoint)
 {
@@ -1006,25 +1089,55 @@ static void ParserContext_free(ParserContext *c)
       GCDEC(c, c->memoArray[i].memoTree);
       c->memoArray[i].memoTree = NULL;
     }
-    _free(c->memoArray);
+    ParserContext_release(c, MEMORY_MEMO, c->memoArray);
     c->memoArray = NULL;
   }
   if(c->tables != NULL) {
-    _free(c->tables);
+    ParserContext_release(c, MEMORY_SYMBOL, c->tables);
     c->tables = NULL;
   }
   ParserContext_backLog(c, 0);
-  _free(c->logs);
+  ParserContext_release(c, MEMORY_LOG, c->logs);
   c->logs = NULL;
   for(i = 0; i < c->stack_size; i++) {
     GCDEC(c, c->stacks[i].tree);
     c->stacks[i].tree = NULL;
   }
-  _free(c->stacks);
+  ParserContext_release(c, MEMORY_STACK, c->stacks);
   c->stacks = NULL;
+  GCDEC(c, c->left);
+  c->left = NULL;
   _free(c);
 }
 
+/* Rewind a context to parse another input without reallocating its tables */
+static void ParserContext_reset(ParserContext *c, const unsigned char *text, size_t len)
+{
+  size_t i;
+  for(i = 0; i < c->memoSize; i++) {
+    GCDEC(c, c->memoArray[i].memoTree);
+    c->memoArray[i].memoTree = NULL;
+    c->memoArray[i].key = -1LL;
+  }
+  ParserContext_backLog(c, 0);
+  for(i = 0; i < c->stack_size; i++) {
+    GCDEC(c, c->stacks[i].tree);
+    c->stacks[i].tree = NULL;
+  }
+  c->unused_stack = 0;
+  c->fail_stack   = 0;
+  GCDEC(c, c->left);
+  c->left = NULL;
+  c->tableSize = 0;
+  c->stateValue = 0;
+  c->stateCount = 0;
+  c->count = 0;
+  c->inputs = text;
+  c->length = len;
+  c->pos = text;
+  ParserContext_accountInput(c, len);
+}
+
 //----------------------------------------------------------------------------
 
 static inline int ParserContext_bitis(ParserContext *c, int *bits, size_t n)
@@ -0,0 +1,380 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "nezvm.h"
+#include "flat.h"
+#include "project.h"
+
+/* set on the tag of a node once it has a parent (build time only) */
+#define FLAT_LINKED 0x80000000U
+
+#define FLAT_NODE(P) ((mininez_node_t)(uintptr_t)(P))
+#define FLAT_HANDLE(N) ((void *)(uintptr_t)(N))
+
+/* Under a projection, a leaf that is not wanted gets no node; its handle
+ * carries the text span instead, in case a condition looks at it. */
+#if UINTPTR_MAX > 0xffffffffU
+#define FLAT_LEAF_BIT ((uintptr_t)1 << 63)
+#define FLAT_IS_LEAF(P) (((uintptr_t)(P) & FLAT_LEAF_BIT) != 0)
+#define FLAT_LEAF(S, L) ((void *)(FLAT_LEAF_BIT | ((uintptr_t)(S) << 31) | (uintptr_t)(L)))
+#define FLAT_LEAF_START(P) ((uint32_t)(((uintptr_t)(P) >> 31) & 0x7fffffff))
+#define FLAT_LEAF_LEN(P) ((uint32_t)((uintptr_t)(P) & 0x7fffffff))
+#define FLAT_LEAF_MAX 0x7fffffffU
+#else
+#define FLAT_IS_LEAF(P) 0
+#define FLAT_LEAF_START(P) 0
+#define FLAT_LEAF_LEN(P) 0
+#endif
+
+static void flat_alloc(mininez_flat_tree_t *t, uint32_t capacity) {
+  size_t words = (size_t)capacity * 5;
+  char *block = (char *) VM_MALLOC(sizeof(uint32_t) * words + sizeof(uint16_t) * capacity);
+  t->block = block;
+  t->tags = (uint32_t *)block;
+  t->starts = t->tags + capacity;
+  t->lens = t->starts + capacity;
+  t->firsts = t->lens + capacity;
+  t->nexts = t->firsts + capacity;
+  t->labels = (uint16_t *)(t->nexts + capacity);
+  t->capacity = capacity;
+}
+
+void mininez_flat_init(mininez_flat_tree_t *t) {
+  flat_alloc(t, 1024);
+  t->mapped = 0;
+  t->size = 1;
+  t->tags[0] = t->starts[0] = t->lens[0] = t->firsts[0] = t->nexts[0] = 0;
+  t->labels[0] = 0;
+  t->root = 0;
+  t->inputs = NULL;
+  t->length = 0;
+  t->symbol_capacity = 64;
+  t->symbols = (const char **) VM_MALLOC(sizeof(const char *) * t->symbol_capacity);
+  t->symbols[0] = NULL;
+  t->symbol_size = 1;
+  t->symbol_hash_size = 256;
+  t->symbol_keys = (const char **) calloc(t->symbol_hash_size, sizeof(const char *));
+  t->symbol_ids = (uint32_t *) calloc(t->symbol_hash_size, sizeof(uint32_t));
+  t->last_child = 0;
+  t->projection = NULL;
+}
+
+void mininez_flat_dispose(mininez_flat_tree_t *t) {
+  if (t->mapped != 0) {
+    munmap(t->block, t->mapped);
+  } else {
+    VM_FREE(t->block);
+  }
+  VM_FREE(t->symbols);
+  VM_FREE(t->symbol_keys);
+  VM_FREE(t->symbol_ids);
+  t->block = NULL;
+  t->size = t->capacity = 0;
+}
+
+size_t mininez_flat_memory(mininez_flat_tree_t *t) {
+  return (size_t)t->size * (sizeof(uint32_t) * 5 + sizeof(uint16_t));
+}
+
+static void flat_grow(mininez_flat_tree_t *t) {
+  mininez_flat_tree_t old = *t;
+  flat_alloc(t, old.capacity * 2);
+  memcpy(t->tags, old.tags, sizeof(uint32_t) * old.size);
+  memcpy(t->starts, old.starts, sizeof(uint32_t) * old.size);
+  memcpy(t->lens, old.lens, sizeof(uint32_t) * old.size);
+  memcpy(t->firsts, old.firsts, sizeof(uint32_t) * old.size);
+  memcpy(t->nexts, old.nexts, sizeof(uint32_t) * old.size);
+  memcpy(t->labels, old.labels, sizeof(uint16_t) * old.size);
+  VM_FREE(old.block);
+}
+
+static uint32_t flat_symbol_slot(mininez_flat_tree_t *t, const char *s) {
+  uint32_t mask = t->symbol_hash_size - 1;
+  uint32_t i = (uint32_t)(((uintptr_t)s >> 3) * 2654435761U) & mask;
+  while (t->symbol_keys[i] != NULL && t->symbol_keys[i] != s) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/* Replaced values are keyed by address; equal strings at different addresses
+ * (one pool entry per occurrence) still share one id. */
+static uint32_t flat_symbol(mininez_flat_tree_t *t, const char *s) {
+  if (s == NULL) {
+    return 0;
+  }
+  uint32_t slot = flat_symbol_slot(t, s);
+  if (t->symbol_keys[slot] == s) {
+    return t->symbol_ids[slot];
+  }
+  uint32_t id;
+  for (id = 1; id < t->symbol_size; id++) {
+    if (!strcmp(t->symbols[id], s)) {
+      break;
+    }
+  }
+  if (id == t->symbol_size) {
+    if (t->symbol_size == t->symbol_capacity) {
+      t->symbol_capacity *= 2;
+      t->symbols = (const char **) realloc(t->symbols, sizeof(const char *) * t->symbol_capacity);
+    }
+    t->symbols[t->symbol_size++] = s;
+  }
+  if ((t->symbol_size + 1) * 2 > t->symbol_hash_size) {
+    const char **keys = t->symbol_keys;
+    uint32_t *ids = t->symbol_ids;
+    uint32_t size = t->symbol_hash_size;
+    t->symbol_hash_size *= 2;
+    t->symbol_keys = (const char **) calloc(t->symbol_hash_size, sizeof(const char *));
+    t->symbol_ids = (uint32_t *) calloc(t->symbol_hash_size, sizeof(uint32_t));
+    for (uint32_t i = 0; i < size; i++) {
+      if (keys[i] != NULL) {
+        uint32_t j = flat_symbol_slot(t, keys[i]);
+        t->symbol_keys[j] = keys[i];
+        t->symbol_ids[j] = ids[i];
+      }
+    }
+    VM_FREE(keys);
+    VM_FREE(ids);
+    slot = flat_symbol_slot(t, s);
+  }
+  t->symbol_keys[slot] = s;
+  t->symbol_ids[slot] = id;
+  return id;
+}
+
+static mininez_node_t flat_append(mininez_flat_tree_t *t, uint32_t tag, uint32_t start, uint32_t len) {
+  if (t->size == t->capacity) {
+    if (t->capacity >= (UINT32_MAX >> 2)) {
+      nez_PrintErrorInfo("flat tree error: too many nodes");
+    }
+    flat_grow(t);
+  }
+  mininez_node_t n = t->size++;
+  t->tags[n] = tag;
+  t->starts[n] = start;
+  t->lens[n] = len;
+  t->firsts[n] = 0;
+  t->nexts[n] = 0;
+  t->labels[n] = 0;
+  return n;
+}
+
+/* Tree Functions (see ParserContext_initTreeFunc) */
+static void *flat_new(symbol_t tag, const unsigned char *text, size_t len, size_t n, void *thunk) {
+  mininez_flat_tree_t *t = (mininez_flat_tree_t *)thunk;
+  uint32_t start;
+  if (text >= t->inputs && text <= t->inputs + t->length) {
+    start = (uint32_t)(text - t->inputs);
+  } else {
+    start = flat_symbol(t, (const char *)text);
+    len |= MININEZ_FLAT_SYMBOL;
+  }
+  t->last_child = 0;
+#ifdef FLAT_LEAF_BIT
+  if (t->projection != NULL && n == 0 && len <= FLAT_LEAF_MAX && start <= FLAT_LEAF_MAX
+      && !mininez_projection_has(t->projection, mininez_symbol_id(tag), MININEZ_PROJECT_TAG)) {
+    return FLAT_LEAF(start, len);
+  }
+#endif
+  return FLAT_HANDLE(flat_append(t, mininez_symbol_id(tag), start, (uint32_t)len));
+}
+
+static void flat_link(void *parent, size_t n, symbol_t label, void *child, void *thunk) {
+  mininez_flat_tree_t *t = (mininez_flat_tree_t *)thunk;
+  mininez_node_t p = FLAT_NODE(parent);
+  mininez_node_t c = FLAT_NODE(child);
+  uint32_t id = mininez_symbol_id(label);
+  if (FLAT_IS_LEAF(child)) {
+    if (!mininez_projection_has(t->projection, id, MININEZ_PROJECT_LABEL)) {
+      return;
+    }
+    /* kept for a condition, without its tag */
+    c = flat_append(t, 0, FLAT_LEAF_START(child), FLAT_LEAF_LEN(child));
+  } else if (c == 0 && t->projection != NULL) {
+    return;
+  } else if (c == 0) {
+    c = flat_append(t, 0, 0, 0);
+  } else if (t->tags[c] & FLAT_LINKED) {
+    /* memoized subtrees may be linked again; siblings need a copy */
+    mininez_node_t copy = flat_append(t, t->tags[c], t->starts[c], t->lens[c]);
+    t->firsts[copy] = t->firsts[c];
+    c = copy;
+  }
+  t->tags[c] |= FLAT_LINKED;
+  t->labels[c] = (uint16_t)id;
+  if (t->firsts[p] == 0) {
+    t->firsts[p] = c;
+  } else {
+    t->nexts[t->last_child] = c;
+  }
+  t->last_child = c;
+}
+
+static void flat_gc(void *parent, int c, void *thunk) {
+}
+
+typedef struct flat_frame_t {
+  mininez_node_t child;  /* next child to copy, in the old table */
+  mininez_node_t copy;   /* the copy of the parent */
+  mininez_node_t last;   /* last child copied */
+} flat_frame_t;
+
+static mininez_node_t flat_copy(mininez_flat_tree_t *dst, mininez_flat_tree_t *src, mininez_node_t n) {
+  mininez_node_t c = dst->size++;
+  dst->tags[c] = src->tags[n] & ~FLAT_LINKED;
+  dst->starts[c] = src->starts[n];
+  dst->lens[c] = src->lens[n];
+  dst->firsts[c] = 0;
+  dst->nexts[c] = 0;
+  dst->labels[c] = src->labels[n];
+  return c;
+}
+
+/* Keeps the nodes reachable from the root, in preorder */
+static void flat_compact(mininez_flat_tree_t *t, mininez_node_t root) {
+  mininez_flat_tree_t old = *t;
+  flat_alloc(t, old.size);
+  t->size = 1;
+  t->tags[0] = t->starts[0] = t->lens[0] = t->firsts[0] = t->nexts[0] = 0;
+  t->labels[0] = 0;
+  t->root = 0;
+  if (root != 0) {
+    size_t depth = 0, capacity = 64;
+    flat_frame_t *stack = (flat_frame_t *) VM_MALLOC(sizeof(flat_frame_t) * capacity);
+    t->root = flat_copy(t, &old, root);
+    t->labels[t->root] = 0;
+    stack[depth].child = old.firsts[root];
+    stack[depth].copy = t->root;
+    stack[depth].last = 0;
+    depth++;
+    while (depth > 0) {
+      flat_frame_t *f = &stack[depth - 1];
+      if (f->child == 0) {
+        depth--;
+        continue;
+      }
+      mininez_node_t n = f->child;
+      mininez_node_t c = flat_copy(t, &old, n);
+      f->child = old.nexts[n];
+      if (f->last == 0) {
+        t->firsts[f->copy] = c;
+      } else {
+        t->nexts[f->last] = c;
+      }
+      f->last = c;
+      if (old.firsts[n] != 0) {
+        if (depth == capacity) {
+          capacity *= 2;
+          stack = (flat_frame_t *) realloc(stack, sizeof(flat_frame_t) * capacity);
+        }
+        stack[depth].child = old.firsts[n];
+        stack[depth].copy = c;
+        stack[depth].last = 0;
+        depth++;
+      }
+    }
+    VM_FREE(stack);
+  }
+  VM_FREE(old.block);
+}
+
+int mininez_flat_parse(mininez_runtime_t *r, mininez_inst_t *inst, mininez_flat_tree_t *t) {
+  ParserContext *ctx = r->ctx;
+  if (ctx->length >= MININEZ_FLAT_SYMBOL) {
+    nez_PrintErrorInfo("flat tree error: input too large");
+  }
+  t->inputs = ctx->inputs;
+  t->length = ctx->length;
+  /* grammar symbols keep their ids, so tags and labels need no lookup */
+  for (uint32_t i = t->symbol_size; i < r->C->symbol_size; i++) {
+    flat_symbol(t, r->C->symbols[i]);
+  }
+  ParserContext_initTreeFunc(ctx, t, flat_new, flat_link, flat_gc);
+  mininez_init_vm(ctx);
+  ctx->pos = ctx->inputs;
+  int result = mininez_parse(r, inst);
+  flat_compact(t, result == 1 && !FLAT_IS_LEAF(ctx->left) ? FLAT_NODE(ctx->left) : 0);
+  /* drop the handles left in the stacks and memo table before the
+   * default tree functions come back */
+  size_t consumed = ctx->pos - ctx->inputs;
+  ParserContext_reset(ctx, ctx->inputs, ctx->length);
+  ctx->pos = ctx->inputs + consumed;
+  ParserContext_initTreeFunc(ctx, NULL, NULL, NULL, NULL);
+  return result;
+}
+
+static void flat_indent(mininez_writer_t *w, size_t indent) {
+  for (size_t i = 0; i < indent; i++) {
+    mininez_writer_write(w, "  ", 2);
+  }
+}
+
+/* returns 1 when n has children */
+static int flat_open(mininez_writer_t *w, mininez_flat_tree_t *t, mininez_node_t n) {
+  const char *tag = mininez_flat_tag(t, n);
+  if (tag == NULL) {
+    mininez_writer_write(w, "null", 4);
+    return 0;
+  }
+  mininez_writer_write(w, "#", 1);
+  mininez_writer_write(w, tag, strlen(tag));
+  if (t->firsts[n] == 0) {
+    size_t len;
+    const unsigned char *text = mininez_flat_text(t, n, &len);
+    mininez_writer_write(w, "['", 2);
+    mininez_writer_write(w, text, len);
+    mininez_writer_write(w, "']", 2);
+    return 0;
+  }
+  mininez_writer_write(w, "[\n", 2);
+  return 1;
+}
+
+void mininez_flat_write(mininez_writer_t *w, mininez_flat_tree_t *t) {
+  if (t->root == 0) {
+    mininez_writer_write(w, "null\n", 5);
+    return;
+  }
+  /* preorder: the parent of a node is the nearest open node on the path */
+  size_t depth = 0, capacity = 64;
+  mininez_node_t *open = (mininez_node_t *) VM_MALLOC(sizeof(mininez_node_t) * capacity);
+  mininez_node_t n = t->root;
+  if (flat_open(w, t, n)) {
+    open[depth++] = n;
+  }
+  n = t->firsts[n];
+  while (depth > 0) {
+    if (n == 0) {
+      mininez_node_t p = open[--depth];
+      flat_indent(w, depth);
+      mininez_writer_write(w, "]", 1);
+      if (depth > 0) {
+        mininez_writer_write(w, "\n", 1);
+      }
+      n = t->nexts[p];
+      continue;
+    }
+    flat_indent(w, depth);
+    const char *label = mininez_flat_label(t, n);
+    if (label != NULL) {
+      mininez_writer_write(w, "$", 1);
+      mininez_writer_write(w, label, strlen(label));
+      mininez_writer_write(w, "=", 1);
+    }
+    if (flat_open(w, t, n)) {
+      if (depth == capacity) {
+        capacity *= 2;
+        open = (mininez_node_t *) realloc(open, sizeof(mininez_node_t) * capacity);
+      }
+      open[depth++] = n;
+      n = t->firsts[n];
+    } else {
+      mininez_writer_write(w, "\n", 1);
+      n = t->nexts[n];
+    }
+  }
+  mininez_writer_write(w, "\n", 1);
+  VM_FREE(open);
+}
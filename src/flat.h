@@ -0,0 +1,96 @@
+#ifndef FLAT_H
+#define FLAT_H
+
+#include "nezvm.h"
+#include "output.h"
+
+/* Flat Tree
+ * Nodes live in one block of parallel arrays and are addressed by index;
+ * node 0 means "no node". After mininez_flat_parse the nodes are in preorder,
+ * so the first child of node n (if any) is n + 1.
+ *   tags, labels  symbol ids (0: none), equal to the grammar's ids (see
+ *                 mininez_symbol_id); a null child has tag 0
+ *   starts, lens  input offset and length of the text; when lens has
+ *                 MININEZ_FLAT_SYMBOL set, starts is the symbol id of a
+ *                 replaced value instead
+ */
+typedef uint32_t mininez_node_t;
+
+#define MININEZ_FLAT_SYMBOL 0x80000000U
+
+typedef struct mininez_flat_tree_t {
+  void *block;
+  size_t mapped;      /* length of block when it is a mapped cache file */
+  uint32_t *tags;
+  uint32_t *starts;
+  uint32_t *lens;
+  uint32_t *firsts;
+  uint32_t *nexts;
+  uint16_t *labels;
+  uint32_t size;      /* including node 0 */
+  uint32_t capacity;
+  mininez_node_t root;
+  const unsigned char *inputs;
+  size_t length;
+  /* symbols: tags, labels and replaced values */
+  const char **symbols;
+  uint32_t symbol_size;
+  uint32_t symbol_capacity;
+  const char **symbol_keys;
+  uint32_t *symbol_ids;
+  uint32_t symbol_hash_size;
+  /* builder */
+  mininez_node_t last_child;
+  /* when set, leaves and null children nobody asked for are not kept */
+  const struct mininez_projection_t *projection;
+} mininez_flat_tree_t;
+
+void mininez_flat_init(mininez_flat_tree_t *t);
+void mininez_flat_dispose(mininez_flat_tree_t *t);
+/* Parses with r and leaves the reachable nodes in t; r keeps its input
+ * position but no tree. */
+int mininez_flat_parse(mininez_runtime_t *r, mininez_inst_t *inst, mininez_flat_tree_t *t);
+/* Bytes used by the node arrays */
+size_t mininez_flat_memory(mininez_flat_tree_t *t);
+/* The indented format of dumpAST */
+void mininez_flat_write(mininez_writer_t *w, mininez_flat_tree_t *t);
+
+/* Accessors */
+static inline mininez_node_t mininez_flat_root(mininez_flat_tree_t *t) {
+  return t->root;
+}
+
+static inline mininez_node_t mininez_flat_first_child(mininez_flat_tree_t *t, mininez_node_t n) {
+  return t->firsts[n];
+}
+
+static inline mininez_node_t mininez_flat_next_sibling(mininez_flat_tree_t *t, mininez_node_t n) {
+  return t->nexts[n];
+}
+
+static inline const char *mininez_flat_tag(mininez_flat_tree_t *t, mininez_node_t n) {
+  return t->symbols[t->tags[n]];
+}
+
+static inline const char *mininez_flat_label(mininez_flat_tree_t *t, mininez_node_t n) {
+  return t->symbols[t->labels[n]];
+}
+
+static inline const unsigned char *mininez_flat_text(mininez_flat_tree_t *t, mininez_node_t n, size_t *len) {
+  if (t->lens[n] & MININEZ_FLAT_SYMBOL) {
+    *len = t->lens[n] & ~MININEZ_FLAT_SYMBOL;
+    return (const unsigned char *)t->symbols[t->starts[n]];
+  }
+  *len = t->lens[n];
+  return t->inputs + t->starts[n];
+}
+
+static inline size_t mininez_flat_child_count(mininez_flat_tree_t *t, mininez_node_t n) {
+  size_t count = 0;
+  for (mininez_node_t c = t->firsts[n]; c != 0; c = t->nexts[c]) {
+    count++;
+  }
+  return count;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include <string.h>
+
+#include "histogram.h"
+
+/* Values below 2 * SUB have a bucket each; above, the bucket is the top
+ * SUB_BITS + 1 bits of the value, offset by its magnitude */
+static unsigned histogram_index(uint64_t value) {
+  if (value < 2 * MININEZ_HISTOGRAM_SUB) {
+    return (unsigned)value;
+  }
+  unsigned shift = 63 - __builtin_clzll(value) - MININEZ_HISTOGRAM_SUB_BITS;
+  return shift * MININEZ_HISTOGRAM_SUB + (unsigned)(value >> shift);
+}
+
+static uint64_t histogram_highest(unsigned index) {
+  if (index < 2 * MININEZ_HISTOGRAM_SUB) {
+    return index;
+  }
+  unsigned shift = index / MININEZ_HISTOGRAM_SUB - 1;
+  uint64_t low = (uint64_t)(index - shift * MININEZ_HISTOGRAM_SUB) << shift;
+  return low + (((uint64_t)1 << shift) - 1);
+}
+
+void mininez_histogram_init(mininez_histogram_t *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+void mininez_histogram_record(mininez_histogram_t *h, uint64_t value) {
+  h->buckets[histogram_index(value)]++;
+  h->count++;
+  h->sum += (double)value;
+  h->min = value < h->min ? value : h->min;
+  h->max = value > h->max ? value : h->max;
+}
+
+void mininez_histogram_merge(mininez_histogram_t *to, const mininez_histogram_t *from) {
+  if (from->count == 0) {
+    return;
+  }
+  for (unsigned i = 0; i < MININEZ_HISTOGRAM_BUCKETS; i++) {
+    to->buckets[i] += from->buckets[i];
+  }
+  to->count += from->count;
+  to->sum += from->sum;
+  to->min = from->min < to->min ? from->min : to->min;
+  to->max = from->max > to->max ? from->max : to->max;
+}
+
+uint64_t mininez_histogram_percentile(const mininez_histogram_t *h, double percentile) {
+  if (h->count == 0) {
+    return 0;
+  }
+  /* the rank of the percentile, counting from 1 */
+  uint64_t rank = (uint64_t)(percentile / 100.0 * (double)h->count + 0.5);
+  uint64_t seen = 0;
+  rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+  for (unsigned i = 0; i < MININEZ_HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t value = histogram_highest(i);
+      return value > h->max ? h->max : value;
+    }
+  }
+  return h->max;
+}
+
+void mininez_histogram_report(const mininez_histogram_t *h, const char *name,
+                              double scale, const char *unit, FILE *fp) {
+  if (h->count == 0) {
+    fprintf(fp, "%s: n 0\n", name);
+    return;
+  }
+  fprintf(fp, "%s: n %llu, min %.3f, mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f %s\n",
+          name, (unsigned long long)h->count, h->min / scale, h->sum / h->count / scale,
+          mininez_histogram_percentile(h, 50) / scale, mininez_histogram_percentile(h, 90) / scale,
+          mininez_histogram_percentile(h, 99) / scale, mininez_histogram_percentile(h, 99.9) / scale,
+          h->max / scale, unit);
+}
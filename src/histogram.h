@@ -0,0 +1,35 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Latency Histogram
+ * HDR-style: every power of two is split into 2^MININEZ_HISTOGRAM_SUB_BITS
+ * linear buckets, so any uint64_t is recorded in constant time and space
+ * with a relative error under 1%. min, max and the mean are exact.
+ * Histograms of the same kind add up (one per worker, merged at the end).
+ */
+#define MININEZ_HISTOGRAM_SUB_BITS 7
+#define MININEZ_HISTOGRAM_SUB      (1 << MININEZ_HISTOGRAM_SUB_BITS)
+#define MININEZ_HISTOGRAM_BUCKETS  ((64 - MININEZ_HISTOGRAM_SUB_BITS + 1) * MININEZ_HISTOGRAM_SUB)
+
+typedef struct mininez_histogram_t {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+  uint64_t buckets[MININEZ_HISTOGRAM_BUCKETS];
+} mininez_histogram_t;
+
+void mininez_histogram_init(mininez_histogram_t *h);
+void mininez_histogram_record(mininez_histogram_t *h, uint64_t value);
+void mininez_histogram_merge(mininez_histogram_t *to, const mininez_histogram_t *from);
+/* The largest value recorded in the bucket that holds the percentile
+ * (0-100), never above max; 0 when empty */
+uint64_t mininez_histogram_percentile(const mininez_histogram_t *h, double percentile);
+/* "<name>: n <count>, min, mean, p50, p90, p99, p99.9, max" in value / scale */
+void mininez_histogram_report(const mininez_histogram_t *h, const char *name,
+                              double scale, const char *unit, FILE *fp);
+
+#endif
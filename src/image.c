@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "pstring.h"
+#include "image.h"
+
+#define IMAGE_BYTE_ORDER 0x01020304
+
+typedef struct image_buffer_t {
+  char *data;
+  size_t size;
+  size_t capacity;
+} image_buffer_t;
+
+static size_t image_reserve(image_buffer_t *b, size_t len, size_t align) {
+  size_t pos = (b->size + align - 1) & ~(align - 1);
+  if (pos + len > b->capacity) {
+    while (pos + len > b->capacity) {
+      b->capacity = b->capacity == 0 ? 4096 : b->capacity * 2;
+    }
+    b->data = (char *) realloc(b->data, b->capacity);
+  }
+  memset(b->data + b->size, 0, pos + len - b->size);
+  b->size = pos + len;
+  return pos;
+}
+
+static size_t image_append(image_buffer_t *b, const void *p, size_t len, size_t align) {
+  size_t pos = image_reserve(b, len, align);
+  memcpy(b->data + pos, p, len);
+  return pos;
+}
+
+static uint64_t image_pstring(image_buffer_t *b, const char *s) {
+  if (s == NULL) {
+    return 0;
+  }
+  unsigned len = pstring_length(s);
+  size_t pos = image_reserve(b, sizeof(pstring_t) + len + 1, sizeof(unsigned));
+  memcpy(b->data + pos, &len, sizeof(unsigned));
+  memcpy(b->data + pos + OFFSET_OF(pstring_t, str), s, len + 1);
+  return pos + OFFSET_OF(pstring_t, str);
+}
+
+#define IMAGE_AT(B, OFF, T) ((T *)((B)->data + (OFF)))
+
+static uint64_t image_strings(image_buffer_t *b, const char **strs, uint16_t size) {
+  size_t offset = image_reserve(b, sizeof(uint64_t) * size, sizeof(uint64_t));
+  for (uint16_t i = 0; i < size; i++) {
+    uint64_t pos = image_pstring(b, strs[i]);
+    IMAGE_AT(b, offset, uint64_t)[i] = pos;
+  }
+  return offset;
+}
+
+/* symbols, then tags as offsets of the same strings */
+static uint64_t image_symbols(image_buffer_t *b, mininez_constant_t *C, uint64_t *tag_offset) {
+  uint64_t *pos = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * C->symbol_size);
+  pos[0] = 0;
+  for (uint16_t i = 1; i < C->symbol_size; i++) {
+    unsigned len = pstring_length(C->symbols[i]);
+    size_t at = image_reserve(b, sizeof(mininez_symbol_t) + len, sizeof(uint32_t));
+    mininez_symbol_t *sym = IMAGE_AT(b, at, mininez_symbol_t);
+    sym->id = i;
+    sym->len = len;
+    memcpy(sym->str, C->symbols[i], len + 1);
+    pos[i] = at + OFFSET_OF(mininez_symbol_t, str);
+  }
+  uint64_t offset = image_append(b, pos, sizeof(uint64_t) * C->symbol_size, sizeof(uint64_t));
+  *tag_offset = image_reserve(b, sizeof(uint64_t) * C->tag_size, sizeof(uint64_t));
+  for (uint16_t i = 0; i < C->tag_size; i++) {
+    IMAGE_AT(b, *tag_offset, uint64_t)[i] = pos[mininez_symbol_id(C->tags[i])];
+  }
+  VM_FREE(pos);
+  return offset;
+}
+
+int mininez_save_image(mininez_runtime_t *r, mininez_inst_t *inst, const char *path) {
+  mininez_constant_t *C = r->C;
+  mininez_image_header_t header;
+  image_buffer_t b = { NULL, 0, 0 };
+  image_reserve(&b, sizeof(header), sizeof(uint64_t));
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MININEZ_IMAGE_MAGIC, sizeof(header.magic));
+  header.version = MININEZ_IMAGE_VERSION;
+  header.byte_order = IMAGE_BYTE_ORDER;
+  header.prod_size = C->prod_size;
+  header.set_size = C->set_size;
+  header.str_size = C->str_size;
+  header.tag_size = C->tag_size;
+  header.table_size = C->table_size;
+  header.memo_width = C->memo_width;
+  header.memo_points = C->memo_points;
+  header.symbol_size = C->symbol_size;
+
+  header.code_size = mininez_code_size(r, inst);
+  image_append(&b, (mininez_code_header_t *)inst - 1, sizeof(mininez_code_header_t), sizeof(uint64_t));
+  header.code_offset = image_append(&b, inst, header.code_size, 1);
+  header.set_offset = image_append(&b, C->sets, sizeof(bitset_t) * C->set_size, 64); /* cache line */
+  header.prod_offset = image_strings(&b, C->prod_names, C->prod_size);
+  header.str_offset = image_strings(&b, C->strs, C->str_size);
+  header.symbol_offset = image_symbols(&b, C, &header.tag_offset);
+
+  header.index_offset = image_reserve(&b, sizeof(uint64_t) * C->table_size, sizeof(uint64_t));
+  header.table_offset = image_reserve(&b, sizeof(uint64_t) * C->table_size, sizeof(uint64_t));
+  for (uint16_t i = 0; i < C->table_size; i++) {
+    uint64_t pos = image_append(&b, C->jump_indexs[i], 256, sizeof(uint64_t));
+    IMAGE_AT(&b, header.index_offset, uint64_t)[i] = pos;
+    pos = image_append(&b, C->jump_tables[i], sizeof(uint16_t) * mininez_table_length(C->jump_indexs[i]), sizeof(uint64_t));
+    IMAGE_AT(&b, header.table_offset, uint64_t)[i] = pos;
+  }
+  header.image_size = b.size;
+  memcpy(b.data, &header, sizeof(header));
+
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    free(b.data);
+    return -1;
+  }
+  size_t written = fwrite(b.data, 1, b.size, fp);
+  int closed = fclose(fp);
+  free(b.data);
+  return (written == b.size && closed == 0) ? 0 : -1;
+}
+
+/* fills p with the pointers of an offset array */
+static const char **image_pointers(char *base, uint64_t offset, uint16_t size, const char **p) {
+  uint64_t *offsets = (uint64_t *)(base + offset);
+  for (uint16_t i = 0; i < size; i++) {
+    p[i] = offsets[i] == 0 ? NULL : base + offsets[i];
+  }
+  return p;
+}
+
+/* n items of width bytes at offset lie within the image */
+static int image_fits(uint64_t offset, uint64_t n, uint64_t width, uint64_t align, uint64_t size) {
+  return offset >= sizeof(mininez_image_header_t) && offset <= size && offset % align == 0
+      && n <= (size - offset) / width;
+}
+
+/* A NUL terminated string within the image, its length in the unsigned
+ * before it and head bytes of header in all (pstring_t, mininez_symbol_t) */
+static int image_string(const char *base, uint64_t size, uint64_t offset, uint64_t head) {
+  unsigned len;
+  if (!image_fits(offset - head, 1, head, sizeof(unsigned), size) || offset >= size) {
+    return 0;
+  }
+  memcpy(&len, base + offset - sizeof(unsigned), sizeof(unsigned));
+  return len < size - offset && base[offset + len] == 0;
+}
+
+static int image_strings_valid(const char *base, uint64_t size, uint64_t offset, uint16_t n) {
+  if (!image_fits(offset, n, sizeof(uint64_t), sizeof(uint64_t), size)) {
+    return 0;
+  }
+  const uint64_t *offsets = (const uint64_t *)(base + offset);
+  for (uint16_t i = 0; i < n; i++) {
+    if (offsets[i] != 0 && !image_string(base, size, offsets[i], OFFSET_OF(pstring_t, str))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* every section, string and table the header points to lies within the
+ * image, and the code is whole */
+static int image_valid(const char *base, uint64_t size) {
+  const mininez_image_header_t *h = (const mininez_image_header_t *)base;
+  uint64_t head = sizeof(mininez_code_header_t);
+  if (h->code_offset < head || !image_fits(h->code_offset - head, 1, head, sizeof(uint64_t), size)
+      || !image_fits(h->code_offset, h->code_size, 1, 1, size)
+      || !image_fits(h->set_offset, h->set_size, sizeof(bitset_t), 64, size)
+      || !image_strings_valid(base, size, h->prod_offset, h->prod_size)
+      || !image_strings_valid(base, size, h->str_offset, h->str_size)
+      || !image_fits(h->symbol_offset, h->symbol_size, sizeof(uint64_t), sizeof(uint64_t), size)
+      || !image_fits(h->tag_offset, h->tag_size, sizeof(uint64_t), sizeof(uint64_t), size)
+      || !image_fits(h->index_offset, h->table_size, sizeof(uint64_t), sizeof(uint64_t), size)
+      || !image_fits(h->table_offset, h->table_size, sizeof(uint64_t), sizeof(uint64_t), size)) {
+    return 0;
+  }
+  const mininez_inst_t *code = (const mininez_inst_t *)(base + h->code_offset);
+  uint64_t pc = 0, i = 0;
+  for (; i < mininez_code_length(code) && pc < h->code_size; i++) {
+    pc += opcode_length(code[pc]);
+  }
+  if (i != mininez_code_length(code) || pc != h->code_size || mininez_code_start(code) >= h->code_size) {
+    return 0;
+  }
+  const uint64_t *symbols = (const uint64_t *)(base + h->symbol_offset);
+  for (uint16_t i = 0; i < h->symbol_size; i++) {
+    if (symbols[i] == 0 ? i != 0
+        : !image_string(base, size, symbols[i], OFFSET_OF(mininez_symbol_t, str))
+          || mininez_symbol_id(base + symbols[i]) != i) {
+      return 0;
+    }
+  }
+  const uint64_t *tags = (const uint64_t *)(base + h->tag_offset);
+  for (uint16_t i = 0; i < h->tag_size; i++) {
+    if (tags[i] != 0 && !image_string(base, size, tags[i], OFFSET_OF(mininez_symbol_t, str))) {
+      return 0;
+    }
+    uint32_t id = tags[i] == 0 ? 0 : mininez_symbol_id(base + tags[i]);
+    if (id >= h->symbol_size || symbols[id] != tags[i]) {
+      return 0;
+    }
+  }
+  const uint64_t *indexs = (const uint64_t *)(base + h->index_offset);
+  const uint64_t *tables = (const uint64_t *)(base + h->table_offset);
+  for (uint16_t i = 0; i < h->table_size; i++) {
+    if (!image_fits(indexs[i], 1, 256, 1, size)
+        || !image_fits(tables[i], mininez_table_length((const uint8_t *)(base + indexs[i])),
+                       sizeof(uint16_t), sizeof(uint16_t), size)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+mininez_inst_t *mininez_load_image(mininez_runtime_t *r, const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    nez_PrintErrorInfo("image error: cannot open file");
+  }
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(mininez_image_header_t)) {
+    nez_PrintErrorInfo("image error: broken image");
+  }
+  char *base = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    nez_PrintErrorInfo("image error: cannot map file");
+  }
+  mininez_image_header_t *header = (mininez_image_header_t *)base;
+  if (memcmp(header->magic, MININEZ_IMAGE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != MININEZ_IMAGE_VERSION
+      || header->byte_order != IMAGE_BYTE_ORDER
+      || header->image_size != (uint64_t)st.st_size) {
+    nez_PrintErrorInfo("image error: incompatible image");
+  }
+  if (!image_valid(base, st.st_size)) {
+    nez_PrintErrorInfo("image error: broken image");
+  }
+
+  mininez_constant_t *C = mininez_create_constant();
+  C->prod_size = header->prod_size;
+  C->set_size = header->set_size;
+  C->str_size = header->str_size;
+  C->tag_size = header->tag_size;
+  C->table_size = header->table_size;
+  C->memo_width = header->memo_width;
+  C->memo_points = header->memo_points;
+  C->symbol_size = header->symbol_size;
+  C->symbol_capacity = header->symbol_size;
+  C->image = base;
+  C->image_size = st.st_size;
+  C->pool_tables = C->table_size;
+
+  /* only the pointer arrays are allocated, as the arena; everything else
+   * stays mapped */
+  const char **p = (const char **) VM_MALLOC(sizeof(const char *) * ((size_t)C->prod_size + C->str_size
+      + C->symbol_size + C->tag_size + 2 * (size_t)C->table_size));
+  C->arena = p;
+  C->pool_size = sizeof(const char *) * ((size_t)C->prod_size + C->str_size
+      + C->symbol_size + C->tag_size + 2 * (size_t)C->table_size) + C->image_size;
+  C->sets = (bitset_t *)(base + header->set_offset);
+  C->prod_names = image_pointers(base, header->prod_offset, C->prod_size, p);
+  p += C->prod_size;
+  C->strs = image_pointers(base, header->str_offset, C->str_size, p);
+  p += C->str_size;
+  C->symbols = image_pointers(base, header->symbol_offset, C->symbol_size, p);
+  p += C->symbol_size;
+  C->tags = image_pointers(base, header->tag_offset, C->tag_size, p);
+  p += C->tag_size;
+  C->jump_indexs = (uint8_t **) image_pointers(base, header->index_offset, C->table_size, p);
+  p += C->table_size;
+  C->jump_tables = (uint16_t **) image_pointers(base, header->table_offset, C->table_size, p);
+  r->C = C;
+  ParserContext_initMemo(r->ctx, C->memo_width, C->memo_points);
+  return (mininez_inst_t *)(base + header->code_offset);
+}
@@ -0,0 +1,46 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "nezvm.h"
+
+#define MININEZ_IMAGE_MAGIC   "MININEZI"
+#define MININEZ_IMAGE_VERSION 3
+
+/* Grammar Image
+ * A relocated copy of the loaded instruction stream and constant pool.
+ * Every reference is an offset from the start of the image, so the file
+ * can be mapped read-only at any address and shared between processes.
+ *
+ *   header | code (after its mininez_code_header_t) | sets | offset arrays | pstrings | symbols | dispatch tables
+ *
+ * Symbols are stored once with their ids; tag offsets point into them.
+ */
+typedef struct mininez_image_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint16_t prod_size;
+  uint16_t set_size;
+  uint16_t str_size;
+  uint16_t tag_size;
+  uint16_t table_size;
+  uint16_t memo_width;
+  uint16_t memo_points;
+  uint16_t symbol_size;
+  uint64_t code_offset;
+  uint64_t code_size;
+  uint64_t set_offset;
+  /* arrays of uint64_t offsets, 0 stands for NULL */
+  uint64_t prod_offset;
+  uint64_t str_offset;
+  uint64_t symbol_offset;
+  uint64_t tag_offset;
+  uint64_t index_offset;
+  uint64_t table_offset;
+  uint64_t image_size;
+} mininez_image_header_t;
+
+int mininez_save_image(mininez_runtime_t *r, mininez_inst_t *inst, const char *path);
+mininez_inst_t *mininez_load_image(mininez_runtime_t *r, const char *path);
+
+#endif
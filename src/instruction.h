@@ -119,6 +119,28 @@ enum mininez_opcode {
   OP(TLookup)\
   OP(TMemo)
 
+/* Length of a loaded instruction in bytes, including the opcode.
+ * Trap carries a uint16_t hook id and Cov a uint16_t coverage site; the
+ * runtime inserts them, the compiler never emits them. */
+static inline int opcode_length(int opcode) {
+  switch (opcode) {
+  case Exit: case Byte: case NByte: case OByte: case RByte: case TBegin:
+    return 2;
+  case Nop: case Cov: case Trap: case Jump: case Alt: case Set: case Str: case NSet:
+  case NStr: case OSet: case OStr: case RSet: case RStr: case Dispatch:
+  case DDispatch: case TTag: case TReplace: case TLink: case Memo:
+  case MemoFail: case TMemo:
+    return 3;
+  case TFold:
+    return 4;
+  case Call: case Lookup: case TLookup:
+    return 5;
+  case TEnd:
+    return 6;
+  }
+  return 1;
+}
+
 #ifdef MININEZ_DUMP_OPCODE
 static const char* opcode_to_string(int opcode) {
   switch (opcode) {
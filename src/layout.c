@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "program.h"
+#include "cache.h"
+#include "layout.h"
+
+static int layout_ends_block(uint8_t opcode) {
+  return mininez_insn_ends_flow(opcode) || opcode == Lookup || opcode == TLookup || opcode == Trap;
+}
+
+/* A production is entered past its Nop, so its block starts after it */
+static void layout_mark(uint8_t *leader, mininez_program_t *p, uint64_t i) {
+  while (i < p->size && p->insns[i].opcode == Nop) {
+    i++;
+  }
+  if (i < p->size) {
+    leader[i] = 1;
+  }
+}
+
+static uint8_t *layout_leaders(mininez_program_t *p, uint64_t prologue) {
+  uint8_t *leader = (uint8_t *) calloc(p->size + 1, sizeof(uint8_t));
+  layout_mark(leader, p, p->start);
+  for (uint64_t i = prologue; i < p->size; i++) {
+    mininez_insn_t *insn = &p->insns[i];
+    switch (insn->opcode) {
+    case Nop:
+      layout_mark(leader, p, i);
+      break;
+    case Jump: case Alt: case Lookup: case TLookup:
+      layout_mark(leader, p, insn->target);
+      break;
+    case Call:
+      layout_mark(leader, p, insn->target);
+      layout_mark(leader, p, insn->ret);
+      break;
+    case Dispatch: case DDispatch:
+      for (uint16_t k = 0; k < insn->case_size; k++) {
+        layout_mark(leader, p, insn->cases[k]);
+      }
+      break;
+    }
+    if (layout_ends_block(insn->opcode)) {
+      layout_mark(leader, p, i + 1);
+    }
+  }
+  for (uint64_t i = 0; i < p->size; i++) {
+    if (i < prologue || mininez_program_glued(p, i)) {
+      leader[i] = 0;
+    }
+  }
+  return leader;
+}
+
+mininez_inst_t *mininez_cover(mininez_runtime_t *r, mininez_inst_t *inst, mininez_coverage_t *cov) {
+  mininez_program_t p;
+  mininez_program_decode(&p, r, inst);
+  cov->hash = mininez_grammar_hash(r, inst);
+  uint64_t prologue = mininez_program_prologue(&p);
+  uint8_t *leader = layout_leaders(&p, prologue);
+  uint64_t sites = 0;
+  for (uint64_t i = 0; i < p.size; i++) {
+    sites += leader[i];
+  }
+  if (sites > UINT16_MAX) {
+    nez_PrintErrorInfo("coverage error: too many blocks");
+  }
+  cov->size = (uint16_t)sites;
+  cov->counts = (uint64_t *) calloc(sites + 1, sizeof(uint64_t));
+  cov->sites = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (sites + 1));
+  cov->prods = (uint16_t *) VM_MALLOC(sizeof(uint16_t) * (sites + 1));
+
+  mininez_insn_t *insns = (mininez_insn_t *) calloc(p.size + sites, sizeof(mininez_insn_t));
+  uint64_t *map = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * p.size);
+  uint64_t size = 0;
+  uint16_t site = 0;
+  uint16_t prod = 0;
+  for (uint64_t i = 0; i < p.size; i++) {
+    if (p.insns[i].opcode == Nop) {
+      prod = *(uint16_t *)p.insns[i].operand;
+    }
+    map[i] = size;
+    if (leader[i]) {
+      insns[size].opcode = Cov;
+      *(uint16_t *)insns[size].operand = site;
+      cov->sites[site] = i;
+      cov->prods[site] = prod;
+      site++;
+      size++;
+    }
+    insns[size++] = p.insns[i];
+  }
+  mininez_program_replace(&p, insns, size, map);
+  mininez_inst_t *code = mininez_program_encode(&p, r);
+  mininez_program_dispose(&p);
+  VM_FREE(map);
+  VM_FREE(leader);
+  return code;
+}
+
+uint16_t mininez_coverage_hits(mininez_coverage_t *cov) {
+  uint16_t hits = 0;
+  for (uint16_t i = 0; i < cov->size; i++) {
+    hits += cov->counts[i] > 0;
+  }
+  return hits;
+}
+
+void mininez_coverage_dispose(mininez_coverage_t *cov) {
+  VM_FREE(cov->counts);
+  VM_FREE(cov->sites);
+  VM_FREE(cov->prods);
+  cov->size = 0;
+}
+
+/* Profile Files */
+typedef struct layout_profile_t {
+  uint64_t hash;
+  uint64_t *index;
+  uint64_t *count;
+  size_t size;
+  size_t capacity;
+} layout_profile_t;
+
+/* Returns -1 when there is no file at path */
+static int layout_read_profile(layout_profile_t *prof, const char *path) {
+  char line[1024];
+  int has_hash = 0;
+  FILE *fp = fopen(path, "r");
+  memset(prof, 0, sizeof(*prof));
+  if (fp == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    uint64_t index, count;
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    if (sscanf(line, "hash %" SCNx64, &prof->hash) == 1) {
+      has_hash = 1;
+      continue;
+    }
+    if (sscanf(line, "%" SCNu64 " %" SCNu64, &index, &count) != 2) {
+      nez_PrintErrorInfo("coverage error: broken profile");
+    }
+    if (prof->size == prof->capacity) {
+      prof->capacity = prof->capacity == 0 ? 256 : prof->capacity * 2;
+      prof->index = (uint64_t *) realloc(prof->index, sizeof(uint64_t) * prof->capacity);
+      prof->count = (uint64_t *) realloc(prof->count, sizeof(uint64_t) * prof->capacity);
+    }
+    prof->index[prof->size] = index;
+    prof->count[prof->size] = count;
+    prof->size++;
+  }
+  fclose(fp);
+  if (!has_hash) {
+    nez_PrintErrorInfo("coverage error: broken profile");
+  }
+  return 0;
+}
+
+static void layout_dispose_profile(layout_profile_t *prof) {
+  free(prof->index);
+  free(prof->count);
+}
+
+int mininez_coverage_write(mininez_coverage_t *cov, mininez_runtime_t *r, const char *path) {
+  layout_profile_t prof;
+  uint64_t *counts = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (cov->size + 1));
+  memcpy(counts, cov->counts, sizeof(uint64_t) * cov->size);
+  if (layout_read_profile(&prof, path) == 0) {
+    if (prof.hash != cov->hash) {
+      nez_PrintErrorInfo("coverage error: the profile there is of another grammar");
+    }
+    /* sites are in instruction order */
+    for (size_t i = 0; i < prof.size; i++) {
+      uint16_t lo = 0, hi = cov->size;
+      while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (cov->sites[mid] < prof.index[i]) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      if (lo == cov->size || cov->sites[lo] != prof.index[i]) {
+        nez_PrintErrorInfo("coverage error: broken profile");
+      }
+      counts[lo] += prof.count[i];
+    }
+    layout_dispose_profile(&prof);
+  }
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    VM_FREE(counts);
+    return -1;
+  }
+  fprintf(fp, "# mininez coverage\nhash %016" PRIx64 "\n", cov->hash);
+  for (uint16_t i = 0; i < cov->size; i++) {
+    fprintf(fp, "%" PRIu64 " %" PRIu64 " %s\n", cov->sites[i], counts[i], r->C->prod_names[cov->prods[i]]);
+  }
+  VM_FREE(counts);
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Layout */
+typedef struct layout_block_t {
+  uint64_t start;
+  uint64_t end;
+  uint64_t count;
+} layout_block_t;
+
+typedef struct layout_prod_t {
+  uint64_t first;   /* blocks */
+  uint64_t last;
+  uint64_t count;
+} layout_prod_t;
+
+static int layout_compare_prods(const void *a, const void *b) {
+  const layout_prod_t *x = *(const layout_prod_t *const *)a;
+  const layout_prod_t *y = *(const layout_prod_t *const *)b;
+  if (x->count != y->count) {
+    return x->count > y->count ? -1 : 1;
+  }
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+mininez_inst_t *mininez_layout(mininez_runtime_t *r, mininez_inst_t *inst, const char *path) {
+  layout_profile_t prof;
+  mininez_program_t p;
+  if (layout_read_profile(&prof, path) != 0) {
+    nez_PrintErrorInfo("layout error: cannot read the coverage profile");
+  }
+  if (prof.hash != mininez_grammar_hash(r, inst)) {
+    nez_PrintErrorInfo("layout error: the coverage profile is of another grammar");
+  }
+  mininez_program_decode(&p, r, inst);
+  uint64_t *hits = (uint64_t *) calloc(p.size, sizeof(uint64_t));
+  for (size_t i = 0; i < prof.size; i++) {
+    if (prof.index[i] >= p.size) {
+      nez_PrintErrorInfo("layout error: broken coverage profile");
+    }
+    hits[prof.index[i]] += prof.count[i];
+  }
+  layout_dispose_profile(&prof);
+
+  /* blocks split at leaders; a Nop opens the block of its entry */
+  uint64_t prologue = mininez_program_prologue(&p);
+  uint8_t *leader = layout_leaders(&p, prologue);
+  layout_block_t *blocks = (layout_block_t *) VM_MALLOC(sizeof(layout_block_t) * (p.size + 1));
+  layout_prod_t *prods = (layout_prod_t *) VM_MALLOC(sizeof(layout_prod_t) * (p.size + 1));
+  uint64_t block_size = 0, prod_size = 0;
+  for (uint64_t i = prologue; i < p.size; i++) {
+    int nop = p.insns[i].opcode == Nop;
+    if (nop || (leader[i] && p.insns[i - 1].opcode != Nop) || i == prologue) {
+      if (block_size > 0) {
+        blocks[block_size - 1].end = i;
+      }
+      blocks[block_size].start = i;
+      blocks[block_size].count = hits[nop && i + 1 < p.size ? i + 1 : i];
+      if (nop) {
+        if (prod_size > 0) {
+          prods[prod_size - 1].last = block_size;
+        }
+        prods[prod_size].first = block_size;
+        prods[prod_size].count = blocks[block_size].count;
+        prod_size++;
+      }
+      block_size++;
+    }
+  }
+  if (block_size > 0) {
+    blocks[block_size - 1].end = p.size;
+    prods[prod_size - 1].last = block_size;
+  }
+
+  /* hot productions first, each with its blocks that ran; then the rest */
+  layout_prod_t **order = (layout_prod_t **) VM_MALLOC(sizeof(layout_prod_t *) * (prod_size + 1));
+  for (uint64_t k = 0; k < prod_size; k++) {
+    order[k] = &prods[k];
+  }
+  qsort(order, prod_size, sizeof(layout_prod_t *), layout_compare_prods);
+  uint64_t *sequence = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (block_size + 1));
+  uint64_t seq_size = 0, hot_prods = 0, cold_blocks = 0;
+  for (uint64_t k = 0; k < prod_size; k++) {
+    if (order[k]->count == 0) {
+      continue;
+    }
+    hot_prods++;
+    for (uint64_t b = order[k]->first; b < order[k]->last; b++) {
+      if (blocks[b].count > 0) {
+        sequence[seq_size++] = b;
+      }
+    }
+  }
+  for (uint64_t k = 0; k < prod_size; k++) {
+    for (uint64_t b = prods[k].first; b < prods[k].last; b++) {
+      if (prods[k].count == 0 || blocks[b].count == 0) {
+        sequence[seq_size++] = b;
+        cold_blocks += prods[k].count > 0;
+      }
+    }
+  }
+
+  /* at most one Jump per block is added */
+  mininez_insn_t *insns = (mininez_insn_t *) calloc(p.size + block_size, sizeof(mininez_insn_t));
+  uint64_t *map = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * p.size);
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < prologue; i++) {
+    map[i] = size;
+    insns[size++] = p.insns[i];
+  }
+  for (uint64_t s = 0; s < seq_size; s++) {
+    layout_block_t *b = &blocks[sequence[s]];
+    uint64_t next = s + 1 < seq_size ? blocks[sequence[s + 1]].start : p.size;
+    for (uint64_t i = b->start; i < b->end; i++) {
+      map[i] = size;
+      insns[size++] = p.insns[i];
+    }
+    mininez_insn_t *last = &insns[size - 1];
+    if (last->opcode == Jump && last->target == next) {
+      last->removed = 1;
+    } else if (!mininez_insn_ends_flow(last->opcode) && b->end != next && b->end < p.size) {
+      insns[size].opcode = Jump;
+      insns[size].target = b->end;
+      size++;
+    }
+  }
+  mininez_program_replace(&p, insns, size, map);
+  mininez_inst_t *code = mininez_program_encode(&p, r);
+  fprintf(stderr, "Layout: %" PRIu64 " of %" PRIu64 " productions hot, %" PRIu64 " cold blocks moved out\n",
+          hot_prods, prod_size, cold_blocks);
+  mininez_program_dispose(&p);
+  VM_FREE(sequence);
+  VM_FREE(order);
+  VM_FREE(map);
+  VM_FREE(prods);
+  VM_FREE(blocks);
+  VM_FREE(leader);
+  VM_FREE(hits);
+  return code;
+}
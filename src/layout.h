@@ -0,0 +1,41 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "nezvm.h"
+
+/* Coverage
+ * mininez_cover returns a copy of inst with a Cov before every basic block,
+ * counting into r->coverage while it is set to counts. A site is known by
+ * the index of the instruction it precedes in inst, so the profiles of a
+ * grammar add up across runs and apply to it as loaded (mininez_layout).
+ * A profile is a text file:
+ *   # mininez coverage
+ *   hash <mininez_grammar_hash of inst>
+ *   <instruction index> <count> <production>
+ */
+typedef struct mininez_coverage_t {
+  uint64_t *counts;   /* by site */
+  uint64_t *sites;    /* instruction index in inst */
+  uint16_t *prods;    /* production of the site */
+  uint16_t size;
+  uint64_t hash;
+} mininez_coverage_t;
+
+mininez_inst_t *mininez_cover(mininez_runtime_t *r, mininez_inst_t *inst, mininez_coverage_t *cov);
+/* Writes the profile to path, adding the counts of the profile there */
+int mininez_coverage_write(mininez_coverage_t *cov, mininez_runtime_t *r, const char *path);
+/* Sites executed at least once */
+uint16_t mininez_coverage_hits(mininez_coverage_t *cov);
+void mininez_coverage_dispose(mininez_coverage_t *cov);
+
+/* Profile-Guided Layout
+ * Returns a copy of inst laid out by a coverage profile of it: productions
+ * by descending call count, each with the blocks that ran contiguous in
+ * their original order, and every block that never ran moved to the end.
+ * Choices keep their order (PEG choice is ordered); their cold alternatives
+ * move out of line. A Jump is added where a block lost its fall-through
+ * successor.
+ */
+mininez_inst_t *mininez_layout(mininez_runtime_t *r, mininez_inst_t *inst, const char *path);
+
+#endif
@@ -224,6 +224,12 @@ mininez_inst_t* mininez_dump_inst(mininez_inst_t* inst, mininez_runtime_t *r) {
       inst++;
       break;
     }
+    CASE_(Cov);
+    CASE_(Trap) {
+      fprintf(stderr, " %u", *((uint16_t *)inst));
+      inst+=2;
+      break;
+    }
     CASE_(Jump) {
       fprintf(stderr, " %d", *((int16_t *)inst));
       inst+=2;
@@ -330,7 +336,8 @@ mininez_inst_t* mininez_dump_inst(mininez_inst_t* inst, mininez_runtime_t *r) {
 }
 
 void mininez_dump_code(mininez_inst_t* inst, mininez_runtime_t *r) {
-  for (uint64_t i = 0; i < r->C->bytecode_length; i++) {
+  uint64_t length = mininez_code_length(inst);
+  for (uint64_t i = 0; i < length; i++) {
     fprintf(stderr, "[%llu]", i);
     inst = mininez_dump_inst(inst, r);
   }
@@ -338,6 +345,167 @@ void mininez_dump_code(mininez_inst_t* inst, mininez_runtime_t *r) {
 
 #endif
 
+/* Constant Pool
+ * Constants are deduplicated as they are read, and refs counts the
+ * instructions using each one so that the hot ones can be laid out first.
+ */
+static uint16_t Loader_AddSet(mininez_bytecode_loader *loader, bitset_t *set) {
+  mininez_constant_t *C = loader->r->C;
+  uint16_t id;
+  for (id = 0; id < loader->set_count; id++) {
+    if (memcmp(&C->sets[id], set, sizeof(bitset_t)) == 0) {
+      break;
+    }
+  }
+  if (id == loader->set_count) {
+    C->sets[loader->set_count++] = *set;
+  }
+  loader->set_refs[id]++;
+  return id;
+}
+
+static uint16_t Loader_AddStr(mininez_bytecode_loader *loader, const char *str, unsigned len) {
+  mininez_constant_t *C = loader->r->C;
+  uint16_t id;
+  for (id = 0; id < loader->str_count; id++) {
+    const char *s = C->strs[id];
+    if (s == NULL ? str == NULL : (str != NULL && pstring_length(s) == len && memcmp(s, str, len) == 0)) {
+      break;
+    }
+  }
+  if (id == loader->str_count) {
+    C->strs[loader->str_count++] = str == NULL ? NULL : pstring_alloc(str, len);
+  }
+  loader->str_refs[id]++;
+  return id;
+}
+
+static uint16_t Loader_AddTag(mininez_bytecode_loader *loader, const char *tag, unsigned len) {
+  mininez_constant_t *C = loader->r->C;
+  const char *sym = tag == NULL ? NULL : mininez_intern_symbol(C, tag, len);
+  uint16_t id;
+  for (id = 0; id < loader->tag_count; id++) {
+    if (C->tags[id] == sym) {
+      return id;
+    }
+  }
+  C->tags[loader->tag_count] = sym;
+  return loader->tag_count++;
+}
+
+/* takes index and table; duplicates are freed */
+static uint16_t Loader_AddTable(mininez_bytecode_loader *loader, uint8_t *index, uint16_t *table) {
+  mininez_constant_t *C = loader->r->C;
+  uint16_t len = mininez_table_length(index);
+  uint16_t id;
+  for (id = 0; id < loader->table_count; id++) {
+    if (memcmp(C->jump_indexs[id], index, 256) == 0
+        && memcmp(C->jump_tables[id], table, sizeof(uint16_t) * len) == 0) {
+      break;
+    }
+  }
+  if (id == loader->table_count) {
+    C->jump_indexs[id] = index;
+    C->jump_tables[id] = table;
+    loader->table_count++;
+  } else {
+    VM_FREE(index);
+    VM_FREE(table);
+  }
+  loader->table_refs[id]++;
+  return id;
+}
+
+typedef struct loader_rank_t {
+  uint32_t refs;
+  uint16_t id;
+} loader_rank_t;
+
+static int Loader_CompareRank(const void *a, const void *b) {
+  const loader_rank_t *x = (const loader_rank_t *)a;
+  const loader_rank_t *y = (const loader_rank_t *)b;
+  if (x->refs != y->refs) {
+    return x->refs > y->refs ? -1 : 1;
+  }
+  return (int)x->id - (int)y->id;
+}
+
+/* order[new id] = old id, most used first; map[old id] = new id */
+static uint16_t *Loader_Rank(uint32_t *refs, uint16_t size, uint16_t *order) {
+  loader_rank_t *ranks = (loader_rank_t *) VM_MALLOC(sizeof(loader_rank_t) * (size + 1));
+  uint16_t *map = (uint16_t *) VM_MALLOC(sizeof(uint16_t) * (size + 1));
+  for (uint16_t i = 0; i < size; i++) {
+    ranks[i].refs = refs[i];
+    ranks[i].id = i;
+  }
+  qsort(ranks, size, sizeof(loader_rank_t), Loader_CompareRank);
+  for (uint16_t i = 0; i < size; i++) {
+    order[i] = ranks[i].id;
+    map[ranks[i].id] = i;
+  }
+  VM_FREE(ranks);
+  return map;
+}
+
+/* Renumbers sets, strings and dispatch tables by use and rewrites the
+ * operands that refer to them */
+static void Loader_SortConstant(mininez_bytecode_loader *loader) {
+  mininez_constant_t *C = loader->r->C;
+  uint16_t *order = (uint16_t *) VM_MALLOC(sizeof(uint16_t) * ((size_t)C->set_size + C->str_size + C->table_size + 1));
+  uint16_t *set_map = Loader_Rank(loader->set_refs, loader->set_count, order);
+  bitset_t *sets = (bitset_t *) VM_MALLOC(sizeof(bitset_t) * (loader->set_count + 1));
+  for (uint16_t i = 0; i < loader->set_count; i++) {
+    sets[i] = C->sets[order[i]];
+  }
+  memcpy(C->sets, sets, sizeof(bitset_t) * loader->set_count);
+  VM_FREE(sets);
+
+  uint16_t *str_map = Loader_Rank(loader->str_refs, loader->str_count, order);
+  const char **strs = (const char **) VM_MALLOC(sizeof(const char *) * (loader->str_count + 1));
+  for (uint16_t i = 0; i < loader->str_count; i++) {
+    strs[i] = C->strs[order[i]];
+  }
+  memcpy(C->strs, strs, sizeof(const char *) * loader->str_count);
+  VM_FREE(strs);
+
+  uint16_t *table_map = Loader_Rank(loader->table_refs, loader->table_count, order);
+  uint8_t **indexs = (uint8_t **) VM_MALLOC(sizeof(uint8_t *) * (loader->table_count + 1));
+  uint16_t **tables = (uint16_t **) VM_MALLOC(sizeof(uint16_t *) * (loader->table_count + 1));
+  for (uint16_t i = 0; i < loader->table_count; i++) {
+    indexs[i] = C->jump_indexs[order[i]];
+    tables[i] = C->jump_tables[order[i]];
+  }
+  memcpy(C->jump_indexs, indexs, sizeof(uint8_t *) * loader->table_count);
+  memcpy(C->jump_tables, tables, sizeof(uint16_t *) * loader->table_count);
+  VM_FREE(indexs);
+  VM_FREE(tables);
+  VM_FREE(order);
+
+  mininez_inst_t *pc = loader->head;
+  for (uint64_t i = 0; i < loader->info->bytecode_length; i++) {
+    uint16_t *operand = (uint16_t *)(pc + 1);
+    switch (*pc) {
+    case Set: case NSet: case OSet: case RSet:
+      *operand = set_map[*operand];
+      break;
+    case Str: case NStr: case OStr: case RStr: case TReplace:
+      *operand = str_map[*operand];
+      break;
+    case TEnd:
+      operand = (uint16_t *)(pc + 4);
+      *operand = str_map[*operand];
+      break;
+    case Dispatch: case DDispatch:
+      *operand = table_map[*operand];
+      break;
+    }
+    pc += opcode_length(*pc);
+  }
+  VM_FREE(set_map);
+  VM_FREE(str_map);
+  VM_FREE(table_map);
+}
+
 mininez_inst_t* mininez_load_instruction(mininez_inst_t* inst, mininez_bytecode_loader* loader) {
   uint8_t opcode = *inst;
   inst++;
@@ -393,16 +561,16 @@ mininez_inst_t* mininez_load_instruction(mininez_inst_t* inst, mininez_bytecode_
     CASE_(NSet);
     CASE_(OSet);
     CASE_(RSet) {
-      bitset_t* set = &loader->r->C->sets[loader->set_count];
-      bitset_init(set);
+      bitset_t set;
+      bitset_init(&set);
       size_t len = Loader_Read16(loader);
       for (unsigned i = 0; i < len; i++) {
         unsigned v = Loader_Read8(loader);
         if (v) {
-          bitset_set(set, i);
+          bitset_set(&set, i);
         }
       }
-      inst = Loader_Write16(inst, loader->set_count++);
+      inst = Loader_Write16(inst, Loader_AddSet(loader, &set));
       break;
     }
     CASE_(Str);
@@ -412,24 +580,22 @@ mininez_inst_t* mininez_load_instruction(mininez_inst_t* inst, mininez_bytecode_
       uint16_t len = Loader_Read16(loader);
       char *str = peek(loader->buf, loader->info);
       skip(loader->info, len);
-      loader->r->C->strs[loader->str_count] = pstring_alloc(str, (unsigned)len);
-      inst = Loader_Write16(inst, loader->str_count++);
+      inst = Loader_Write16(inst, Loader_AddStr(loader, str, len));
       break;
     }
     CASE_(Dispatch);
     CASE_(DDispatch) {
       uint16_t len = Loader_Read16(loader);
-      loader->r->C->jump_indexs[loader->table_count] = (uint8_t *)VM_MALLOC(sizeof(uint8_t) * len);
+      uint8_t *index = (uint8_t *)VM_MALLOC(sizeof(uint8_t) * len);
       for (size_t i = 0; i < len; i++) {
-        uint8_t index = Loader_Read8(loader);
-        loader->r->C->jump_indexs[loader->table_count][i] = index;
+        index[i] = Loader_Read8(loader);
       }
       len = Loader_Read16(loader);
-      loader->r->C->jump_tables[loader->table_count] = (uint16_t *)VM_MALLOC(sizeof(uint16_t) * len);
+      uint16_t *table = (uint16_t *)VM_MALLOC(sizeof(uint16_t) * len);
       for (size_t i = 0; i < len; i++) {
-        loader->r->C->jump_tables[loader->table_count][i] = Loader_Read16(loader);
+        table[i] = Loader_Read16(loader);
       }
-      inst = Loader_Write16(inst, loader->table_count++);
+      inst = Loader_Write16(inst, Loader_AddTable(loader, index, table));
       break;
     }
     CASE_(TBegin) {
@@ -441,54 +607,34 @@ mininez_inst_t* mininez_load_instruction(mininez_inst_t* inst, mininez_bytecode_
       *(int8_t *)inst = Loader_ReadS8(loader);
       inst++;
       uint16_t len = Loader_Read16(loader);
-      if (len == 0) {
-        loader->r->C->tags[loader->tag_count] = 0;
-        inst = Loader_Write16(inst, loader->tag_count++);
-      } else {
-        char *tag = peek(loader->buf, loader->info);
-        skip(loader->info, len);
-        loader->r->C->tags[loader->tag_count] = pstring_alloc(tag, (unsigned)len);
-        inst = Loader_Write16(inst, loader->tag_count++);
-      }
+      char *tag = peek(loader->buf, loader->info);
+      skip(loader->info, len);
+      inst = Loader_Write16(inst, Loader_AddTag(loader, len == 0 ? NULL : tag, len));
       len = Loader_Read16(loader);
-      if (len == 0) {
-        loader->r->C->strs[loader->str_count] = NULL;
-        inst = Loader_Write16(inst, loader->str_count++);
-      } else {
-        char *str = peek(loader->buf, loader->info);
-        skip(loader->info, len);
-        loader->r->C->strs[loader->str_count] = pstring_alloc(str, (unsigned)len);
-        inst = Loader_Write16(inst, loader->str_count++);
-      }
+      char *str = peek(loader->buf, loader->info);
+      skip(loader->info, len);
+      inst = Loader_Write16(inst, Loader_AddStr(loader, len == 0 ? NULL : str, len));
       break;
     }
     CASE_(TTag) {
       uint16_t len = Loader_Read16(loader);
       char *tag = peek(loader->buf, loader->info);
       skip(loader->info, len);
-      loader->r->C->tags[loader->tag_count] = pstring_alloc(tag, (unsigned)len);
-      inst = Loader_Write16(inst, loader->tag_count++);
+      inst = Loader_Write16(inst, Loader_AddTag(loader, tag, len));
       break;
     }
     CASE_(TReplace) {
       uint16_t len = Loader_Read16(loader);
       char *str = peek(loader->buf, loader->info);
       skip(loader->info, len);
-      loader->r->C->strs[loader->str_count] = pstring_alloc(str, (unsigned)len);
-      inst = Loader_Write16(inst, loader->str_count++);
+      inst = Loader_Write16(inst, Loader_AddStr(loader, str, len));
       break;
     }
     CASE_(TLink) {
       uint16_t len = Loader_Read16(loader);
-      if (len == 0) {
-        loader->r->C->tags[loader->tag_count] = NULL;
-        inst = Loader_Write16(inst, loader->tag_count++);
-      } else {
-        char *label = peek(loader->buf, loader->info);
-        skip(loader->info, len);
-        loader->r->C->tags[loader->tag_count] = pstring_alloc(label, (unsigned)len);
-        inst = Loader_Write16(inst, loader->tag_count++);
-      }
+      char *label = peek(loader->buf, loader->info);
+      skip(loader->info, len);
+      inst = Loader_Write16(inst, Loader_AddTag(loader, len == 0 ? NULL : label, len));
       break;
     }
     CASE_(TFold) {
@@ -497,8 +643,7 @@ mininez_inst_t* mininez_load_instruction(mininez_inst_t* inst, mininez_bytecode_
       uint16_t len = Loader_Read16(loader);
       char *label = peek(loader->buf, loader->info);
       skip(loader->info, len);
-      loader->r->C->tags[loader->tag_count] = pstring_alloc(label, (unsigned)len);
-      inst = Loader_Write16(inst, loader->tag_count++);
+      inst = Loader_Write16(inst, Loader_AddTag(loader, label, len));
       break;
     }
     CASE_(Lookup);
@@ -550,21 +695,21 @@ mininez_inst_t* mininez_load_code(mininez_runtime_t* r, const char* code_file_na
   C->str_size = read16(buf, &info);
   C->tag_size = read16(buf, &info);
   C->table_size = read16(buf, &info);
-  C->start_point = 4; // Default Start Point
   mininez_init_constant(C);
   r->C = C;
 
   // Memo Size
   uint16_t w = read16(buf, &info);
   uint16_t n = read16(buf, &info);
+  C->memo_width = w;
+  C->memo_points = n;
   ParserContext_initMemo(r->ctx, w, n);
 
   info.bytecode_length = read64(buf, &info);
-  r->C->bytecode_length = info.bytecode_length;
   info.bytecode_size = read64(buf, &info);
   dump_bytecode_info(&info);
 
-  head = inst = VM_MALLOC(sizeof(*inst) * info.bytecode_size);
+  head = inst = mininez_alloc_code(sizeof(*inst) * info.bytecode_size, info.bytecode_length, 4); // Default Start Point
   memset(inst, 0, sizeof(*inst) * info.bytecode_length);
 
   mininez_bytecode_loader loader;
@@ -577,6 +722,9 @@ mininez_inst_t* mininez_load_code(mininez_runtime_t* r, const char* code_file_na
   loader.str_count = 0;
   loader.tag_count = 0;
   loader.table_count = 0;
+  loader.set_refs = (uint32_t *) calloc((size_t)C->set_size + 1, sizeof(uint32_t));
+  loader.str_refs = (uint32_t *) calloc((size_t)C->str_size + 1, sizeof(uint32_t));
+  loader.table_refs = (uint32_t *) calloc((size_t)C->table_size + 1, sizeof(uint32_t));
 
   /* load bytecode body */
   for(uint64_t i = 0; i < info.bytecode_length; i++) {
@@ -584,6 +732,17 @@ mininez_inst_t* mininez_load_code(mininez_runtime_t* r, const char* code_file_na
     inst = mininez_load_instruction(inst, &loader);
   }
 
+  /* only the distinct constants remain */
+  C->set_size = loader.set_count;
+  C->str_size = loader.str_count;
+  C->tag_size = loader.tag_count;
+  C->table_size = loader.table_count;
+  Loader_SortConstant(&loader);
+  mininez_pack_constant(C);
+  VM_FREE(loader.set_refs);
+  VM_FREE(loader.str_refs);
+  VM_FREE(loader.table_refs);
+
 #if MININEZ_DEBUG == 1
   mininez_dump_code(head, r);
 #endif
@@ -592,5 +751,5 @@ mininez_inst_t* mininez_load_code(mininez_runtime_t* r, const char* code_file_na
 }
 
 void mininez_dispose_instructions(mininez_inst_t* inst) {
-  VM_FREE(inst);
+  VM_FREE((mininez_code_header_t *)inst - 1);
 }
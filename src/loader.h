@@ -24,6 +24,10 @@ typedef struct mininez_bytecode_loader {
   uint16_t str_count;
   uint16_t tag_count;
   uint16_t table_count;
+  /* instructions using each constant */
+  uint32_t *set_refs;
+  uint32_t *str_refs;
+  uint32_t *table_refs;
 } mininez_bytecode_loader;
 
 /* Loader Function */
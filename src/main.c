@@ -1,18 +1,58 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/time.h>
 
 #include "nezvm.h"
 #include "loader.h"
+#include "batch.h"
+#include "speculate.h"
+#include "image.h"
+#include "stream.h"
+#include "program.h"
+#include "output.h"
+#include "flat.h"
+#include "cache.h"
+#include "project.h"
+#include "profile.h"
+#include "perf.h"
+#include "layout.h"
+#include "optimize.h"
+#include "sample.h"
 
 static void nez_ShowUsage() {
   fprintf(stderr, "\nnezvm <command> optional files\n");
   fprintf(stderr, "  -g <filename> Specify an Nez grammar bytecode file\n");
   fprintf(stderr, "  -i <filename> Specify an input file\n");
-  // fprintf(stderr, "  -o <filename> Specify an output file\n");
-  fprintf(stderr, "  -t <type>     Specify an output type (tree, none)\n");
+  fprintf(stderr, "  --save-image <filename> Write the loaded grammar as a mappable image\n");
+  fprintf(stderr, "  --load-image <filename> Use a grammar image instead of -g\n");
+  fprintf(stderr, "  --symbols     Print the tag and label ids of the grammar as a C enum\n");
+  fprintf(stderr, "  --flat        Build a flat, index-based tree (-t tree prints it)\n");
+  fprintf(stderr, "  --cache <dir> Reuse flat trees of inputs parsed before (implies --flat)\n");
+  fprintf(stderr, "  --cache-limit <MB> Size limit of the --cache directory (default: 256)\n");
+  fprintf(stderr, "  --project <spec> Print only the nodes Tag or Tag$label=text, comma separated, as JSON lines (implies --flat)\n");
+  fprintf(stderr, "  --folded <filename> Profile productions and write folded stacks (profiling build)\n");
+  fprintf(stderr, "  --heatmap <filename> Write where the parser backtracks in the input (profiling build)\n");
+  fprintf(stderr, "  --memory      Print the memory held by each runtime structure after parsing\n");
+  fprintf(stderr, "  --perf-counters Count cycles, instructions and misses of the parse (Linux perf)\n");
+  fprintf(stderr, "  --coverage <filename> Count the blocks of the grammar run, adding to the profile there\n");
+  fprintf(stderr, "  --layout <filename> Lay out the grammar code by a --coverage profile, hot code first\n");
+  fprintf(stderr, "  --optimize    Thread jumps and drop dead code and needless choices from the grammar code\n");
+  fprintf(stderr, "  --sample <filename> Sample the productions run and write folded stacks\n");
+  fprintf(stderr, "  --sample-hz <num> Sampling rate of --sample (default: %d)\n", MININEZ_SAMPLE_DEFAULT_HZ);
+  fprintf(stderr, "  --max-steps <num> Abort a parse after this many calls and backward jumps\n");
+  fprintf(stderr, "  --timeout <msec> Abort a parse running longer (per file with -b)\n");
+  fprintf(stderr, "  -b <source>   Parse many files: a directory, a glob pattern or @<listfile>\n");
+  fprintf(stderr, "  --latency     Report per-file parse time and instruction percentiles, and the slowest files of -b\n");
+  fprintf(stderr, "  -s <name>     Parse a single input in parallel, speculating on production <name>\n");
+  fprintf(stderr, "  -S <chars>    Delimiters that may precede <name> for -s (default: \",\")\n");
+  fprintf(stderr, "  -j <num>      Number of worker threads for -b and -s (default: online CPUs)\n");
+  fprintf(stderr, "  -o <filename> Specify an output file (default: stdout)\n");
+  fprintf(stderr, "  -t <type>     Specify an output type (tree, json, binary, events, none)\n");
   fprintf(stderr, "  -h            Display this help and exit\n\n");
   exit(EXIT_FAILURE);
 }
@@ -23,16 +63,239 @@ static uint64_t timer() {
   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/* the layout is taken before optimizing, as profiles are of the code as loaded */
+static mininez_inst_t *nez_LoadGrammar(mininez_runtime_t *r, const char *syntax_file, const char *image_file, const char *layout_file, int optimize) {
+  mininez_inst_t *inst = image_file != NULL ? mininez_load_image(r, image_file) : mininez_load_code(r, syntax_file);
+  if (layout_file != NULL) {
+    mininez_inst_t *code = mininez_layout(r, inst, layout_file);
+    if (image_file == NULL) {
+      mininez_dispose_instructions(inst);
+    }
+    inst = code;
+  }
+  if (optimize) {
+    mininez_optimize_stats_t stats;
+    mininez_inst_t *code = mininez_optimize(r, inst, &stats);
+    mininez_optimize_report(&stats, stderr);
+    if (image_file == NULL || layout_file != NULL) {
+      mininez_dispose_instructions(inst);
+    }
+    inst = code;
+  }
+  return inst;
+}
+
+/* Opens the counters of --perf-counters; NULL when none can be counted */
+static mininez_perf_t *nez_OpenPerf(mininez_perf_t *perf) {
+  if (mininez_perf_open(perf) == 0) {
+    fprintf(stderr, "perf counters unavailable: %s\n", strerror(perf->error));
+    return NULL;
+  }
+  return perf;
+}
+
+static void nez_ReportPerf(mininez_perf_t *perf, size_t bytes) {
+  if (perf != NULL) {
+    mininez_perf_report(perf, bytes, stderr);
+    mininez_perf_close(perf);
+  }
+}
+
+static void nez_StartSampling(const char *sample_file, mininez_constant_t *C, unsigned hz) {
+  if (sample_file != NULL && mininez_sample_start(C, hz) != 0) {
+    nez_PrintErrorInfo("sample error: cannot set the profiling timer");
+  }
+}
+
+static void nez_ReportSamples(const char *sample_file) {
+  if (sample_file != NULL) {
+    mininez_sample_stop();
+    mininez_sample_report(stderr);
+    if (mininez_sample_write_folded(sample_file) != 0) {
+      fprintf(stderr, "sample error: cannot write %s\n", sample_file);
+    }
+    mininez_sample_dispose();
+  }
+}
+
+/* image code lives in the mapping released together with the constant pool */
+static void nez_DisposeGrammar(mininez_inst_t *inst, const char *image_file, const char *layout_file, int optimize) {
+  if (image_file == NULL || layout_file != NULL || optimize) {
+    mininez_dispose_instructions(inst);
+  }
+}
+
+static int nez_RunBatch(const char *syntax_file, const char *image_file, const char *layout_file, int optimize, const char *source, int nthreads, const char *output_type, const char *output_file, int perf_counters, const char *sample_file, unsigned sample_hz, int latency, uint64_t max_steps, uint64_t timeout_ns) {
+  mininez_batch_result_t result;
+  mininez_batch_latency_t *latency_buf = NULL;
+  if (latency) {
+    latency_buf = (mininez_batch_latency_t *) VM_MALLOC(sizeof(mininez_batch_latency_t));
+  }
+  mininez_batch_t *b = mininez_batch_create();
+  if (mininez_batch_collect(b, source) < 0) {
+    nez_PrintErrorInfo("batch error: cannot read input source");
+  }
+  mininez_runtime_t *r = mininez_create_runtime(NULL, 0);
+  mininez_inst_t *inst = nez_LoadGrammar(r, syntax_file, image_file, layout_file, optimize);
+  int output_format = output_type != NULL ? mininez_output_format(output_type) : -1;
+  int output_fd = STDOUT_FILENO;
+  if (output_file != NULL) {
+    output_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+      nez_PrintErrorInfo("output error: cannot open file");
+    }
+  }
+  mininez_set_limits(r, max_steps, timeout_ns); /* the workers fork r */
+  mininez_perf_t perf_buf;
+  mininez_perf_t *perf = perf_counters ? nez_OpenPerf(&perf_buf) : NULL;
+  if (perf != NULL) {
+    mininez_perf_start(perf);
+  }
+  nez_StartSampling(sample_file, r->C, sample_hz);
+  int written = mininez_batch_run(r, inst, b, nthreads, output_format, output_fd, stdout, latency_buf, &result);
+  if (perf != NULL) {
+    mininez_perf_stop(perf);
+  }
+  fprintf(stderr, "\n========= Batch Result =========\n");
+  mininez_batch_report(&result, stderr);
+  if (latency_buf != NULL) {
+    fprintf(stderr, "\n========= Latency =========\n");
+    mininez_batch_latency_report(b, latency_buf, stderr);
+    VM_FREE(latency_buf);
+  }
+  nez_ReportPerf(perf, result.bytes);
+  nez_ReportSamples(sample_file);
+  if (written != 0) {
+    nez_PrintErrorInfo("output error: cannot write tree");
+  }
+  if (output_fd != STDOUT_FILENO) {
+    close(output_fd);
+  }
+  mininez_dispose_runtime(r);
+  nez_DisposeGrammar(inst, image_file, layout_file, optimize);
+  mininez_batch_dispose(b);
+  return result.files == result.success ? 0 : 1;
+}
+
 int main(int argc, char *const argv[]) {
   mininez_runtime_t* r = NULL;
   mininez_inst_t *inst = NULL;
   const char *syntax_file = NULL;
   const char *input_file = NULL;
   const char *output_type = NULL;
+  const char *output_file = NULL;
+  const char *batch_source = NULL;
+  const char *image_file = NULL;
+  const char *save_image = NULL;
+  const char *coverage_file = NULL;
+  const char *layout_file = NULL;
+  int optimize = 0;
+  int dump_symbols = 0;
+  int memory = 0;
+  int perf_counters = 0;
+  int latency = 0;
+  uint64_t max_steps = 0;
+  uint64_t timeout_ns = 0;
+  const char *sample_file = NULL;
+  unsigned sample_hz = 0;
+  const char *speculation = NULL;
+  const char *delims = ",";
+  int flat = 0;
+  const char *cache_dir = NULL;
+  const char *project_spec = NULL;
+  size_t cache_limit = MININEZ_CACHE_DEFAULT_LIMIT;
   const char *orig_argv0 = argv[0];
+  int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  static const struct option long_options[] = {
+    {"save-image", required_argument, NULL, 'W'},
+    {"load-image", required_argument, NULL, 'L'},
+    {"symbols", no_argument, NULL, 'Y'},
+    {"flat", no_argument, NULL, 'F'},
+    {"cache", required_argument, NULL, 'C'},
+    {"cache-limit", required_argument, NULL, 'M'},
+    {"project", required_argument, NULL, 'P'},
+    {"folded", required_argument, NULL, 'Q'},
+    {"heatmap", required_argument, NULL, 'H'},
+    {"memory", no_argument, NULL, 'U'},
+    {"perf-counters", no_argument, NULL, 'K'},
+    {"coverage", required_argument, NULL, 'V'},
+    {"layout", required_argument, NULL, 'A'},
+    {"optimize", no_argument, NULL, 'O'},
+    {"sample", required_argument, NULL, 'X'},
+    {"sample-hz", required_argument, NULL, 'N'},
+    {"latency", no_argument, NULL, 'R'},
+    {"max-steps", required_argument, NULL, 'E'},
+    {"timeout", required_argument, NULL, 'T'},
+    {NULL, 0, NULL, 0}
+  };
   int opt;
-  while ((opt = getopt(argc, argv, "g:i:t:c:h:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "g:i:t:o:c:b:j:s:S:h:", long_options, NULL)) != -1) {
     switch (opt) {
+    case 'W':
+      save_image = optarg;
+      break;
+    case 'L':
+      image_file = optarg;
+      break;
+    case 'Y':
+      dump_symbols = 1;
+      break;
+    case 'F':
+      flat = 1;
+      break;
+    case 'C':
+      cache_dir = optarg;
+      flat = 1;
+      break;
+    case 'P':
+      project_spec = optarg;
+      flat = 1;
+      break;
+    case 'Q':
+      if (!MININEZ_PROFILE) {
+        nez_PrintErrorInfo("--folded needs a profiling build (-DMININEZ_PROFILE=ON)");
+      }
+      mininez_profile_productions(optarg);
+      break;
+    case 'H':
+      if (!MININEZ_PROFILE) {
+        nez_PrintErrorInfo("--heatmap needs a profiling build (-DMININEZ_PROFILE=ON)");
+      }
+      mininez_profile_heatmap(optarg);
+      break;
+    case 'U':
+      memory = 1;
+      break;
+    case 'K':
+      perf_counters = 1;
+      break;
+    case 'V':
+      coverage_file = optarg;
+      break;
+    case 'A':
+      layout_file = optarg;
+      break;
+    case 'O':
+      optimize = 1;
+      break;
+    case 'X':
+      sample_file = optarg;
+      break;
+    case 'N':
+      sample_hz = (unsigned)atoi(optarg);
+      break;
+    case 'R':
+      latency = 1;
+      break;
+    case 'E':
+      max_steps = strtoull(optarg, NULL, 10);
+      break;
+    case 'T':
+      timeout_ns = (uint64_t)(atof(optarg) * 1000000.0);
+      break;
+    case 'M':
+      cache_limit = (size_t)atol(optarg) * 1024 * 1024;
+      break;
     case 'g':
       syntax_file = optarg;
       break;
@@ -42,41 +305,257 @@ int main(int argc, char *const argv[]) {
     case 't':
       output_type = optarg;
       break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 'b':
+      batch_source = optarg;
+      break;
+    case 's':
+      speculation = optarg;
+      break;
+    case 'S':
+      delims = optarg;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
     case 'h':
       nez_ShowUsage();
     default: /* '?' */
       nez_ShowUsage();
     }
   }
-  if (syntax_file == NULL) {
+  if (syntax_file == NULL && image_file == NULL) {
     nez_PrintErrorInfo("not input syntaxfile");
   }
+  if (output_type != NULL && strcmp(output_type, "events") && strcmp(output_type, "none") && mininez_output_format(output_type) == -1) {
+    nez_PrintErrorInfo("unknown output type: use -t tree, json, binary, events or none");
+  }
+  if (save_image != NULL || dump_symbols) {
+    r = mininez_create_runtime(NULL, 0);
+    inst = nez_LoadGrammar(r, syntax_file, image_file, layout_file, optimize);
+    if (save_image != NULL && mininez_save_image(r, inst, save_image) != 0) {
+      nez_PrintErrorInfo("image error: cannot write image");
+    }
+    if (dump_symbols) {
+      mininez_dump_symbols(r->C, stdout);
+    }
+    mininez_dispose_runtime(r);
+    nez_DisposeGrammar(inst, image_file, layout_file, optimize);
+    if (input_file == NULL && batch_source == NULL) {
+      return 0;
+    }
+  }
+  if (coverage_file != NULL && (batch_source != NULL || speculation != NULL || layout_file != NULL || optimize)) {
+    nez_PrintErrorInfo("--coverage counts one parse of the grammar as loaded: no -b, -s, --layout or --optimize");
+  }
+  int events = output_type != NULL && !strcmp(output_type, "events");
+  if (cache_dir != NULL && (batch_source != NULL || speculation != NULL || events)) {
+    nez_PrintErrorInfo("--cache keeps the flat tree of one plain parse: no -b, -s or -t events");
+  }
+  if (flat && (batch_source != NULL || speculation != NULL || events)) {
+    nez_PrintErrorInfo("--flat and --project build the tree of one plain parse: no -b, -s or -t events");
+  }
+  if (batch_source != NULL) {
+    if (memory) {
+      nez_PrintErrorInfo("--memory reports a single input, not -b");
+    }
+    if (events) {
+      nez_PrintErrorInfo("-t events streams a single input, not -b");
+    }
+    return nez_RunBatch(syntax_file, image_file, layout_file, optimize, batch_source, nthreads, output_type, output_file, perf_counters, sample_file, sample_hz, latency, max_steps, timeout_ns);
+  }
+  if (latency) {
+    nez_PrintErrorInfo("--latency reports many inputs: use it with -b");
+  }
+  int output_format = output_type != NULL ? mininez_output_format(output_type) : -1;
+  if (project_spec != NULL && (output_format != -1 || cache_dir != NULL || speculation != NULL)) {
+    nez_PrintErrorInfo("--project takes no -t format, --cache or -s");
+  }
+  if (flat && output_format != -1 && output_format != MININEZ_OUTPUT_TEXT) {
+    nez_PrintErrorInfo("flat trees are printed with -t tree only");
+  }
+  int output_fd = STDOUT_FILENO;
+  if (output_file != NULL) {
+    output_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+      nez_PrintErrorInfo("output error: cannot open file");
+    }
+  }
   size_t len;
   char* text = load_file(input_file, &len);
   r = mininez_create_runtime(text, len);
-  inst = mininez_load_code(r, syntax_file);
+  inst = nez_LoadGrammar(r, syntax_file, image_file, layout_file, optimize);
+  mininez_set_limits(r, max_steps, timeout_ns);
+  mininez_coverage_t coverage;
+  mininez_inst_t *uncovered = NULL;
+  if (coverage_file != NULL) {
+    uncovered = inst;
+    inst = mininez_cover(r, inst, &coverage);
+    r->coverage = coverage.counts;
+  }
+  mininez_inst_t *recognizer = NULL;
+  if (output_type != NULL && !strcmp(output_type, "none") && speculation == NULL && !flat) {
+    recognizer = mininez_strip_tree(r, inst);
+  }
+  mininez_projection_t projection;
+  mininez_inst_t *projected = NULL;
+  if (project_spec != NULL) {
+    mininez_projection_init(&projection, r->C, project_spec);
+    projected = mininez_project_program(r, inst, &projection);
+  }
+  mininez_cache_t cache;
+  int cached = 0;
+  if (cache_dir != NULL) {
+    mininez_cache_init(&cache, cache_dir, cache_limit, r, inst);
+  }
   int result;
-  mininez_init_vm(r->ctx);
-  r->ctx->pos = r->ctx->inputs;
+  mininez_flat_tree_t flat_tree;
+  mininez_speculation_result_t speculation_result;
   uint64_t start, end;
+  mininez_perf_t perf_buf;
+  mininez_perf_t *perf = perf_counters ? nez_OpenPerf(&perf_buf) : NULL;
+  if (perf != NULL) {
+    mininez_perf_start(perf);
+  }
+  nez_StartSampling(sample_file, r->C, sample_hz);
   start = timer();
-  result = mininez_parse(r, inst);
+  if (speculation != NULL) {
+    result = mininez_speculate(r, inst, speculation, delims, nthreads, &speculation_result);
+  } else if (events) {
+    static mininez_event_sink_t sink;
+    mininez_stream_t stream;
+    FILE *fp = output_file != NULL ? fdopen(output_fd, "w") : stdout;
+    mininez_event_sink_init(&sink, fp);
+    mininez_stream_init(&stream, mininez_event_sink, &sink);
+    result = mininez_stream_parse(r, inst, &stream);
+    mininez_event_sink_flush(&sink);
+    if (fp != stdout) {
+      fclose(fp); /* closes output_fd */
+      output_fd = STDOUT_FILENO;
+    }
+  } else if (flat) {
+    if (cache_dir != NULL) {
+      cached = mininez_cache_load(&cache, r->ctx->inputs, r->ctx->length, &flat_tree);
+    }
+    if (cached) {
+      result = 1;
+      r->ctx->pos = r->ctx->inputs + r->ctx->length;
+    } else {
+      mininez_flat_init(&flat_tree);
+      if (projected != NULL) {
+        flat_tree.projection = &projection;
+      }
+      result = mininez_flat_parse(r, projected != NULL ? projected : inst, &flat_tree);
+      if (cache_dir != NULL && result == 1 && (size_t)(r->ctx->pos - r->ctx->inputs) == r->ctx->length) {
+        if (mininez_cache_store(&cache, &flat_tree) != 0) {
+          fprintf(stderr, "cache error: cannot write %s\n", cache_dir);
+        }
+      }
+    }
+  } else if (recognizer != NULL) {
+    mininez_init_vm(r->ctx);
+    r->ctx->pos = r->ctx->inputs;
+    result = mininez_recognize(r, recognizer);
+  } else {
+    mininez_init_vm(r->ctx);
+    r->ctx->pos = r->ctx->inputs;
+    result = mininez_parse(r, inst);
+  }
   end = timer();
+  if (perf != NULL) {
+    mininez_perf_stop(perf);
+  }
+  if (speculation != NULL) {
+    mininez_speculation_report(&speculation_result, stderr);
+  }
   fprintf(stderr, "ErapsedTime: %llu msec\n", (unsigned long long)end - start);
+  nez_ReportPerf(perf, r->ctx->length);
+  nez_ReportSamples(sample_file);
+  if (flat) {
+    fprintf(stderr, "Flat Tree: %u nodes, %zu bytes%s\n", flat_tree.size - 1, mininez_flat_memory(&flat_tree),
+            cache_dir == NULL ? "" : cached ? " (cache hit)" : " (cache miss)");
+  }
   fprintf(stderr, "\n========= Parse Result =========\n");
-  if (result) {
-    if (output_type != NULL && !strcmp(output_type, "tree")) {
-      dumpAST(r->ctx->left, 0, stderr);
+  if (result == MININEZ_ABORTED) {
+    fprintf(stderr, "\naborted: %s (%llu steps)\n", mininez_limit_name(r->limit_hit), (unsigned long long)r->steps);
+  } else if (result) {
+    if (projected != NULL && output_type == NULL) {
+      mininez_writer_t writer;
+      mininez_writer_init(&writer, output_fd);
+      size_t matches = mininez_project_write(&writer, &flat_tree, &projection);
+      if (mininez_writer_flush(&writer) != 0) {
+        nez_PrintErrorInfo("output error: cannot write matches");
+      }
+      mininez_writer_dispose(&writer);
+      fprintf(stderr, "Projection: %zu matches\n", matches);
+    } else if (output_format != -1) {
+      mininez_writer_t writer;
+      mininez_writer_init(&writer, output_fd);
+      if (flat) {
+        mininez_flat_write(&writer, &flat_tree);
+      } else {
+        mininez_write_tree(&writer, r->ctx->left, (mininez_output_format_t)output_format);
+      }
+      if (mininez_writer_flush(&writer) != 0) {
+        nez_PrintErrorInfo("output error: cannot write tree");
+      }
+      mininez_writer_dispose(&writer);
     }
-    if ((r->ctx->pos - r->ctx->inputs) != r->ctx->length) {
+    size_t consumed = r->ctx->pos - r->ctx->inputs;
+    if (consumed != r->ctx->length) {
       fprintf(stderr, "\nunconsume error\n");
+      if (recognizer != NULL) {
+        fprintf(stderr, "error position: %zu\n", r->error_pos > consumed ? r->error_pos : consumed);
+      }
     } else {
       fprintf(stderr, "\nsuccess\n");
     }
   } else {
     fprintf(stderr, "\nsyntax error\n");
+    if (recognizer != NULL) {
+      fprintf(stderr, "error position: %zu\n", r->error_pos);
+    }
+  }
+  if (coverage_file != NULL) {
+    if (mininez_coverage_write(&coverage, r, coverage_file) != 0) {
+      nez_PrintErrorInfo("coverage error: cannot write profile");
+    }
+    fprintf(stderr, "Coverage: %u of %u blocks run\n", mininez_coverage_hits(&coverage), coverage.size);
+  }
+  if (memory) {
+    MemoryUsage usage[MEMORY_KINDS];
+    mininez_memory(r, usage);
+    if (flat) {
+      /* the flat tree holds the nodes, not the context */
+      size_t bytes = mininez_flat_memory(&flat_tree);
+      usage[MEMORY_TREE].current += bytes;
+      usage[MEMORY_TREE].peak += bytes;
+      usage[MEMORY_TREE].allocs += flat_tree.mapped == 0;
+    }
+    fprintf(stderr, "\n========= Memory =========\n");
+    mininez_print_usage(usage, stderr);
+  }
+  if (recognizer != NULL) {
+    mininez_dispose_instructions(recognizer);
+  }
+  if (flat) {
+    mininez_flat_dispose(&flat_tree);
+  }
+  if (projected != NULL) {
+    mininez_dispose_instructions(projected);
+    mininez_projection_dispose(&projection);
+  }
+  if (output_fd != STDOUT_FILENO) {
+    close(output_fd);
+  }
+  if (uncovered != NULL) {
+    mininez_dispose_instructions(inst);
+    mininez_coverage_dispose(&coverage);
+    inst = uncovered;
   }
   mininez_dispose_runtime(r);
-  mininez_dispose_instructions(inst);
+  nez_DisposeGrammar(inst, image_file, layout_file, optimize);
   return 0;
 }
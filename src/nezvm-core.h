@@ -0,0 +1,692 @@
+/* VM Core
+ * Instantiated by nezvm.c once per variant:
+ *   MININEZ_VM_NAME  name of the generated parse function
+ *   MININEZ_VM_TREE  1: full tree construction
+ *                    0: recognition only; choice frames carry no tree or
+ *                       log index and the farthest failure is recorded
+ *   MININEZ_VM_DISPATCH  MININEZ_DISPATCH_* (default: MININEZ_DISPATCH)
+ * The handlers below are the same for every dispatch; OP_CASE makes them
+ * labels, switch cases or functions.
+ * No include guard on purpose.
+ */
+
+#if MININEZ_VM_TREE
+#define VM_PUSH_FAIL    PUSH_FAIL
+#define VM_POP_FAIL     POP_FAIL
+#define VM_STEP_FAIL    STEP_FAIL
+#define VM_POP_SUCC     POP_SUCC
+#define VM_POP_SUCC_POS POP_SUCC_POS
+#else
+#define VM_PUSH_FAIL    RECOG_PUSH_FAIL
+#define VM_POP_FAIL     RECOG_POP_FAIL
+#define VM_STEP_FAIL    RECOG_STEP_FAIL
+#define VM_POP_SUCC     RECOG_POP_SUCC
+#define VM_POP_SUCC_POS RECOG_POP_SUCC_POS
+#endif
+
+#ifndef MININEZ_VM_DISPATCH
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH
+#endif
+
+/* for the tail calls of MININEZ_DISPATCH_TAILCALL, once for every variant */
+#ifndef MININEZ_MUSTTAIL
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MININEZ_HAS_MUSTTAIL 1
+#define MININEZ_MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifndef MININEZ_MUSTTAIL
+#define MININEZ_HAS_MUSTTAIL 0
+#define MININEZ_MUSTTAIL
+#endif
+#endif
+
+/* Names the production the frame mininez_init_vm pushed returns from, and
+ * marks the runtime as running on this thread */
+#define VM_ENTER() do {\
+  if (ctx->stacks[ctx->unused_stack].value & MININEZ_CALL_FRAME) {\
+    ctx->stacks[ctx->unused_stack].num = *(const uint16_t *)(*pc == Nop ? pc + 1 : pc - 2);\
+  }\
+  if (!r->limit_held && (r->step_budget != 0 || r->timeout_ns != 0)) {\
+    mininez_limit_start(r);\
+  }\
+  mininez_running = r;\
+  MININEZ_TRACE3(parse__start, r, entry, ctx->pos - ctx->inputs);\
+} while(0)
+
+/* Counts a step (Call, backward Jump) against the limits of the parse */
+#define VM_LIMIT_STEP() do {\
+  if (--r->fuel == 0 && mininez_limit_reached(r)) {\
+    PROFILE_EXIT(0);\
+    MININEZ_TRACE3(parse__end, r, MININEZ_ABORTED, ctx->pos - ctx->inputs);\
+    VM_EXIT(MININEZ_ABORTED);\
+  }\
+} while(0)
+
+#define TRACE_MEMO_LOOKUP(UID, RESULT) do {\
+  if ((RESULT) == NotFound) {\
+    MININEZ_TRACE2(memo__miss, UID, ctx->pos - ctx->inputs);\
+  } else {\
+    MININEZ_TRACE3(memo__hit, UID, ctx->pos - ctx->inputs, RESULT);\
+  }\
+} while(0)
+
+#if MININEZ_DEBUG == 1
+#define DEBUG_DISPATCH(PC) do {\
+  fprintf(stderr, "[%d]", (int)((PC) - inst));\
+  mininez_dump_inst(PC, r);\
+} while(0)
+#else
+#define DEBUG_DISPATCH(PC)
+#endif
+
+#define CONSUME() ctx->pos++;
+#define CONSUME_N(N) ctx->pos+=N;
+
+#if MININEZ_VM_DISPATCH == MININEZ_DISPATCH_TAILCALL
+#if MININEZ_PROFILE
+#error "the profiling build times dispatches within one function: no MININEZ_DISPATCH_TAILCALL"
+#endif
+#if !MININEZ_HAS_MUSTTAIL && !defined(__OPTIMIZE__)
+#error "MININEZ_DISPATCH_TAILCALL needs musttail or an optimizing build"
+#endif
+#define PROFILE_MEMO_LOOKUP(UID, RESULT)
+#define PROFILE_MEMO_STORE(UID, PPOS)
+#define PROFILE_EXIT(STATUS)
+#define PROFILE_CALL()
+#define PROFILE_RET()
+/* A function per instruction; the VM state is passed along in the
+ * arguments (farthest only matters for recognition) */
+#define VM_PASTE_(A, B) A##_##B
+#define VM_PASTE(A, B)  VM_PASTE_(A, B)
+#define VM_OP(OP)       VM_PASTE(MININEZ_VM_NAME, OP)
+#define VM_OPS          VM_PASTE(MININEZ_VM_NAME, ops)
+#define VM_OP_ARGS      mininez_runtime_t* r, mininez_inst_t* inst, mininez_inst_t* pc,\
+                        ParserContext* ctx, Wstack* fail, const unsigned char* farthest
+#define DECLARE_OP(OP) static int VM_OP(OP)(VM_OP_ARGS);
+OP_EACH(DECLARE_OP)
+#undef DECLARE_OP
+static const mininez_vm_op_t VM_OPS[] = {
+#define DEFINE_TABLE(OP) VM_OP(OP),
+  OP_EACH(DEFINE_TABLE)
+#undef DEFINE_TABLE
+};
+#define tail                    (ctx->inputs + ctx->length)
+#define VM_EXIT(RESULT)         return (RESULT)
+#define DISPATCH_NEXT()         do {\
+  DEBUG_DISPATCH(pc);\
+  MININEZ_MUSTTAIL return VM_OPS[*pc](r, inst, pc + 1, ctx, fail, farthest);\
+} while(0)
+#define OP_CASE(OP)             static int VM_OP(OP)(VM_OP_ARGS)
+
+#else
+int MININEZ_VM_NAME(mininez_runtime_t* r, mininez_inst_t* inst, uint64_t entry) {
+  mininez_inst_t* pc = inst + entry;
+  ParserContext* ctx = r->ctx;
+  const char* tail = ctx->inputs + ctx->length;
+  Wstack* fail = NULL;
+  mininez_runtime_t* running = mininez_running;
+#if !MININEZ_VM_TREE
+  const unsigned char* farthest = ctx->pos;
+#endif
+#if MININEZ_PROFILE
+  mininez_profile_t* prof = r->profile;
+  const unsigned char* prof_entry = ctx->pos;
+  uint64_t prof_tick = mininez_profile_tick();
+  uint8_t prof_op = Exit;
+  prof->runs++;
+  /* cycles since the last dispatch go to the opcode dispatched then */
+#define PROFILE_MEMO_LOOKUP(UID, RESULT) do {\
+  mininez_profile_memo_t *memo_ = mininez_profile_memo(prof, UID);\
+  if ((RESULT) == SuccFound) {\
+    memo_->hits++;\
+  } else if ((RESULT) == FailFound) {\
+    memo_->fail_hits++;\
+  } else {\
+    memo_->misses++;\
+  }\
+} while(0)
+#define PROFILE_MEMO_STORE(UID, PPOS) do {\
+  uniquekey_t key_;\
+  MemoEntry *slot_ = ParserContext_memoSlot(ctx, UID, (const unsigned char*)(PPOS), &key_);\
+  mininez_profile_memo_t *memo_ = mininez_profile_memo(prof, UID);\
+  memo_->stores++;\
+  if (slot_->key != -1LL && slot_->key != key_) {\
+    memo_->collisions++;\
+  }\
+} while(0)
+#define PROFILE_DISPATCH(OP) do {\
+  uint64_t now_ = mininez_profile_tick();\
+  prof->cycles[prof_op] += now_ - prof_tick;\
+  prof_tick = now_;\
+  prof_op = (OP);\
+  prof->counts[prof_op]++;\
+} while(0)
+#define PROFILE_EXIT(STATUS) do {\
+  prof->cycles[prof_op] += mininez_profile_tick() - prof_tick;\
+  if (STATUS) {\
+    prof->consumed += ctx->pos - prof_entry;\
+  }\
+  if (prof->nodes != NULL) {\
+    mininez_profile_end(prof, (STATUS) ? ctx->pos : NULL, !(STATUS));\
+  }\
+  mininez_profile_memo_table(prof, ctx, ctx->fnew == NEW);\
+} while(0)
+  /* productions: the call frame index tells which ones a failure leaves */
+#define PROFILE_CALL() do {\
+  if (prof->nodes != NULL) {\
+    mininez_profile_enter(prof, pc - inst, (int64_t)ctx->unused_stack, ctx->pos);\
+  }\
+} while(0)
+#define PROFILE_RET() do {\
+  if (prof->nodes != NULL) {\
+    mininez_profile_leave(prof, (int64_t)ctx->unused_stack - 1, ctx->pos, 0);\
+  }\
+} while(0)
+  if (prof->nodes != NULL) {
+    mininez_profile_begin(prof, r, inst, entry, ctx->pos);
+  }
+  if (prof->heatmap) {
+    mininez_profile_heat_begin(prof, r, inst, ctx->length);
+  }
+#else
+#define PROFILE_MEMO_LOOKUP(UID, RESULT)
+#define PROFILE_MEMO_STORE(UID, PPOS)
+#define PROFILE_DISPATCH(OP)
+#define PROFILE_EXIT(STATUS)
+#define PROFILE_CALL()
+#define PROFILE_RET()
+#endif
+
+  VM_ENTER();
+#define VM_EXIT(RESULT) do {\
+  mininez_running = running;\
+  return (RESULT);\
+} while(0)
+
+#if MININEZ_VM_DISPATCH == MININEZ_DISPATCH_SWITCH
+#define DISPATCH_NEXT()         goto L_vm_head
+#define DISPATCH_START(PC)      L_vm_head: PROFILE_DISPATCH(*PC); DEBUG_DISPATCH(PC); switch (*PC++) {
+#define DISPATCH_END()          default: nez_PrintErrorInfo("DISPATCH ERROR"); }
+#define OP_CASE(OP)             case OP:
+#else
+  static const void* OP_JUMP[] = {
+#define DEFINE_TABLE(NAME) &&MININEZ_OP_##NAME,
+    OP_EACH(DEFINE_TABLE)
+#undef DEFINE_TABLE
+  };
+#if MININEZ_VM_DISPATCH == MININEZ_DISPATCH_DIRECT
+  const void* const* threaded = mininez_threaded_code(r, inst, OP_JUMP);
+#define DISPATCH_NEXT()         do {\
+  PROFILE_DISPATCH(*pc);\
+  DEBUG_DISPATCH(pc);\
+  goto *threaded[pc++ - inst];\
+} while(0)
+#else
+#define DISPATCH_NEXT()         do {\
+  PROFILE_DISPATCH(*pc);\
+  DEBUG_DISPATCH(pc);\
+  goto *OP_JUMP[*pc++];\
+} while(0)
+#endif
+#define DISPATCH_START(PC)      DISPATCH_NEXT()
+#define DISPATCH_END()          nez_PrintErrorInfo("DISPATCH ERROR");
+#define OP_CASE(OP)             MININEZ_OP_##OP:
+#endif
+
+  DISPATCH_START(pc);
+#endif
+
+  OP_CASE(Nop) {
+    /* skips the production id: direct threading has no entry inside it */
+    read_uint16_t(pc);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Exit) {
+    // r->ctx->pos = cur;
+#if !MININEZ_VM_TREE
+    r->error_pos = farthest - ctx->inputs;
+#endif
+    PROFILE_EXIT(*pc);
+    MININEZ_TRACE3(parse__end, r, *pc, ctx->pos - ctx->inputs);
+    VM_EXIT((int8_t) *pc);
+  }
+  OP_CASE(Cov) {
+    uint16_t site = read_uint16_t(pc);
+    if (r->coverage != NULL) {
+      r->coverage[site]++;
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Trap) {
+    uint16_t id = read_uint16_t(pc);
+    if (r->trap != NULL && r->trap(r, id)) {
+      PROFILE_RET();
+      MININEZ_TRACE2(production__return, ctx->stacks[ctx->unused_stack].num, ctx->pos - ctx->inputs);
+      POP_CALL(ctx, inst, pc);
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Pos) {
+    push(ctx, ctx->pos);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Back) {
+    Wstack* stack = popW(ctx);
+#if MININEZ_PROFILE
+    prof->rewound += ctx->pos - (const unsigned char*)stack->value;
+#endif
+    ctx->pos = stack->value;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Move) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction Move");
+  }
+  OP_CASE(Jump) {
+    int16_t jump = read_int16_t(pc);
+    if (jump < 0) {
+      VM_LIMIT_STEP();
+    }
+    pc = pc + jump;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Call) {
+    int16_t next = read_int16_t(pc);
+    uint16_t jump = read_uint16_t(pc);
+    VM_LIMIT_STEP();
+    pc = pc + next;
+    PUSH_CALL(ctx, jump, pc);
+    PROFILE_CALL();
+    MININEZ_TRACE2(production__enter, *(const uint16_t *)(pc - 2), ctx->pos - ctx->inputs);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ret) {
+    PROFILE_RET();
+    MININEZ_TRACE2(production__return, ctx->stacks[ctx->unused_stack].num, ctx->pos - ctx->inputs);
+    POP_CALL(ctx, inst, pc);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Alt) {
+    uint16_t jump = read_uint16_t(pc);
+    VM_PUSH_FAIL(ctx, ctx->pos, jump);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Succ) {
+    VM_POP_SUCC(ctx, inst, ctx->pos, pc, fail);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Fail) {
+    VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Guard) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction Guard");
+  }
+  OP_CASE(Step) {
+    VM_STEP_FAIL(ctx, inst, ctx->pos, pc, fail);
+#if MININEZ_VM_TREE
+    if (r->stream != NULL) {
+      mininez_stream_flush(r);
+    }
+#endif
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Byte) {
+    uint8_t ch = read_uint8_t(pc);
+    if (*ctx->pos == ch) {
+      CONSUME();
+      DISPATCH_NEXT();
+    }
+    VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Set) {
+    uint16_t id = read_uint16_t(pc);
+    bitset_t* set = &(r->C->sets[id]);
+    if (bitset_get(set, *ctx->pos)) {
+      CONSUME();
+      DISPATCH_NEXT();
+    }
+    VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Str) {
+    uint16_t id = read_uint16_t(pc);
+    const char *str = r->C->strs[id];
+    unsigned len = pstring_length(str);
+    if (pstring_starts_with(ctx->pos, str, len) == 0) {
+        VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+        DISPATCH_NEXT();
+    }
+    CONSUME_N(len);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Any) {
+    if (ctx->pos == tail) {
+      VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+      DISPATCH_NEXT();
+    }
+    CONSUME();
+    DISPATCH_NEXT();
+  }
+  OP_CASE(NByte) {
+    uint8_t ch = read_uint8_t(pc);
+    if (*ctx->pos == ch) {
+      VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+      DISPATCH_NEXT();
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(NSet) {
+    uint16_t id = read_uint16_t(pc);
+    bitset_t* set = &(r->C->sets[id]);
+    if (bitset_get(set, *ctx->pos)) {
+      VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+      DISPATCH_NEXT();
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(NStr) {
+    uint16_t id = read_uint16_t(pc);
+    const char *str = r->C->strs[id];
+    unsigned len = pstring_length(str);
+    if (pstring_starts_with(ctx->pos, str, len) == 0) {
+      DISPATCH_NEXT();
+    }
+    VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(NAny) {
+    if (ctx->pos == tail) {
+      DISPATCH_NEXT();
+    }
+    VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(OByte) {
+    uint8_t ch = read_uint8_t(pc);
+    if (*ctx->pos == ch) {
+      CONSUME();
+      DISPATCH_NEXT();
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(OSet) {
+    uint16_t id = read_uint16_t(pc);
+    bitset_t* set = &(r->C->sets[id]);
+    if (bitset_get(set, *ctx->pos)) {
+      CONSUME();
+      DISPATCH_NEXT();
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(OStr) {
+    uint16_t id = read_uint16_t(pc);
+    const char *str = r->C->strs[id];
+    unsigned len = pstring_length(str);
+    if (pstring_starts_with(ctx->pos, str, len) == 0) {
+        DISPATCH_NEXT();
+    }
+    CONSUME_N(len);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(RByte) {
+    uint8_t ch = read_uint8_t(pc);
+    while (*ctx->pos == ch) {
+      CONSUME();
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(RSet) {
+    uint16_t id = read_uint16_t(pc);
+    bitset_t* set = &(r->C->sets[id]);
+    while (bitset_get(set, *ctx->pos)) {
+      CONSUME();
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(RStr) {
+    uint16_t id = read_uint16_t(pc);
+    const char *str = r->C->strs[id];
+    unsigned len = pstring_length(str);
+    while (pstring_starts_with(ctx->pos, str, len) == 1) {
+        CONSUME_N(len);
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Dispatch) {
+    uint16_t id = read_uint16_t(pc);
+    uint8_t* index = r->C->jump_indexs[id];
+    uint16_t* table = r->C->jump_tables[id];
+    uint8_t ch = (uint8_t)*ctx->pos;
+    pc = pc + (int16_t)table[index[ch]];
+    DISPATCH_NEXT();
+  }
+  OP_CASE(DDispatch) {
+    uint16_t id = read_uint16_t(pc);
+    uint8_t* index = r->C->jump_indexs[id];
+    uint16_t* table = r->C->jump_tables[id];
+    uint8_t ch = (uint8_t)*ctx->pos++;
+    pc = pc + (int16_t)table[index[ch]];
+    DISPATCH_NEXT();
+  }
+#if MININEZ_VM_TREE
+  OP_CASE(TPush) {
+    pushW(ctx, ParserContext_saveLog(ctx), ctx->left);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TPop) {
+    Wstack* stack = popW(ctx);
+    ParserContext_backLog(ctx, stack->value);
+    GCSET(ctx, ctx->left, stack->tree);
+    ctx->left = stack->tree;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TBegin) {
+    int8_t shift = read_int8_t(pc);
+    ParserContext_beginTree(ctx, shift);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TEnd) {
+    int8_t shift = read_int8_t(pc);
+    uint16_t tag_id = read_uint16_t(pc);
+    symbol_t tag = r->C->tags[tag_id];
+    uint16_t value_id = read_uint16_t(pc);
+    const char* value = r->C->strs[value_id];
+    size_t len = 0;
+    if (value != NULL) {
+      len = pstring_length(value);
+    }
+    if (r->stream == NULL || !mininez_stream_end(r, shift, tag, value, len)) {
+      ParserContext_endTree(ctx, shift, tag, value, len);
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TTag) {
+    uint16_t id = read_uint16_t(pc);
+    symbol_t tag = r->C->tags[id];
+    ParserContext_tagTree(ctx, tag);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TReplace) {
+    uint16_t id = read_uint16_t(pc);
+    const char* text = r->C->strs[id];
+    size_t len = pstring_length(text);
+    ParserContext_valueTree(ctx, text, len);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TLink) {
+    uint16_t id = read_uint16_t(pc);
+    symbol_t label = r->C->tags[id];
+    Wstack* stack = popW(ctx);
+    ParserContext_backLog(ctx, stack->value);
+    ParserContext_linkTree(ctx, label);
+    GCSET(ctx, ctx->left, stack->tree);
+    ctx->left = stack->tree;
+    if (r->stream != NULL) {
+      mininez_stream_flush(r);
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TFold) {
+    int8_t shift = read_int8_t(pc);
+    uint8_t id = read_uint16_t(pc);
+    symbol_t label = r->C->tags[id];
+    ParserContext_foldTree(ctx, shift, label);
+    DISPATCH_NEXT();
+  }
+#else
+#define RECOG_TREE_OP(OP) OP_CASE(OP) {\
+    nez_PrintErrorInfo("Error: Tree Instruction in Recognition Program");\
+  }
+  RECOG_TREE_OP(TPush)
+  RECOG_TREE_OP(TPop)
+  RECOG_TREE_OP(TBegin)
+  RECOG_TREE_OP(TEnd)
+  RECOG_TREE_OP(TTag)
+  RECOG_TREE_OP(TReplace)
+  RECOG_TREE_OP(TLink)
+  RECOG_TREE_OP(TFold)
+#endif
+  OP_CASE(TEmit) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction TEmit");
+  }
+  OP_CASE(SOpen) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SOpen");
+  }
+  OP_CASE(SClose) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SClose");
+  }
+  OP_CASE(SMask) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SMask");
+  }
+  OP_CASE(SDef) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SDef");
+  }
+  OP_CASE(SExists) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SExists");
+  }
+  OP_CASE(SIsDef) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SIsDef");
+  }
+  OP_CASE(SMatch) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SMatch");
+  }
+  OP_CASE(SIs) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SIs");
+  }
+  OP_CASE(SIsa) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction SIsa");
+  }
+  OP_CASE(NScan) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction NScan");
+  }
+  OP_CASE(NDec) {
+    nez_PrintErrorInfo("Error: Unimplemented Instruction NDec");
+  }
+  OP_CASE(Lookup) {
+    uint16_t uid = read_uint16_t(pc);
+    int16_t jump = read_int16_t(pc);
+    int result = ParserContext_memoLookup(ctx, uid);
+    PROFILE_MEMO_LOOKUP(uid, result);
+    TRACE_MEMO_LOOKUP(uid, result);
+    if (result == SuccFound) {
+      pc = pc + jump;
+    } else if (result == FailFound) {
+      VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Memo) {
+    uint16_t uid = read_uint16_t(pc);
+    const char* ppos;
+    VM_POP_SUCC_POS(ctx, inst, ctx->pos, pc, fail, ppos);
+    PROFILE_MEMO_STORE(uid, ppos);
+    ParserContext_memoSucc(ctx, uid, ppos);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(MemoFail) {
+    uint16_t uid = read_uint16_t(pc);
+    PROFILE_MEMO_STORE(uid, ctx->pos);
+    ParserContext_memoFail(ctx, uid);
+    VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    DISPATCH_NEXT();
+  }
+#if MININEZ_VM_TREE
+  OP_CASE(TLookup) {
+    uint16_t uid = read_uint16_t(pc);
+    int16_t jump = read_int16_t(pc);
+    int result = ParserContext_memoLookupTree(ctx, uid);
+    PROFILE_MEMO_LOOKUP(uid, result);
+    TRACE_MEMO_LOOKUP(uid, result);
+    if (result == SuccFound) {
+      pc = pc + jump;
+    } else if (result == FailFound) {
+      VM_POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+    }
+    DISPATCH_NEXT();
+  }
+  OP_CASE(TMemo) {
+    uint16_t uid = read_uint16_t(pc);
+    const char* ppos;
+    VM_POP_SUCC_POS(ctx, inst, ctx->pos, pc, fail, ppos);
+    PROFILE_MEMO_STORE(uid, ppos);
+    ParserContext_memoTreeSucc(ctx, uid, ppos);
+    DISPATCH_NEXT();
+  }
+#else
+  RECOG_TREE_OP(TLookup)
+  RECOG_TREE_OP(TMemo)
+#undef RECOG_TREE_OP
+#endif
+
+#if MININEZ_VM_DISPATCH == MININEZ_DISPATCH_TAILCALL
+int MININEZ_VM_NAME(mininez_runtime_t* r, mininez_inst_t* inst, uint64_t entry) {
+  mininez_inst_t* pc = inst + entry;
+  ParserContext* ctx = r->ctx;
+  mininez_runtime_t* running = mininez_running;
+  int result;
+  VM_ENTER();
+  DEBUG_DISPATCH(pc);
+  result = VM_OPS[*pc](r, inst, pc + 1, ctx, NULL, ctx->pos);
+  mininez_running = running;
+  return result;
+}
+#undef VM_PASTE_
+#undef VM_PASTE
+#undef VM_OP
+#undef VM_OPS
+#undef VM_OP_ARGS
+#undef tail
+#else
+  DISPATCH_END();
+  return 0;
+}
+#undef DISPATCH_START
+#undef DISPATCH_END
+#endif
+
+#undef CONSUME
+#undef CONSUME_N
+#undef DISPATCH_NEXT
+#undef OP_CASE
+#undef VM_ENTER
+#undef VM_EXIT
+#undef VM_LIMIT_STEP
+#undef DEBUG_DISPATCH
+#undef PROFILE_DISPATCH
+#undef PROFILE_EXIT
+#undef PROFILE_CALL
+#undef PROFILE_MEMO_LOOKUP
+#undef PROFILE_MEMO_STORE
+#undef PROFILE_RET
+#undef TRACE_MEMO_LOOKUP
+#undef VM_PUSH_FAIL
+#undef VM_POP_FAIL
+#undef VM_STEP_FAIL
+#undef VM_POP_SUCC
+#undef VM_POP_SUCC_POS
+#undef MININEZ_VM_DISPATCH
+#undef MININEZ_VM_NAME
+#undef MININEZ_VM_TREE
@@ -1,11 +1,18 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
 #include <getopt.h>
 #include <sys/time.h> // gettimeofday
+#include <sys/mman.h>
 
 #include "nezvm.h"
 #include "instruction.h"
 #include "pstring.h"
 #include "loader.h"
+#include "stream.h"
+#include "profile.h"
+#include "trace.h"
 
 void nez_PrintErrorInfo(const char *errmsg) {
   fprintf(stderr, "%s\n", errmsg);
@@ -16,9 +23,38 @@ mininez_runtime_t *mininez_create_runtime(const unsigned char *text, size_t len)
   mininez_runtime_t *r = (mininez_runtime_t *) VM_MALLOC(sizeof(mininez_runtime_t));
   r->ctx = ParserContext_new(text, len);
   ParserContext_initTreeFunc(r->ctx, NULL, NULL, NULL, NULL);
+  r->C = NULL;
+  r->owns_constant = 1;
+  r->trap = NULL;
+  r->trap_data = NULL;
+  r->stream = NULL;
+  r->error_pos = 0;
+  r->coverage = NULL;
+  r->threaded = NULL;
+  r->threaded_code = NULL;
+  r->threaded_ops = NULL;
+  mininez_set_limits(r, 0, 0);
+#if MININEZ_PROFILE
+  r->profile = mininez_profile_new();
+#endif
   return r;
 }
 
+/* Create a runtime sharing the loaded constant pool of r (e.g. per worker) */
+mininez_runtime_t *mininez_fork_runtime(mininez_runtime_t *r, const unsigned char *text, size_t len) {
+  mininez_runtime_t *f = mininez_create_runtime(text, len);
+  f->C = r->C;
+  f->owns_constant = 0;
+  mininez_set_limits(f, r->step_budget, r->timeout_ns);
+  ParserContext_initMemo(f->ctx, f->C->memo_width, f->C->memo_points);
+  return f;
+}
+
+void mininez_reset_runtime(mininez_runtime_t *r, const unsigned char *text, size_t len) {
+  ParserContext_reset(r->ctx, text, len);
+  r->threaded_code = NULL; /* the code may be another one at the same address */
+}
+
 mininez_runtime_t* mininez_init_runtime(mininez_runtime_t *r) {
   int memoSize = r->ctx->memoSize;
   const char* inputs = r->ctx->inputs;
@@ -31,15 +67,30 @@ mininez_runtime_t* mininez_init_runtime(mininez_runtime_t *r) {
 }
 
 void mininez_dispose_runtime(mininez_runtime_t *r) {
-  mininez_dispose_constant(r->C);
+  if (r->owns_constant && r->C != NULL) {
+    mininez_dispose_constant(r->C);
+  }
   r->C = NULL;
   ParserContext_free(r->ctx);
   r->ctx = NULL;
+  VM_FREE(r->threaded);
+#if MININEZ_PROFILE
+  mininez_profile_merge(r->profile);
+#endif
   VM_FREE(r);
 }
 
 mininez_constant_t* mininez_create_constant() {
-  return (mininez_constant_t *) VM_MALLOC(sizeof(mininez_constant_t));
+  mininez_constant_t *C = (mininez_constant_t *) VM_MALLOC(sizeof(mininez_constant_t));
+  C->arena = NULL;
+  C->image = NULL;
+  C->image_size = 0;
+  C->pool_tables = 0;
+  C->pool_size = 0;
+  C->symbols = NULL;
+  C->symbol_size = 0;
+  C->symbol_capacity = 0;
+  return C;
 }
 
 void mininez_init_constant(mininez_constant_t *C) {
@@ -49,52 +100,257 @@ void mininez_init_constant(mininez_constant_t *C) {
   C->tags = (const char**) VM_MALLOC(sizeof(const char*) * C->tag_size);
   C->jump_indexs = (int8_t**) VM_MALLOC(sizeof(int8_t*) * C->table_size);
   C->jump_tables = (int16_t**) VM_MALLOC(sizeof(int16_t*) * C->table_size);
+  C->symbol_capacity = 16;
+  C->symbols = (const char**) VM_MALLOC(sizeof(const char*) * C->symbol_capacity);
+  C->symbols[0] = NULL;
+  C->symbol_size = 1;
 }
 
-void mininez_dispose_constant(mininez_constant_t *C) {
+const char *mininez_intern_symbol(mininez_constant_t *C, const char *name, unsigned len) {
+  for (uint16_t i = 1; i < C->symbol_size; i++) {
+    if (pstring_length(C->symbols[i]) == len && memcmp(C->symbols[i], name, len) == 0) {
+      return C->symbols[i];
+    }
+  }
+  if (C->arena != NULL) {
+    nez_PrintErrorInfo("Error: constant pool is already packed");
+  }
+  if (C->symbol_size == UINT16_MAX) {
+    nez_PrintErrorInfo("Error: too many symbols");
+  }
+  if (C->symbol_size == C->symbol_capacity) {
+    C->symbol_capacity *= 2;
+    C->symbols = (const char**) realloc(C->symbols, sizeof(const char*) * C->symbol_capacity);
+  }
+  mininez_symbol_t *sym = (mininez_symbol_t *) VM_MALLOC(sizeof(mininez_symbol_t) + len);
+  sym->id = C->symbol_size;
+  sym->len = len;
+  memcpy(sym->str, name, len);
+  sym->str[len] = 0;
+  C->symbols[C->symbol_size++] = sym->str;
+  return sym->str;
+}
+
+/* Id of a tag or label name, 0 when the grammar has none */
+uint32_t mininez_find_symbol(mininez_constant_t *C, const char *name) {
+  for (uint16_t i = 1; i < C->symbol_size; i++) {
+    if (!strcmp(C->symbols[i], name)) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+/* Symbol ids as a C enum, for consumers that switch on tags */
+void mininez_dump_symbols(mininez_constant_t *C, FILE *fp) {
+  fprintf(fp, "enum mininez_symbol {\n  MININEZ_SYMBOL_NONE = 0,\n");
+  for (uint16_t i = 1; i < C->symbol_size; i++) {
+    fprintf(fp, "  MININEZ_SYMBOL_");
+    for (const char *p = C->symbols[i]; *p != 0; p++) {
+      fputc(isalnum((unsigned char)*p) ? *p : '_', fp);
+    }
+    fprintf(fp, " = %u,\n", i);
+  }
+  fprintf(fp, "};\n");
+}
+
+/* Dispatch tables are as long as the largest index they are addressed by */
+uint16_t mininez_table_length(const uint8_t *index) {
+  uint16_t max = 0;
+  for (int i = 0; i < 256; i++) {
+    if (index[i] > max) {
+      max = index[i];
+    }
+  }
+  return max + 1;
+}
+
+/* Register a dispatch table owned by C; returns its id */
+uint16_t mininez_add_table(mininez_constant_t *C, uint8_t *index, uint16_t *table) {
+  uint16_t id = C->table_size++;
+  if (id == C->pool_tables) {
+    /* the first table past the pool moves the arrays out of the arena */
+    uint8_t **indexs = (uint8_t **) VM_MALLOC(sizeof(uint8_t *) * C->table_size);
+    uint16_t **tables = (uint16_t **) VM_MALLOC(sizeof(uint16_t *) * C->table_size);
+    memcpy(indexs, C->jump_indexs, sizeof(uint8_t *) * id);
+    memcpy(tables, C->jump_tables, sizeof(uint16_t *) * id);
+    C->jump_indexs = indexs;
+    C->jump_tables = tables;
+  } else {
+    C->jump_indexs = (uint8_t **) realloc(C->jump_indexs, sizeof(uint8_t *) * C->table_size);
+    C->jump_tables = (uint16_t **) realloc(C->jump_tables, sizeof(uint16_t *) * C->table_size);
+  }
+  C->jump_indexs[id] = index;
+  C->jump_tables[id] = table;
+  C->pool_size += 256 + sizeof(uint16_t) * mininez_table_length(index);
+  return id;
+}
+
+/* Constant Pool Arena
+ * mininez_pack_constant moves the pool the loader built piece by piece into
+ * one block, in the order the interpreter touches it:
+ *   sets | strs | dispatch tables | tags, symbols | production names
+ * Sets and dispatch indexes start on cache lines. The same layout function
+ * runs twice, first to measure (base == NULL), then to copy.
+ */
+#define POOL_CACHE_LINE 64
+#define POOL_TAIL 32 /* pstring_starts_with may load 32 bytes of a string */
+
+typedef struct pool_arena_t {
+  char *base;
+  size_t size;
+} pool_arena_t;
+
+static void *pool_copy(pool_arena_t *a, const void *p, size_t len, size_t align) {
+  size_t pos = (a->size + align - 1) & ~(align - 1);
+  a->size = pos + len;
+  if (a->base == NULL) {
+    return NULL;
+  }
+  if (p != NULL) {
+    memcpy(a->base + pos, p, len);
+  }
+  return a->base + pos;
+}
+
+static const char *pool_pstring(pool_arena_t *a, const char *s) {
+  if (s == NULL) {
+    return NULL;
+  }
+  pstring_t *str = CONTAINER_OF(s, pstring_t, str);
+  str = (pstring_t *) pool_copy(a, str, sizeof(pstring_t) + str->len, sizeof(unsigned));
+  return str != NULL ? str->str : NULL;
+}
+
+static const char **pool_pstrings(pool_arena_t *a, const char **strs, uint16_t size) {
+  const char **p = (const char **) pool_copy(a, NULL, sizeof(const char *) * size, sizeof(void *));
+  for (uint16_t i = 0; i < size; i++) {
+    const char *s = pool_pstring(a, strs[i]);
+    if (p != NULL) {
+      p[i] = s;
+    }
+  }
+  return p;
+}
+
+static void pool_layout(mininez_constant_t *C, pool_arena_t *a, mininez_constant_t *P) {
+  P->sets = (bitset_t *) pool_copy(a, C->sets, sizeof(bitset_t) * C->set_size, POOL_CACHE_LINE);
+  P->strs = pool_pstrings(a, C->strs, C->str_size);
+
+  P->jump_indexs = (uint8_t **) pool_copy(a, NULL, sizeof(uint8_t *) * C->table_size, sizeof(void *));
+  P->jump_tables = (uint16_t **) pool_copy(a, NULL, sizeof(uint16_t *) * C->table_size, sizeof(void *));
+  for (uint16_t i = 0; i < C->table_size; i++) {
+    size_t len = sizeof(uint16_t) * mininez_table_length(C->jump_indexs[i]);
+    uint8_t *index = (uint8_t *) pool_copy(a, C->jump_indexs[i], 256, POOL_CACHE_LINE);
+    uint16_t *table = (uint16_t *) pool_copy(a, C->jump_tables[i], len, sizeof(uint16_t));
+    if (a->base != NULL) {
+      P->jump_indexs[i] = index;
+      P->jump_tables[i] = table;
+    }
+  }
+
+  P->symbols = (const char **) pool_copy(a, NULL, sizeof(const char *) * C->symbol_size, sizeof(void *));
+  for (uint16_t i = 1; i < C->symbol_size; i++) {
+    mininez_symbol_t *sym = CONTAINER_OF(C->symbols[i], mininez_symbol_t, str);
+    sym = (mininez_symbol_t *) pool_copy(a, sym, sizeof(mininez_symbol_t) + sym->len, sizeof(uint32_t));
+    if (sym != NULL) {
+      P->symbols[i] = sym->str;
+    }
+  }
+  P->tags = (const char **) pool_copy(a, NULL, sizeof(const char *) * C->tag_size, sizeof(void *));
+  if (a->base != NULL) {
+    P->symbols[0] = NULL;
+    for (uint16_t i = 0; i < C->tag_size; i++) {
+      P->tags[i] = P->symbols[mininez_symbol_id(C->tags[i])];
+    }
+  }
+
+  P->prod_names = pool_pstrings(a, C->prod_names, C->prod_size);
+  pool_copy(a, NULL, POOL_TAIL, 1);
+}
+
+/* Frees a pool built piece by piece */
+static void dispose_pieces(mininez_constant_t *C) {
   for (uint16_t i = 0; i < C->prod_size; i++) {
     pstring_delete(C->prod_names[i]);
-    C->prod_names[i] = NULL;
   }
   VM_FREE(C->prod_names);
-  C->prod_names = NULL;
   VM_FREE(C->sets);
-  C->sets = NULL;
   for (uint16_t i = 0; i < C->str_size; i++) {
     if(C->strs[i] != NULL) {
       pstring_delete(C->strs[i]);
-      C->strs[i] = NULL;
     }
   }
   VM_FREE(C->strs);
-  C->strs = NULL;
-  for (uint16_t i = 0; i < C->tag_size; i++) {
-    if(C->tags[i] != NULL) {
-      pstring_delete(C->tags[i]);
-      C->tags[i] = NULL;
-    }
-  }
+  /* tags point into the symbol table */
   VM_FREE(C->tags);
-  C->tags = NULL;
+  for (uint16_t i = 1; i < C->symbol_size; i++) {
+    VM_FREE(CONTAINER_OF(C->symbols[i], mininez_symbol_t, str));
+  }
+  VM_FREE(C->symbols);
   for (uint16_t i = 0; i < C->table_size; i++) {
     VM_FREE(C->jump_indexs[i]);
-    C->jump_indexs[i] = NULL;
     VM_FREE(C->jump_tables[i]);
-    C->jump_tables[i] = NULL;
   }
   VM_FREE(C->jump_indexs);
-  C->jump_indexs = NULL;
   VM_FREE(C->jump_tables);
-  C->jump_tables = NULL;
+}
+
+void mininez_pack_constant(mininez_constant_t *C) {
+  pool_arena_t a = { NULL, 0 };
+  mininez_constant_t P;
+  pool_layout(C, &a, &P);
+  char *arena = (char *) VM_MALLOC(a.size + POOL_CACHE_LINE);
+  a.base = (char *)(((uintptr_t)arena + POOL_CACHE_LINE - 1) & ~(uintptr_t)(POOL_CACHE_LINE - 1));
+  a.size = 0;
+  pool_layout(C, &a, &P);
+  dispose_pieces(C);
+  C->prod_names = P.prod_names;
+  C->sets = P.sets;
+  C->strs = P.strs;
+  C->tags = P.tags;
+  C->symbols = P.symbols;
+  C->symbol_capacity = C->symbol_size;
+  C->jump_indexs = P.jump_indexs;
+  C->jump_tables = P.jump_tables;
+  C->arena = arena;
+  C->pool_tables = C->table_size;
+  C->pool_size = a.size + POOL_CACHE_LINE;
+}
+
+void mininez_dispose_constant(mininez_constant_t *C) {
+  if (C->arena == NULL) {
+    dispose_pieces(C);
+    VM_FREE(C);
+    return;
+  }
+  /* tables added after loading live outside the pool */
+  if (C->table_size > C->pool_tables) {
+    for (uint16_t i = C->pool_tables; i < C->table_size; i++) {
+      VM_FREE(C->jump_indexs[i]);
+      VM_FREE(C->jump_tables[i]);
+    }
+    VM_FREE(C->jump_indexs);
+    VM_FREE(C->jump_tables);
+  }
+  VM_FREE(C->arena);
+  if (C->image != NULL) {
+    munmap(C->image, C->image_size);
+  }
   VM_FREE(C);
 }
 
-#define PUSH_CALL(CTX, NEXT) do {\
-  push(CTX, NEXT);\
+/* A call target follows the Nop of its production: PC - 2 is the id */
+#define PUSH_CALL(CTX, NEXT, PC) do {\
+  Wstack *frame_ = unusedStack(CTX);\
+  frame_->value = (size_t)(NEXT) | MININEZ_CALL_FRAME;\
+  frame_->num = *(const uint16_t *)((PC) - 2);\
+  GCDEC(CTX, frame_->tree);\
+  frame_->tree = NULL;\
 } while(0)
 
 #define POP_CALL(CTX, INST, PC) do {\
-  PC = INST + popW(CTX)->value;\
+  PC = INST + (popW(CTX)->value & ~MININEZ_CALL_FRAME);\
 } while(0)
 
 #define PUSH_FAIL(CTX, CUR, NEXT) do {\
@@ -102,11 +358,15 @@ void mininez_dispose_constant(mininez_constant_t *C) {
   pushWNum(CTX, CUR, NEXT);\
   pushWNum(CTX, ParserContext_saveLog(CTX), ParserContext_saveSymbolPoint(CTX));\
   CTX->fail_stack = CTX->unused_stack - 2;\
+  MININEZ_TRACE1(choice__push, (CUR) - CTX->inputs);\
 } while(0)
 
 #define POP_FAIL(CTX, INST, CUR, PC, FAIL) do {\
   FAIL = CTX->stacks + CTX->fail_stack;\
+  PROFILE_FAIL(CUR, FAIL + 1);\
+  TRACE_FAIL(CTX, CUR, FAIL + 1);\
   CTX->unused_stack = CTX->fail_stack - 1;\
+  GCSET(CTX, CTX->left, FAIL->tree);\
   CTX->left = FAIL->tree;\
   CTX->fail_stack = FAIL->value;\
   FAIL = FAIL + 1;\
@@ -122,6 +382,7 @@ void mininez_dispose_constant(mininez_constant_t *C) {
   if (((const char*)(FAIL + 1)->value) == CUR) {\
     POP_FAIL(CTX, INST, CUR, PC, FAIL);\
   } else {\
+    GCSET(CTX, FAIL->tree, CTX->left);\
     FAIL->tree = CTX->left;\
     FAIL++;\
     FAIL->value = CUR;\
@@ -132,12 +393,14 @@ void mininez_dispose_constant(mininez_constant_t *C) {
 } while(0)
 
 #define POP_SUCC(CTX, INST, CUR, PC, FAIL) do {\
+  MININEZ_TRACE1(choice__commit, (CUR) - CTX->inputs);\
   FAIL = CTX->stacks + CTX->fail_stack;\
   CTX->unused_stack = CTX->fail_stack - 1;\
   CTX->fail_stack = FAIL->value;\
 } while(0)
 
 #define POP_SUCC_POS(CTX, INST, CUR, PC, FAIL, POS) do {\
+  MININEZ_TRACE1(choice__commit, (CUR) - CTX->inputs);\
   FAIL = CTX->stacks + CTX->fail_stack;\
   CTX->unused_stack = CTX->fail_stack - 1;\
   CTX->fail_stack = FAIL->value;\
@@ -145,389 +408,333 @@ void mininez_dispose_constant(mininez_constant_t *C) {
   POS = (const char*)FAIL->value;\
 } while(0)
 
+/* Recognition frames: (prev fail_stack, symbol point) and (pos, pc) */
+#define RECOG_PUSH_FAIL(CTX, CUR, NEXT) do {\
+  Wstack *frame_ = unusedStack(CTX);\
+  frame_->value = CTX->fail_stack;\
+  frame_->num = ParserContext_saveSymbolPoint(CTX);\
+  frame_ = unusedStack(CTX);\
+  frame_->value = (size_t)(CUR);\
+  frame_->num = NEXT;\
+  CTX->fail_stack = CTX->unused_stack - 1;\
+  MININEZ_TRACE1(choice__push, (CUR) - CTX->inputs);\
+} while(0)
+
+#define RECOG_POP_FAIL(CTX, INST, CUR, PC, FAIL) do {\
+  if (CTX->pos > farthest) {\
+    farthest = CTX->pos;\
+  }\
+  FAIL = CTX->stacks + CTX->fail_stack;\
+  PROFILE_FAIL(CUR, FAIL + 1);\
+  TRACE_FAIL(CTX, CUR, FAIL + 1);\
+  CTX->unused_stack = CTX->fail_stack - 1;\
+  CTX->fail_stack = FAIL->value;\
+  ParserContext_backSymbolPoint(CTX, FAIL->num);\
+  FAIL = FAIL + 1;\
+  CUR = (const char*)FAIL->value;\
+  PC = INST + FAIL->num;\
+} while(0)
+
+#define RECOG_STEP_FAIL(CTX, INST, CUR, PC, FAIL) do {\
+  FAIL = CTX->stacks + CTX->fail_stack;\
+  if (((const char*)(FAIL + 1)->value) == CUR) {\
+    RECOG_POP_FAIL(CTX, INST, CUR, PC, FAIL);\
+  } else {\
+    FAIL->num = ParserContext_saveSymbolPoint(CTX);\
+    (FAIL + 1)->value = CUR;\
+  }\
+} while(0)
+
+#define RECOG_POP_SUCC(CTX, INST, CUR, PC, FAIL) POP_SUCC(CTX, INST, CUR, PC, FAIL)
+
+#define RECOG_POP_SUCC_POS(CTX, INST, CUR, PC, FAIL, POS) POP_SUCC_POS(CTX, INST, CUR, PC, FAIL, POS)
+
+#if MININEZ_PROFILE
+/* FRAME holds (pos, pc) to return to; the bottom frame, popped when the
+ * whole parse fails, holds no position */
+#define PROFILE_FAIL(CUR, FRAME) do {\
+  const char *pos_ = (const char*)(FRAME)->value;\
+  prof->fails++;\
+  if (pos_ >= (const char*)ctx->inputs && pos_ <= (const char*)(CUR)) {\
+    prof->backtracked += (const char*)(CUR) - pos_;\
+    if (prof->heat_buckets > 0) {\
+      mininez_profile_backtrack(prof, pos_ - (const char*)ctx->inputs, (const char*)(CUR) - pos_, (FRAME)->num);\
+    }\
+  }\
+  if (prof->nodes != NULL) {\
+    mininez_profile_leave(prof, (int64_t)ctx->fail_stack - 1, (const unsigned char*)(CUR), 1);\
+  }\
+} while(0)
+#else
+#define PROFILE_FAIL(CUR, FRAME)
+#endif
+
+/* FRAME holds (pos, pc) to return to */
+#define TRACE_FAIL(CTX, CUR, FRAME) \
+  MININEZ_TRACE2(choice__fail, (CUR) - CTX->inputs, (const unsigned char*)(FRAME)->value - CTX->inputs)
+
 #define read_uint8_t(PC)   *(PC);              PC += sizeof(uint8_t)
 #define read_int8_t(PC)    *((int8_t *)PC);    PC += sizeof(int8_t)
 #define read_uint16_t(PC)  *((uint16_t *)PC);  PC += sizeof(uint16_t)
 #define read_int16_t(PC)   *((int16_t *)PC);   PC += sizeof(int16_t)
 
-void mininez_init_vm(ParserContext* ctx, mininez_inst_t* inst) {
-  push(ctx, 0);
+CNEZ_TLS mininez_runtime_t *mininez_running = NULL;
+
+const void *const *mininez_threaded_code(mininez_runtime_t *r, mininez_inst_t *inst, const void *const *ops) {
+  if (r->threaded_code != inst || r->threaded_ops != ops) {
+    mininez_inst_t *pc = inst;
+    VM_FREE(r->threaded);
+    r->threaded = (const void **) calloc(mininez_code_size(r, inst) + 1, sizeof(void *));
+    for (uint64_t i = 0; i < mininez_code_length(inst); i++) {
+      r->threaded[pc - inst] = ops[*pc];
+      pc += opcode_length(*pc);
+    }
+    r->threaded_code = inst;
+    r->threaded_ops = ops;
+  }
+  return r->threaded;
+}
+
+uint64_t mininez_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void mininez_set_limits(mininez_runtime_t *r, uint64_t step_budget, uint64_t timeout_ns) {
+  r->step_budget = step_budget;
+  r->timeout_ns = timeout_ns;
+  r->deadline_ns = 0;
+  r->steps = 0;
+  r->limit_hit = 0;
+  r->limit_held = 0;
+  /* without limits, fuel never runs out */
+  r->fuel = r->fuel_size = UINT64_MAX;
+}
+
+const char *mininez_limit_name(int limit) {
+  switch (limit) {
+  case MININEZ_LIMIT_STEPS: return "step budget";
+  case MININEZ_LIMIT_DEADLINE: return "deadline";
+  }
+  return "none";
+}
+
+/* Fuel up to the next check: the steps left, at most MININEZ_LIMIT_CHECK
+ * when there is a deadline */
+static void limit_refuel(mininez_runtime_t *r) {
+  uint64_t fuel = r->deadline_ns != 0 ? MININEZ_LIMIT_CHECK : UINT64_MAX;
+  if (r->step_budget != 0 && r->step_budget - r->steps < fuel) {
+    fuel = r->step_budget - r->steps;
+  }
+  r->fuel = r->fuel_size = fuel;
+}
+
+void mininez_limit_start(mininez_runtime_t *r) {
+  r->steps = 0;
+  r->limit_hit = 0;
+  r->deadline_ns = r->timeout_ns != 0 ? mininez_now_ns() + r->timeout_ns : 0;
+  limit_refuel(r);
+}
+
+void mininez_limit_hold(mininez_runtime_t *r, uint64_t deadline_ns) {
+  mininez_limit_start(r);
+  if (deadline_ns != 0) {
+    r->deadline_ns = deadline_ns;
+  }
+  r->limit_held = 1;
+}
+
+void mininez_limit_release(mininez_runtime_t *r) {
+  r->limit_held = 0;
+}
+
+int mininez_limit_reached(mininez_runtime_t *r) {
+  r->steps += r->fuel_size;
+  if (r->step_budget != 0 && r->steps >= r->step_budget) {
+    r->limit_hit = MININEZ_LIMIT_STEPS;
+  } else if (r->deadline_ns != 0 && mininez_now_ns() >= r->deadline_ns) {
+    r->limit_hit = MININEZ_LIMIT_DEADLINE;
+  } else {
+    limit_refuel(r);
+    return 0;
+  }
+  /* a later entry without limits must not run out either */
+  r->fuel = r->fuel_size = UINT64_MAX;
+  return 1;
+}
+
+const char *mininez_dispatch_name(int dispatch) {
+  switch (dispatch) {
+  case MININEZ_DISPATCH_SWITCH: return "switch";
+  case MININEZ_DISPATCH_INDIRECT: return "indirect";
+  case MININEZ_DISPATCH_DIRECT: return "direct";
+  case MININEZ_DISPATCH_TAILCALL: return "tailcall";
+  }
+  return "unknown";
+}
+
+void mininez_init_vm(ParserContext* ctx) {
+  pushWNum(ctx, 0, 0);
   pushWNum(ctx, ctx->inputs, 0);
   pushWNum(ctx, ParserContext_saveLog(ctx), ParserContext_saveSymbolPoint(ctx));
-  push(ctx, 2);
+  push(ctx, 2 | MININEZ_CALL_FRAME);
   ctx->fail_stack = 0;
 }
 
-int mininez_parse(mininez_runtime_t* r, mininez_inst_t* inst) {
-  mininez_inst_t* pc = inst + r->C->start_point;
-  mininez_inst_t* jmp_head = inst + r->C->start_point;
-  ParserContext* ctx = r->ctx;
-  const char* cur = ctx->inputs;
-  const char* tail = ctx->inputs + ctx->length;
-  Wstack* fail = NULL;
-
-#define CONSUME() ctx->pos++;
-#define CONSUME_N(N) ctx->pos+=N;
-
-#if defined(MININEZ_USE_SWITCH_CASE_DISPATCH)
-  fprintf(stderr, "========Parse Start========\n");
-#define DISPATCH_NEXT()         goto L_vm_head
-#define DISPATCH_START(PC) L_vm_head:fprintf(stderr, "[%d]", PC-inst);mininez_dump_inst(PC, r);switch (*PC++) {
-#define DISPATCH_END()     default: nez_PrintErrorInfo("DISPATCH ERROR");}
-#define OP_CASE(OP)        case OP:
-#elif defined(MININEZ_USE_INDIRECT_THREADING)
-  static const void* OP_JUMP[] = {
-#define DEFINE_TABLE(NAME) &&MININEZ_OP_##NAME,
-    OP_EACH(DEFINE_TABLE)
-#undef DEFINE_TABLE
-  };
-#define DISPATCH_NEXT()         goto *OP_JUMP[*pc++]
-#define DISPATCH_START(PC)      DISPATCH_NEXT()
-#define DISPATCH_END()          nez_PrintErrorInfo("DISPATCH ERROR");
-#define OP_CASE(OP)             MININEZ_OP_##OP:
-#endif
+mininez_inst_t *mininez_alloc_code(size_t size, uint64_t length, uint64_t start) {
+  mininez_code_header_t *header = (mininez_code_header_t *) VM_MALLOC(sizeof(mininez_code_header_t) + size);
+  header->length = length;
+  header->start = start;
+  return (mininez_inst_t *)(header + 1);
+}
 
-  DISPATCH_START(pc);
+mininez_inst_t *mininez_copy_code(mininez_runtime_t *r, mininez_inst_t *inst) {
+  uint64_t size = mininez_code_size(r, inst);
+  mininez_inst_t *code = mininez_alloc_code(size, mininez_code_length(inst), mininez_code_start(inst));
+  memcpy(code, inst, size);
+  return code;
+}
 
-  OP_CASE(Nop) {
-#if MININEZ_DEBUG == 1
-    read_uint16_t(pc);
-#endif
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Exit) {
-    // r->ctx->pos = cur;
-    return (int8_t) *pc++;
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Cov) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction Cov");
-  }
-  OP_CASE(Trap) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction Trap");
-  }
-  OP_CASE(Pos) {
-    push(ctx, ctx->pos);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Back) {
-    Wstack* stack = popW(ctx);
-    ctx->pos = stack->value;
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Move) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction Move");
-  }
-  OP_CASE(Jump) {
-    int16_t jump = read_int16_t(pc);
-    pc = pc + jump;
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Call) {
-    int16_t next = read_int16_t(pc);
-    uint16_t jump = read_uint16_t(pc);
-    pc = pc + next;
-    PUSH_CALL(ctx, jump);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Ret) {
-    POP_CALL(ctx, inst, pc);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Alt) {
-    uint16_t jump = read_uint16_t(pc);
-    PUSH_FAIL(ctx, ctx->pos, jump);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Succ) {
-    POP_SUCC(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Fail) {
-    POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Guard) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction Guard");
-  }
-  OP_CASE(Step) {
-    STEP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Byte) {
-    uint8_t ch = read_uint8_t(pc);
-    if (*ctx->pos == ch) {
-      CONSUME();
-      DISPATCH_NEXT();
-    }
-    POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Set) {
-    uint16_t id = read_uint16_t(pc);
-    bitset_t* set = &(r->C->sets[id]);
-    if (bitset_get(set, *ctx->pos)) {
-      CONSUME();
-      DISPATCH_NEXT();
-    }
-    POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Str) {
-    uint16_t id = read_uint16_t(pc);
-    const char *str = r->C->strs[id];
-    unsigned len = pstring_length(str);
-    if (pstring_starts_with(ctx->pos, str, len) == 0) {
-        POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-        DISPATCH_NEXT();
-    }
-    CONSUME_N(len);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Any) {
-    if (ctx->pos == tail) {
-      POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-      DISPATCH_NEXT();
-    }
-    CONSUME();
-    DISPATCH_NEXT();
-  }
-  OP_CASE(NByte) {
-    uint8_t ch = read_uint8_t(pc);
-    if (*ctx->pos == ch) {
-      POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-      DISPATCH_NEXT();
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(NSet) {
-    uint16_t id = read_uint16_t(pc);
-    bitset_t* set = &(r->C->sets[id]);
-    if (bitset_get(set, *ctx->pos)) {
-      POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-      DISPATCH_NEXT();
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(NStr) {
-    uint16_t id = read_uint16_t(pc);
-    const char *str = r->C->strs[id];
-    unsigned len = pstring_length(str);
-    if (pstring_starts_with(ctx->pos, str, len) == 0) {
-      DISPATCH_NEXT();
-    }
-    POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(NAny) {
-    if (ctx->pos == tail) {
-      DISPATCH_NEXT();
-    }
-    POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(OByte) {
-    uint8_t ch = read_uint8_t(pc);
-    if (*ctx->pos == ch) {
-      CONSUME();
-      DISPATCH_NEXT();
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(OSet) {
-    uint16_t id = read_uint16_t(pc);
-    bitset_t* set = &(r->C->sets[id]);
-    if (bitset_get(set, *ctx->pos)) {
-      CONSUME();
-      DISPATCH_NEXT();
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(OStr) {
-    uint16_t id = read_uint16_t(pc);
-    const char *str = r->C->strs[id];
-    unsigned len = pstring_length(str);
-    if (pstring_starts_with(ctx->pos, str, len) == 0) {
-        DISPATCH_NEXT();
-    }
-    CONSUME_N(len);
-    DISPATCH_NEXT();
+uint64_t mininez_code_size(mininez_runtime_t *r, mininez_inst_t* inst) {
+  mininez_inst_t *pc = inst;
+  for (uint64_t i = 0; i < mininez_code_length(inst); i++) {
+    pc += opcode_length(*pc);
   }
-  OP_CASE(RByte) {
-    uint8_t ch = read_uint8_t(pc);
-    while (*ctx->pos == ch) {
-      CONSUME();
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(RSet) {
-    uint16_t id = read_uint16_t(pc);
-    bitset_t* set = &(r->C->sets[id]);
-    while (bitset_get(set, *ctx->pos)) {
-      CONSUME();
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(RStr) {
-    uint16_t id = read_uint16_t(pc);
-    const char *str = r->C->strs[id];
-    unsigned len = pstring_length(str);
-    while (pstring_starts_with(ctx->pos, str, len) == 1) {
-        CONSUME_N(len);
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Dispatch) {
-    uint16_t id = read_uint16_t(pc);
-    uint8_t* index = r->C->jump_indexs[id];
-    uint16_t* table = r->C->jump_tables[id];
-    uint8_t ch = (uint8_t)*ctx->pos;
-    pc = pc + table[index[ch]];
-    DISPATCH_NEXT();
-  }
-  OP_CASE(DDispatch) {
-    uint16_t id = read_uint16_t(pc);
-    uint8_t* index = r->C->jump_indexs[id];
-    uint16_t* table = r->C->jump_tables[id];
-    uint8_t ch = (uint8_t)*ctx->pos++;
-    pc = pc + table[index[ch]];
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TPush) {
-    pushW(ctx, ParserContext_saveLog(ctx), ctx->left);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TPop) {
-    Wstack* stack = popW(ctx);
-    ParserContext_backLog(ctx, stack->value);
-    ctx->left = stack->tree;
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TBegin) {
-    int8_t shift = read_int8_t(pc);
-    ParserContext_beginTree(ctx, shift);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TEnd) {
-    int8_t shift = read_int8_t(pc);
-    uint16_t tag_id = read_uint16_t(pc);
-    symbol_t tag = r->C->tags[tag_id];
-    uint16_t value_id = read_uint16_t(pc);
-    const char* value = r->C->strs[value_id];
-    size_t len = 0;
-    if (value != NULL) {
-      len = pstring_length(value);
-    }
-    ParserContext_endTree(ctx, shift, tag, value, len);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TTag) {
-    uint16_t id = read_uint16_t(pc);
-    symbol_t tag = r->C->tags[id];
-    ParserContext_tagTree(ctx, tag);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TReplace) {
-    uint16_t id = read_uint16_t(pc);
-    const char* text = r->C->strs[id];
-    size_t len = pstring_length(text);
-    ParserContext_valueTree(ctx, text, len);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TLink) {
-    uint16_t id = read_uint16_t(pc);
-    symbol_t label = r->C->tags[id];
-    Wstack* stack = popW(ctx);
-    ParserContext_backLog(ctx, stack->value);
-    ParserContext_linkTree(ctx, label);
-    ctx->left = stack->tree;
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TFold) {
-    int8_t shift = read_int8_t(pc);
-    uint8_t id = read_uint16_t(pc);
-    symbol_t label = r->C->tags[id];
-    ParserContext_foldTree(ctx, shift, label);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TEmit) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction TEmit");
-  }
-  OP_CASE(SOpen) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SOpen");
-  }
-  OP_CASE(SClose) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SClose");
-  }
-  OP_CASE(SMask) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SMask");
-  }
-  OP_CASE(SDef) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SDef");
-  }
-  OP_CASE(SExists) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SExists");
-  }
-  OP_CASE(SIsDef) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SIsDef");
-  }
-  OP_CASE(SMatch) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SMatch");
-  }
-  OP_CASE(SIs) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SIs");
-  }
-  OP_CASE(SIsa) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction SIsa");
-  }
-  OP_CASE(NScan) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction NScan");
-  }
-  OP_CASE(NDec) {
-    nez_PrintErrorInfo("Error: Unimplemented Instruction NDec");
-  }
-  OP_CASE(Lookup) {
-    uint16_t uid = read_uint16_t(pc);
-    int16_t jump = read_int16_t(pc);
-    int result = ParserContext_memoLookup(ctx, uid);
-    if (result == SuccFound) {
-      pc = pc + jump;
-    } else if (result == FailFound) {
-      POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    }
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Memo) {
-    uint16_t uid = read_uint16_t(pc);
-    const char* ppos;
-    POP_SUCC_POS(ctx, inst, ctx->pos, pc, fail, ppos);
-    ParserContext_memoSucc(ctx, uid, ppos);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(MemoFail) {
-    uint16_t uid = read_uint16_t(pc);
-    ParserContext_memoFail(ctx, uid);
-    POP_FAIL(ctx, inst, ctx->pos, pc, fail);
-    DISPATCH_NEXT();
-  }
-  OP_CASE(TLookup) {
-    uint16_t uid = read_uint16_t(pc);
-    int16_t jump = read_int16_t(pc);
-    int result = ParserContext_memoLookupTree(ctx, uid);
-    if (result == SuccFound) {
-      pc = pc + jump;
-    } else if (result == FailFound) {
-      POP_FAIL(ctx, inst, ctx->pos, pc, fail);
+  return pc - inst;
+}
+
+/* Entry address of a production, matched with or without its "_0." prefix */
+int64_t mininez_find_production(mininez_runtime_t *r, mininez_inst_t* inst, const char *name) {
+  mininez_inst_t *pc = inst;
+  for (uint64_t i = 0; i < mininez_code_length(inst); i++) {
+    if (*pc == Nop) {
+      const char *prod = r->C->prod_names[*(uint16_t *)(pc + 1)];
+      const char *dot = strrchr(prod, '.');
+      if (!strcmp(prod, name) || (dot != NULL && !strcmp(dot + 1, name))) {
+        return (pc - inst) + opcode_length(Nop);
+      }
     }
-    DISPATCH_NEXT();
+    pc += opcode_length(*pc);
   }
-  OP_CASE(TMemo) {
-    uint16_t uid = read_uint16_t(pc);
-    const char* ppos;
-    POP_SUCC_POS(ctx, inst, ctx->pos, pc, fail, ppos);
-    ParserContext_memoTreeSucc(ctx, uid, ppos);
-    DISPATCH_NEXT();
+  return -1;
+}
+
+size_t mininez_tree_count(void) {
+  return t_newcount;
+}
+
+void mininez_memory(mininez_runtime_t *r, MemoryUsage usage[MEMORY_KINDS]) {
+  memcpy(usage, r->ctx->memory, sizeof(MemoryUsage) * MEMORY_KINDS);
+  if (r->C != NULL) {
+    mininez_constant_t *C = r->C;
+    usage[MEMORY_CONSTANT].current = C->pool_size;
+    usage[MEMORY_CONSTANT].peak = C->pool_size;
+    usage[MEMORY_CONSTANT].allocs = (C->arena != NULL) + (C->image != NULL)
+        + 2 * (size_t)(C->table_size - C->pool_tables);
   }
-  DISPATCH_END();
-  return 0;
 }
+
+const char *mininez_memory_name(MemoryKind kind) {
+  static const char *names[MEMORY_KINDS] = {
+    "vm stack", "tree log", "memo table", "symbol table", "tree nodes", "constant pool", "input"
+  };
+  return names[kind];
+}
+
+void mininez_print_usage(MemoryUsage usage[MEMORY_KINDS], FILE *fp) {
+  size_t current = 0, peak = 0, allocs = 0;
+  fprintf(fp, "%-14s %14s %14s %10s\n", "memory", "current", "peak", "allocs");
+  for (int i = 0; i < MEMORY_KINDS; i++) {
+    fprintf(fp, "%-14s %14zu %14zu %10zu\n", mininez_memory_name((MemoryKind)i),
+            usage[i].current, usage[i].peak, usage[i].allocs);
+    current += usage[i].current;
+    peak += usage[i].peak;
+    allocs += usage[i].allocs;
+  }
+  /* peaks of different structures need not coincide */
+  fprintf(fp, "%-14s %14zu %14zu %10zu\n", "total", current, peak, allocs);
+}
+
+void mininez_print_memory(mininez_runtime_t *r, FILE *fp) {
+  MemoryUsage usage[MEMORY_KINDS];
+  mininez_memory(r, usage);
+  mininez_print_usage(usage, fp);
+}
+
+int mininez_parse(mininez_runtime_t* r, mininez_inst_t* inst) {
+  return mininez_parse_from(r, inst, mininez_code_start(inst));
+}
+
+int mininez_recognize(mininez_runtime_t* r, mininez_inst_t* inst) {
+  return mininez_recognize_from(r, inst, mininez_code_start(inst));
+}
+
+/* Handlers of MININEZ_DISPATCH_TAILCALL */
+typedef int (*mininez_vm_op_t)(mininez_runtime_t* r, mininez_inst_t* inst, mininez_inst_t* pc,
+                               ParserContext* ctx, Wstack* fail, const unsigned char* farthest);
+
+#define MININEZ_VM_NAME mininez_parse_from
+#define MININEZ_VM_TREE 1
+#include "nezvm-core.h"
+
+#define MININEZ_VM_NAME mininez_recognize_from
+#define MININEZ_VM_TREE 0
+#include "nezvm-core.h"
+
+#if MININEZ_DISPATCH_VARIANTS
+/* the profiling build and unoptimized builds without musttail go without */
+#if !MININEZ_PROFILE && (MININEZ_HAS_MUSTTAIL || defined(__OPTIMIZE__))
+#define MININEZ_TAILCALL_VARIANT 1
+#else
+#define MININEZ_TAILCALL_VARIANT 0
+#endif
+
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_SWITCH
+#define MININEZ_VM_NAME mininez_parse_switch
+#define MININEZ_VM_TREE 1
+#include "nezvm-core.h"
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_SWITCH
+#define MININEZ_VM_NAME mininez_recognize_switch
+#define MININEZ_VM_TREE 0
+#include "nezvm-core.h"
+
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_INDIRECT
+#define MININEZ_VM_NAME mininez_parse_indirect
+#define MININEZ_VM_TREE 1
+#include "nezvm-core.h"
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_INDIRECT
+#define MININEZ_VM_NAME mininez_recognize_indirect
+#define MININEZ_VM_TREE 0
+#include "nezvm-core.h"
+
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_DIRECT
+#define MININEZ_VM_NAME mininez_parse_direct
+#define MININEZ_VM_TREE 1
+#include "nezvm-core.h"
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_DIRECT
+#define MININEZ_VM_NAME mininez_recognize_direct
+#define MININEZ_VM_TREE 0
+#include "nezvm-core.h"
+
+#if MININEZ_TAILCALL_VARIANT
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_TAILCALL
+#define MININEZ_VM_NAME mininez_parse_tailcall
+#define MININEZ_VM_TREE 1
+#include "nezvm-core.h"
+#define MININEZ_VM_DISPATCH MININEZ_DISPATCH_TAILCALL
+#define MININEZ_VM_NAME mininez_recognize_tailcall
+#define MININEZ_VM_TREE 0
+#include "nezvm-core.h"
+#endif
+
+const mininez_dispatch_variant_t mininez_dispatch_variants[] = {
+  { "switch", mininez_parse_switch, mininez_recognize_switch },
+  { "indirect", mininez_parse_indirect, mininez_recognize_indirect },
+  { "direct", mininez_parse_direct, mininez_recognize_direct },
+#if MININEZ_TAILCALL_VARIANT
+  { "tailcall", mininez_parse_tailcall, mininez_recognize_tailcall },
+#endif
+  { NULL, NULL, NULL }
+};
+#endif
@@ -2,8 +2,27 @@
 #define NEZVM_H
 
 #define MININEZ_DEBUG 0
-// #define MININEZ_USE_SWITCH_CASE_DISPATCH
-#define MININEZ_USE_INDIRECT_THREADING
+#ifndef MININEZ_PROFILE
+#define MININEZ_PROFILE 0 /* opcode counters, see profile.h */
+#endif
+
+/* Dispatch: how the VM gets from one instruction to the next (nezvm-core.h)
+ *   SWITCH    a switch on the opcode in a loop
+ *   INDIRECT  computed goto through a table indexed by opcode
+ *   DIRECT    computed goto through handler addresses by code offset, made
+ *             per code on entry (mininez_threaded_code)
+ *   TAILCALL  a function per instruction, each tail calling the next; needs
+ *             musttail (clang) or an optimizing build
+ * Chosen with cmake -DMININEZ_DISPATCH=<name>; MININEZ_DEBUG prints each
+ * instruction dispatched.
+ */
+#define MININEZ_DISPATCH_SWITCH   1
+#define MININEZ_DISPATCH_INDIRECT 2
+#define MININEZ_DISPATCH_DIRECT   3
+#define MININEZ_DISPATCH_TAILCALL 4
+#ifndef MININEZ_DISPATCH
+#define MININEZ_DISPATCH MININEZ_DISPATCH_INDIRECT
+#endif
 
 #include <stdlib.h>
 #include "bitset.h"
@@ -11,11 +30,27 @@
 
 typedef uint8_t mininez_inst_t;
 
+/* Symbols
+ * Tags and labels are interned per grammar, so equal names share a pointer.
+ * The pointer is the string of a pstring whose header also holds the id;
+ * id 0 stands for no symbol.
+ */
+typedef struct mininez_symbol_t {
+  uint32_t id;
+  unsigned len; /* pstring_t */
+  char str[1];
+} mininez_symbol_t;
+
+static inline uint32_t mininez_symbol_id(const char *s) {
+  return s == NULL ? 0 : ((const uint32_t *)s)[-2];
+}
+
 typedef struct mininez_constant_t {
   const char **prod_names;
   bitset_t *sets;
   const char **tags;
   const char **strs;
+  const char **symbols;  /* by id; symbols[0] is NULL */
   uint8_t** jump_indexs;
   uint16_t** jump_tables;
 
@@ -24,33 +59,166 @@ typedef struct mininez_constant_t {
   uint16_t str_size;
   uint16_t tag_size;
   uint16_t table_size;
+  uint16_t symbol_size;
+  uint32_t symbol_capacity;
+
+  uint16_t memo_width;
+  uint16_t memo_points;
 
-  uint64_t bytecode_length;
-  uint64_t start_point;
+  /* Once loaded, the pool lives in one arena block, plus the mapped grammar
+   * image it points into (NULL when loaded from .bin) */
+  void *arena;
+  void *image;
+  size_t image_size;
+  uint16_t pool_tables; /* dispatch tables stored in the arena or image */
+  size_t pool_size;     /* bytes of the arena, the image and added tables */
 } mininez_constant_t;
 
 #define MININEZ_DEFAULT_STACK_SIZE (1024)
 
+/* Call frames hold the return address with this bit set and the production
+ * called in num, so the stack can be walked (sample.h) */
+#define MININEZ_CALL_FRAME ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
 typedef struct mininez_runtime_t {
   ParserContext *ctx;
   mininez_constant_t* C;
+  int owns_constant;
+  /* Trap hook: a non-zero result returns from the current production */
+  int (*trap)(struct mininez_runtime_t *r, uint16_t id);
+  void *trap_data;
+  /* event streaming state, see stream.h */
+  struct mininez_stream_t *stream;
+  /* farthest failure position of the last mininez_recognize */
+  size_t error_pos;
+  /* counters of Cov by site, see layout.h (NULL: not counted) */
+  uint64_t *coverage;
+  /* direct-threaded dispatch: handler addresses of threaded_code */
+  const void **threaded;
+  const mininez_inst_t *threaded_code;
+  const void *const *threaded_ops;
+  /* limits of every parse, see mininez_set_limits */
+  uint64_t step_budget;
+  uint64_t timeout_ns;
+  /* state of the running parse: steps are counted down in fuel between
+   * checks of the limits (mininez_limit_reached) */
+  uint64_t deadline_ns;
+  uint64_t steps;
+  uint64_t fuel;
+  uint64_t fuel_size;
+  int limit_hit; /* MININEZ_LIMIT_* that aborted the last parse, 0 if none */
+  int limit_held; /* set by mininez_limit_hold: entries do not restart them */
+#if MININEZ_PROFILE
+  struct mininez_profile_t *profile;
+#endif
 } mininez_runtime_t;
 
+#if defined(__GNUC__)
+__attribute__((noreturn))
+#endif
 void nez_PrintErrorInfo(const char *errmsg);
 
+/* The runtime whose VM runs on this thread, NULL outside of the VM */
+extern CNEZ_TLS mininez_runtime_t *mininez_running;
+
 /* Memory */
 #define VM_MALLOC(N) malloc(N);
 #define VM_FREE(N) free(N);
 
 /* Prepare Runtime */
 mininez_runtime_t *mininez_create_runtime(const unsigned char *text, size_t len);
+mininez_runtime_t *mininez_fork_runtime(mininez_runtime_t *r, const unsigned char *text, size_t len);
+void mininez_reset_runtime(mininez_runtime_t *r, const unsigned char *text, size_t len);
 void mininez_dispose_runtime(mininez_runtime_t *r);
 mininez_constant_t* mininez_create_constant();
 void mininez_init_constant(mininez_constant_t *C);
+void mininez_pack_constant(mininez_constant_t *C);
 void mininez_dispose_constant(mininez_constant_t *C);
+uint16_t mininez_table_length(const uint8_t *index);
+const char *mininez_intern_symbol(mininez_constant_t *C, const char *name, unsigned len);
+uint32_t mininez_find_symbol(mininez_constant_t *C, const char *name);
+void mininez_dump_symbols(mininez_constant_t *C, FILE *fp);
+uint16_t mininez_add_table(mininez_constant_t *C, uint8_t *index, uint16_t *table);
+
+/* Limits
+ * A parse stops with MININEZ_ABORTED once it has run step_budget steps
+ * (Calls and backward Jumps, so every loop and recursion counts) or once
+ * timeout_ns have passed since it started; the clock is read every
+ * MININEZ_LIMIT_CHECK steps. 0 lifts a limit. The runtime is reset for
+ * the next parse as after any other. Forks keep the limits.
+ */
+#define MININEZ_ABORTED (-1)
+#define MININEZ_LIMIT_STEPS    1
+#define MININEZ_LIMIT_DEADLINE 2
+#define MININEZ_LIMIT_CHECK    4096
+void mininez_set_limits(mininez_runtime_t *r, uint64_t step_budget, uint64_t timeout_ns);
+/* The limit r->limit_hit names */
+const char *mininez_limit_name(int limit);
+/* Starts the limits once for several parses, which go on counting the same
+ * steps towards deadline_ns (0: timeout_ns from now) until
+ * mininez_limit_release; the caller stops once r->limit_hit is set */
+void mininez_limit_hold(mininez_runtime_t *r, uint64_t deadline_ns);
+void mininez_limit_release(mininez_runtime_t *r);
+/* Called by the VM: on entry, and when fuel runs out (1: abort) */
+void mininez_limit_start(mininez_runtime_t *r);
+int mininez_limit_reached(mininez_runtime_t *r);
+uint64_t mininez_now_ns(void);
 
 /* Parsing Function */
+void mininez_init_vm(ParserContext* ctx);
+/* 1: parsed, 0: syntax error, MININEZ_ABORTED: out of limits */
 int mininez_parse(mininez_runtime_t* r, mininez_inst_t* inst);
+int mininez_parse_from(mininez_runtime_t* r, mininez_inst_t* inst, uint64_t entry);
+/* Recognition only: for programs made by mininez_strip_tree (program.h) */
+int mininez_recognize(mininez_runtime_t* r, mininez_inst_t* inst);
+int mininez_recognize_from(mininez_runtime_t* r, mininez_inst_t* inst, uint64_t entry);
+/* Handler addresses by code offset of inst, for the VM whose opcode table
+ * is ops; kept in r until it is reset or given other code */
+const void *const *mininez_threaded_code(mininez_runtime_t *r, mininez_inst_t *inst, const void *const *ops);
+const char *mininez_dispatch_name(int dispatch);
+
+#if MININEZ_DISPATCH_VARIANTS
+/* The VM built with every dispatch (mininez-bench); the list ends with a
+ * NULL name */
+typedef struct mininez_dispatch_variant_t {
+  const char *name;
+  int (*parse_from)(mininez_runtime_t* r, mininez_inst_t* inst, uint64_t entry);
+  int (*recognize_from)(mininez_runtime_t* r, mininez_inst_t* inst, uint64_t entry);
+} mininez_dispatch_variant_t;
+
+extern const mininez_dispatch_variant_t mininez_dispatch_variants[];
+#endif
+/* Code Blocks
+ * Every block of instructions is preceded by its length in instructions and
+ * the address of its start production, so that blocks derived from the
+ * loaded one (see program.h) can be run next to it. */
+typedef struct mininez_code_header_t {
+  uint64_t length;
+  uint64_t start;
+} mininez_code_header_t;
+
+static inline uint64_t mininez_code_length(const mininez_inst_t *inst) {
+  return ((const mininez_code_header_t *)inst)[-1].length;
+}
+
+static inline uint64_t mininez_code_start(const mininez_inst_t *inst) {
+  return ((const mininez_code_header_t *)inst)[-1].start;
+}
+
+/* size bytes of code, freed by mininez_dispose_instructions */
+mininez_inst_t *mininez_alloc_code(size_t size, uint64_t length, uint64_t start);
+/* A copy of inst to be patched */
+mininez_inst_t *mininez_copy_code(mininez_runtime_t *r, mininez_inst_t *inst);
+uint64_t mininez_code_size(mininez_runtime_t *r, mininez_inst_t* inst);
+int64_t mininez_find_production(mininez_runtime_t *r, mininez_inst_t* inst, const char *name);
+/* Trees made by the default tree functions on this thread */
+size_t mininez_tree_count(void);
+/* Memory held by r, by MemoryKind: its context's structures, the constant
+ * pool (shared with forks) and the input */
+void mininez_memory(mininez_runtime_t *r, MemoryUsage usage[MEMORY_KINDS]);
+const char *mininez_memory_name(MemoryKind kind);
+void mininez_print_usage(MemoryUsage usage[MEMORY_KINDS], FILE *fp);
+void mininez_print_memory(mininez_runtime_t *r, FILE *fp);
 
 static
 void pushWNum(ParserContext *c, size_t value, size_t num)
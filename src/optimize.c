@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "program.h"
+#include "optimize.h"
+
+#define OPTIMIZE_TAIL 3 /* longest tail copied over a Jump */
+
+/* The Nop naming a production is never executed: it follows the prologue
+ * or an instruction that ends the flow */
+static int optimize_header(mininez_program_t *p, uint64_t prologue, uint64_t i) {
+  return p->insns[i].opcode == Nop
+      && (i == prologue || (i > prologue && mininez_insn_ends_flow(p->insns[i - 1].opcode)));
+}
+
+/* The production of every instruction, counted from 1 (0: the prologue) */
+static uint64_t *optimize_regions(mininez_program_t *p) {
+  uint64_t prologue = mininez_program_prologue(p);
+  uint64_t *region = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (p->size + 1));
+  uint64_t prod = 0;
+  for (uint64_t i = 0; i < p->size; i++) {
+    prod += optimize_header(p, prologue, i);
+    region[i] = prod;
+  }
+  return region;
+}
+
+/* Branches into every instruction; the prologue, the start point and the
+ * production entries (Nop and body) have one more */
+static uint32_t *optimize_refs(mininez_program_t *p) {
+  uint64_t prologue = mininez_program_prologue(p);
+  uint32_t *refs = (uint32_t *) calloc(p->size + 1, sizeof(uint32_t));
+  refs[p->start]++;
+  for (uint64_t i = 0; i < p->size; i++) {
+    mininez_insn_t *insn = &p->insns[i];
+    if (i < prologue) {
+      refs[i]++;
+    }
+    if (optimize_header(p, prologue, i)) {
+      refs[i]++;
+      refs[i + 1]++;
+    }
+    switch (insn->opcode) {
+    case Jump: case Alt: case Lookup: case TLookup:
+      refs[insn->target]++;
+      break;
+    case Call:
+      refs[insn->target]++;
+      refs[insn->ret]++;
+      break;
+    case Dispatch: case DDispatch:
+      for (uint16_t k = 0; k < insn->case_size; k++) {
+        refs[insn->cases[k]]++;
+      }
+      break;
+    }
+  }
+  return refs;
+}
+
+/* Drops the removed instructions; a branch to one goes to the next kept */
+static void optimize_compact(mininez_program_t *p) {
+  mininez_insn_t *insns = (mininez_insn_t *) calloc(p->size + 1, sizeof(mininez_insn_t));
+  uint64_t *map = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (p->size + 1));
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < p->size; i++) {
+    map[i] = size;
+    if (!p->insns[i].removed) {
+      insns[size++] = p->insns[i];
+    } else if (p->insns[i].cases != NULL) {
+      VM_FREE(p->insns[i].cases);
+    }
+  }
+  mininez_program_replace(p, insns, size, map);
+  VM_FREE(map);
+}
+
+/* Instructions that always go on with the next one and leave the stack of
+ * choice points as they found it */
+static int optimize_total(uint8_t opcode) {
+  switch (opcode) {
+  case Nop: case Cov: case OByte: case OSet: case OStr: case RByte: case RSet: case RStr:
+  case TBegin: case TEnd: case TTag: case TReplace:
+    return 1;
+  }
+  return 0;
+}
+
+/* Inner choices first, so that the ones around them can go as well */
+static void optimize_choices(mininez_program_t *p, mininez_optimize_stats_t *stats) {
+  uint32_t *refs = optimize_refs(p);
+  for (uint64_t i = p->size; i-- > 0;) {
+    uint64_t j = i + 1;
+    if (p->insns[i].opcode != Alt || mininez_program_glued(p, i)) {
+      continue;
+    }
+    while (j < p->size && refs[j] == 0 && (p->insns[j].removed || optimize_total(p->insns[j].opcode))) {
+      j++;
+    }
+    if (j < p->size && refs[j] == 0 && p->insns[j].opcode == Succ && !mininez_program_glued(p, j)) {
+      p->insns[i].removed = 1;
+      p->insns[j].removed = 1;
+      refs[p->insns[i].target]--;
+      stats->choices++;
+    }
+  }
+  VM_FREE(refs);
+}
+
+static void optimize_nops(mininez_program_t *p, mininez_optimize_stats_t *stats) {
+  uint64_t prologue = mininez_program_prologue(p);
+  for (uint64_t i = prologue; i < p->size; i++) {
+    if (p->insns[i].opcode == Nop && !optimize_header(p, prologue, i)) {
+      p->insns[i].removed = 1;
+      stats->nops++;
+    }
+  }
+}
+
+/* Where a branch to t ends up past Jumps; with forward set, backward Jumps
+ * are not followed, as they are the ones the step limit counts */
+static uint64_t optimize_follow(mininez_program_t *p, uint64_t t, int forward) {
+  for (uint64_t n = 0; n < p->size; n++) {
+    mininez_insn_t *insn = &p->insns[t];
+    if (insn->opcode != Jump || insn->target == t || (forward && insn->target < t)) {
+      break;
+    }
+    t = insn->target;
+  }
+  return t;
+}
+
+static void optimize_thread(mininez_program_t *p, uint64_t *operand, int forward, mininez_optimize_stats_t *stats) {
+  uint64_t t = optimize_follow(p, *operand, forward);
+  if (t != *operand) {
+    *operand = t;
+    stats->threaded++;
+  }
+}
+
+/* A Jump stays a Jump, so it may follow any; other branches only go
+ * further forward */
+static void optimize_threading(mininez_program_t *p, mininez_optimize_stats_t *stats) {
+  for (uint64_t i = 0; i < p->size; i++) {
+    mininez_insn_t *insn = &p->insns[i];
+    switch (insn->opcode) {
+    case Jump:
+      optimize_thread(p, &insn->target, 0, stats);
+      break;
+    case Alt: case Lookup: case TLookup:
+      optimize_thread(p, &insn->target, 1, stats);
+      break;
+    case Call:
+      optimize_thread(p, &insn->ret, 1, stats);
+      break;
+    case Dispatch: case DDispatch:
+      for (uint16_t k = 0; k < insn->case_size; k++) {
+        optimize_thread(p, &insn->cases[k], 1, stats);
+      }
+      break;
+    }
+  }
+}
+
+/* Instructions without branch operands that the stream and the profilers
+ * do not look for by position */
+static int optimize_copyable(uint8_t opcode) {
+  switch (opcode) {
+  case Pos: case Back: case Byte: case Set: case Str: case Any:
+  case NByte: case NSet: case NStr: case NAny: case OByte: case OSet: case OStr:
+  case RByte: case RSet: case RStr: case TPush: case TPop: case TBegin: case TEnd:
+  case TTag: case TReplace: case TLink: case TFold: case Memo: case TMemo:
+    return 1;
+  }
+  return 0;
+}
+
+/* The last instruction of the tail the Jump at j can be replaced by, or 0.
+ * A tail that returns or fails is no loop, so it is copied over backward
+ * Jumps too; one ending in a Jump only over forward ones. */
+static uint64_t optimize_tail(mininez_program_t *p, const uint64_t *region, uint64_t j) {
+  uint64_t t = p->insns[j].target;
+  if (t == j || region[t] != region[j] || (j > 0 && p->insns[j - 1].opcode == Step)) {
+    return 0;
+  }
+  for (uint64_t k = t; k < p->size && k < t + OPTIMIZE_TAIL; k++) {
+    uint8_t opcode = p->insns[k].opcode;
+    if (opcode == Ret || opcode == Fail || opcode == MemoFail || (opcode == Jump && k > t && t > j)) {
+      return k;
+    }
+    if (!optimize_copyable(opcode)) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/* Copies are made while every offset of the code still fits in an int16_t */
+static void optimize_tails(mininez_program_t *p, mininez_optimize_stats_t *stats) {
+  uint64_t *region = optimize_regions(p);
+  uint64_t bytes = 0;
+  for (uint64_t i = 0; i < p->size; i++) {
+    bytes += opcode_length(p->insns[i].opcode);
+  }
+  mininez_insn_t *insns = (mininez_insn_t *) calloc(p->size * OPTIMIZE_TAIL + 1, sizeof(mininez_insn_t));
+  uint64_t *map = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (p->size + 1));
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < p->size; i++) {
+    uint64_t end = p->insns[i].opcode == Jump ? optimize_tail(p, region, i) : 0;
+    uint64_t grown = 0;
+    map[i] = size;
+    for (uint64_t k = p->insns[i].target; end != 0 && k <= end; k++) {
+      grown += opcode_length(p->insns[k].opcode);
+    }
+    if (end == 0 || bytes + grown - opcode_length(Jump) > INT16_MAX) {
+      insns[size++] = p->insns[i];
+      continue;
+    }
+    for (uint64_t k = p->insns[i].target; k <= end; k++) {
+      insns[size++] = p->insns[k];
+    }
+    bytes += grown - opcode_length(Jump);
+    stats->tails++;
+  }
+  mininez_program_replace(p, insns, size, map);
+  VM_FREE(map);
+  VM_FREE(region);
+}
+
+static void optimize_reach(uint8_t *reached, uint64_t *work, uint64_t *size, uint64_t i) {
+  if (!reached[i]) {
+    reached[i] = 1;
+    work[(*size)++] = i;
+  }
+}
+
+/* Roots: the prologue, the start point and every production */
+static void optimize_dead(mininez_program_t *p, mininez_optimize_stats_t *stats) {
+  uint64_t prologue = mininez_program_prologue(p);
+  uint8_t *reached = (uint8_t *) calloc(p->size + 1, sizeof(uint8_t));
+  uint64_t *work = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (p->size + 1));
+  uint64_t size = 0;
+  optimize_reach(reached, work, &size, p->start);
+  for (uint64_t i = 0; i < p->size; i++) {
+    if (i < prologue || optimize_header(p, prologue, i)) {
+      optimize_reach(reached, work, &size, i);
+    }
+  }
+  while (size > 0) {
+    uint64_t i = work[--size];
+    mininez_insn_t *insn = &p->insns[i];
+    switch (insn->opcode) {
+    case Jump: case Alt: case Lookup: case TLookup:
+      optimize_reach(reached, work, &size, insn->target);
+      break;
+    case Call:
+      optimize_reach(reached, work, &size, insn->target);
+      optimize_reach(reached, work, &size, insn->ret);
+      break;
+    case Dispatch: case DDispatch:
+      for (uint16_t k = 0; k < insn->case_size; k++) {
+        optimize_reach(reached, work, &size, insn->cases[k]);
+      }
+      break;
+    }
+    if (!mininez_insn_ends_flow(insn->opcode) && i + 1 < p->size) {
+      optimize_reach(reached, work, &size, i + 1);
+    }
+  }
+  for (uint64_t i = 0; i < p->size; i++) {
+    if (!reached[i]) {
+      p->insns[i].removed = 1;
+      stats->dead++;
+    }
+  }
+  VM_FREE(work);
+  VM_FREE(reached);
+  optimize_compact(p);
+}
+
+/* The last instruction of the block the Jump at j can pull in behind it,
+ * or 0: the block must be entered by the Jump only, ahead of it, and end
+ * the flow */
+static uint64_t optimize_block(mininez_program_t *p, const uint32_t *refs, const uint64_t *region, uint64_t j) {
+  uint64_t t = p->insns[j].target;
+  if (t <= j || region[t] != region[j] || refs[t] != 1
+      || !mininez_insn_ends_flow(p->insns[t - 1].opcode) || mininez_program_glued(p, t)) {
+    return 0;
+  }
+  for (uint64_t k = t; k < p->size; k++) {
+    if (k > t && (refs[k] != 0 || p->insns[k].opcode == Nop)) {
+      return 0;
+    }
+    if (mininez_insn_ends_flow(p->insns[k].opcode)) {
+      return k + 1 < p->size && mininez_program_glued(p, k + 1) ? 0 : k;
+    }
+  }
+  return 0;
+}
+
+static void optimize_straighten(mininez_program_t *p, mininez_optimize_stats_t *stats) {
+  uint64_t *region = optimize_regions(p);
+  uint32_t *refs = optimize_refs(p);
+  uint8_t *placed = (uint8_t *) calloc(p->size + 1, sizeof(uint8_t));
+  mininez_insn_t *insns = (mininez_insn_t *) calloc(p->size + 1, sizeof(mininez_insn_t));
+  uint64_t *map = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (p->size + 1));
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < p->size; i++) {
+    uint64_t k = i;
+    while (!placed[k]) {
+      uint64_t end = p->insns[k].opcode == Jump ? optimize_block(p, refs, region, k) : 0;
+      placed[k] = 1;
+      map[k] = size;
+      insns[size++] = p->insns[k];
+      if (end == 0) {
+        break;
+      }
+      /* the block goes on from the Jump, which is dropped; its last
+       * instruction may pull in the next one */
+      insns[size - 1].removed = 1;
+      stats->straight++;
+      for (uint64_t b = p->insns[k].target; b < end; b++) {
+        placed[b] = 1;
+        map[b] = size;
+        insns[size++] = p->insns[b];
+      }
+      k = end;
+    }
+  }
+  mininez_program_replace(p, insns, size, map);
+  optimize_compact(p);
+  for (uint64_t i = 0; i + 1 < p->size; i++) {
+    mininez_insn_t *insn = &p->insns[i];
+    if (insn->opcode == Jump && insn->target == i + 1 && !(i > 0 && p->insns[i - 1].opcode == Step)) {
+      insn->removed = 1;
+      stats->straight++;
+    }
+  }
+  optimize_compact(p);
+  VM_FREE(map);
+  VM_FREE(placed);
+  VM_FREE(refs);
+  VM_FREE(region);
+}
+
+mininez_inst_t *mininez_optimize(mininez_runtime_t *r, mininez_inst_t *inst, mininez_optimize_stats_t *stats) {
+  mininez_program_t p;
+  memset(stats, 0, sizeof(*stats));
+  mininez_program_decode(&p, r, inst);
+  stats->before = p.size;
+  optimize_choices(&p, stats);
+  optimize_nops(&p, stats);
+  optimize_compact(&p);
+  optimize_threading(&p, stats);
+  optimize_tails(&p, stats);
+  optimize_dead(&p, stats);
+  optimize_straighten(&p, stats);
+  stats->after = p.size;
+  mininez_inst_t *code = mininez_program_encode(&p, r);
+  mininez_program_dispose(&p);
+  return code;
+}
+
+void mininez_optimize_report(mininez_optimize_stats_t *stats, FILE *fp) {
+  fprintf(fp, "Optimize: %" PRIu64 " -> %" PRIu64 " instructions (choices %" PRIu64 ", nops %" PRIu64
+          ", threaded %" PRIu64 ", tails %" PRIu64 ", dead %" PRIu64 ", straightened %" PRIu64 ")\n",
+          stats->before, stats->after, stats->choices, stats->nops, stats->threaded, stats->tails,
+          stats->dead, stats->straight);
+}
@@ -0,0 +1,41 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stdio.h>
+#include "nezvm.h"
+
+/* Bytecode Optimizer
+ * mininez_optimize returns a copy of inst that parses the same and
+ * dispatches fewer instructions. The passes, in order:
+ *   choices   an Alt whose body up to its Succ cannot fail (optional and
+ *             repeated matches, tree marks) pushes a choice nobody takes:
+ *             both go
+ *   nops      Nops on the path of execution; the Nop that names each
+ *             production stays (calls, the profilers and --speculate read it)
+ *   threading branch operands follow Jump chains to their end; a Call's
+ *             return address does too, its target never does
+ *   tails     a forward Jump to a short tail that ends the flow (TMemo Ret,
+ *             RSet Ret, Fail, ...) becomes a copy of the tail
+ *   dead      instructions no path reaches
+ *   straight  a block reached only by a forward Jump is moved behind it, and
+ *             a Jump to the next instruction goes
+ * Code is only moved or copied within its production, and no branch that
+ * the step limit does not count (see mininez_set_limits) is made to go
+ * backwards. The constant pool of r is updated as by mininez_program_encode.
+ */
+typedef struct mininez_optimize_stats_t {
+  uint64_t before;    /* instructions */
+  uint64_t after;
+  uint64_t choices;   /* Alt and Succ pairs removed */
+  uint64_t nops;
+  uint64_t threaded;  /* branch operands moved past a Jump */
+  uint64_t tails;     /* Jumps replaced by their tail */
+  uint64_t dead;
+  uint64_t straight;  /* Jumps removed by moving or falling through */
+} mininez_optimize_stats_t;
+
+mininez_inst_t *mininez_optimize(mininez_runtime_t *r, mininez_inst_t *inst, mininez_optimize_stats_t *stats);
+/* "Optimize: <before> -> <after> instructions (...)" */
+void mininez_optimize_report(mininez_optimize_stats_t *stats, FILE *fp);
+
+#endif
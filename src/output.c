@@ -0,0 +1,367 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "nezvm.h"
+#include "output.h"
+
+void mininez_writer_init(mininez_writer_t *w, int fd) {
+  w->fd = fd;
+  w->error = 0;
+  w->size = 0;
+  w->buf = (char *) VM_MALLOC(MININEZ_WRITER_BUFFER_SIZE);
+}
+
+static void writer_writev(mininez_writer_t *w, struct iovec *iov, int n) {
+  while (n > 0 && !w->error) {
+    ssize_t done = writev(w->fd, iov, n);
+    if (done < 0) {
+      if (errno != EINTR) {
+        w->error = 1;
+      }
+      continue;
+    }
+    while (n > 0 && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  w->size = 0;
+}
+
+void mininez_writer_write(mininez_writer_t *w, const void *p, size_t len) {
+  if (w->size + len <= MININEZ_WRITER_BUFFER_SIZE) {
+    memcpy(w->buf + w->size, p, len);
+    w->size += len;
+    return;
+  }
+  if (len < MININEZ_WRITER_BUFFER_SIZE / 2) {
+    mininez_writer_flush(w);
+    memcpy(w->buf, p, len);
+    w->size = len;
+    return;
+  }
+  /* large chunks go out together with the buffer, without a copy */
+  struct iovec iov[2];
+  iov[0].iov_base = w->buf;
+  iov[0].iov_len = w->size;
+  iov[1].iov_base = (void *)p;
+  iov[1].iov_len = len;
+  writer_writev(w, iov, 2);
+}
+
+int mininez_writer_flush(mininez_writer_t *w) {
+  if (w->size > 0) {
+    struct iovec iov;
+    iov.iov_base = w->buf;
+    iov.iov_len = w->size;
+    writer_writev(w, &iov, 1);
+  }
+  return w->error ? -1 : 0;
+}
+
+void mininez_writer_dispose(mininez_writer_t *w) {
+  VM_FREE(w->buf);
+  w->buf = NULL;
+}
+
+static inline void writer_putc(mininez_writer_t *w, char c) {
+  if (w->size == MININEZ_WRITER_BUFFER_SIZE) {
+    mininez_writer_flush(w);
+  }
+  w->buf[w->size++] = c;
+}
+
+static inline void writer_puts(mininez_writer_t *w, const char *s) {
+  mininez_writer_write(w, s, strlen(s));
+}
+
+int mininez_output_format(const char *name) {
+  if (!strcmp(name, "tree")) {
+    return MININEZ_OUTPUT_TEXT;
+  }
+  if (!strcmp(name, "json")) {
+    return MININEZ_OUTPUT_JSON;
+  }
+  if (!strcmp(name, "binary")) {
+    return MININEZ_OUTPUT_BINARY;
+  }
+  return -1;
+}
+
+/* Tree Walk: (node, next child) frames on a heap stack */
+typedef struct walk_frame_t {
+  Tree *t;
+  size_t i;
+} walk_frame_t;
+
+typedef struct walk_stack_t {
+  walk_frame_t *frames;
+  size_t size;
+  size_t capacity;
+} walk_stack_t;
+
+static void walk_push(walk_stack_t *s, Tree *t) {
+  if (s->size == s->capacity) {
+    s->capacity = s->capacity == 0 ? 64 : s->capacity * 2;
+    s->frames = (walk_frame_t *) realloc(s->frames, sizeof(walk_frame_t) * s->capacity);
+  }
+  s->frames[s->size].t = t;
+  s->frames[s->size].i = 0;
+  s->size++;
+}
+
+/* Text */
+static void text_indent(mininez_writer_t *w, size_t indent) {
+  for (size_t i = 0; i < indent; i++) {
+    writer_putc(w, ' ');
+    writer_putc(w, ' ');
+  }
+}
+
+/* writes a node up to its first child; returns 1 when it has children */
+static int text_open(mininez_writer_t *w, Tree *t) {
+  if (t == NULL) {
+    mininez_writer_write(w, "null", 4);
+    return 0;
+  }
+  writer_putc(w, '#');
+  writer_puts(w, t->tag);
+  writer_putc(w, '[');
+  if (t->size == 0) {
+    writer_putc(w, '\'');
+    mininez_writer_write(w, t->text, t->len);
+    writer_putc(w, '\'');
+    writer_putc(w, ']');
+    return 0;
+  }
+  writer_putc(w, '\n');
+  return 1;
+}
+
+static void text_write(mininez_writer_t *w, Tree *root) {
+  walk_stack_t s = { NULL, 0, 0 };
+  if (text_open(w, root)) {
+    walk_push(&s, root);
+  }
+  while (s.size > 0) {
+    walk_frame_t *f = &s.frames[s.size - 1];
+    Tree *t = f->t;
+    if (f->i == t->size) {
+      s.size--;
+      text_indent(w, s.size);
+      writer_putc(w, ']');
+      if (s.size > 0) {
+        writer_putc(w, '\n');
+      }
+      continue;
+    }
+    size_t i = f->i++;
+    text_indent(w, s.size);
+    if (t->labels[i] != 0) {
+      writer_putc(w, '$');
+      writer_puts(w, t->labels[i]);
+      writer_putc(w, '=');
+    }
+    if (text_open(w, t->childs[i])) {
+      walk_push(&s, t->childs[i]);
+    } else {
+      writer_putc(w, '\n');
+    }
+  }
+  free(s.frames);
+}
+
+/* JSON */
+
+/* Length of the prefix of s that needs no escaping */
+static size_t json_plain_length(const unsigned char *s, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i space = _mm_set1_epi8(0x20);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    /* max(v, 0x20) == v exactly when v >= 0x20 as an unsigned byte */
+    __m128i printable = _mm_cmpeq_epi8(_mm_max_epu8(v, space), v);
+    __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+    int mask = _mm_movemask_epi8(special) | (~_mm_movemask_epi8(printable) & 0xffff);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    if (s[i] < 0x20 || s[i] == '"' || s[i] == '\\') {
+      break;
+    }
+  }
+  return i;
+}
+
+static void json_string(mininez_writer_t *w, const unsigned char *s, size_t len) {
+  writer_putc(w, '"');
+  while (len > 0) {
+    size_t n = json_plain_length(s, len);
+    mininez_writer_write(w, s, n);
+    s += n;
+    len -= n;
+    if (len == 0) {
+      break;
+    }
+    char esc[8];
+    esc[0] = '\\';
+    switch (*s) {
+    case '"':  esc[1] = '"'; break;
+    case '\\': esc[1] = '\\'; break;
+    case '\n': esc[1] = 'n'; break;
+    case '\r': esc[1] = 'r'; break;
+    case '\t': esc[1] = 't'; break;
+    case '\b': esc[1] = 'b'; break;
+    case '\f': esc[1] = 'f'; break;
+    default:
+      memcpy(esc + 1, "u00", 3);
+      esc[4] = "0123456789abcdef"[*s >> 4];
+      esc[5] = "0123456789abcdef"[*s & 0xf];
+      mininez_writer_write(w, esc, 6);
+      s++;
+      len--;
+      continue;
+    }
+    mininez_writer_write(w, esc, 2);
+    s++;
+    len--;
+  }
+  writer_putc(w, '"');
+}
+
+void mininez_write_json_string(mininez_writer_t *w, const unsigned char *s, size_t len) {
+  json_string(w, s, len);
+}
+
+static void json_symbol(mininez_writer_t *w, symbol_t s) {
+  const char *str = s != NULL ? s : "";
+  json_string(w, (const unsigned char *)str, strlen(str));
+}
+
+/* {"label":..,"tag":..,"text":..} or {..,"tag":..,"children":[ */
+static int json_open(mininez_writer_t *w, Tree *t, symbol_t label) {
+  if (t == NULL) {
+    mininez_writer_write(w, "null", 4);
+    return 0;
+  }
+  writer_putc(w, '{');
+  if (label != 0) {
+    mininez_writer_write(w, "\"label\":", 8);
+    json_symbol(w, label);
+    writer_putc(w, ',');
+  }
+  mininez_writer_write(w, "\"tag\":", 6);
+  json_symbol(w, t->tag);
+  if (t->size == 0) {
+    mininez_writer_write(w, ",\"text\":", 8);
+    json_string(w, t->text, t->len);
+    writer_putc(w, '}');
+    return 0;
+  }
+  mininez_writer_write(w, ",\"children\":[", 13);
+  return 1;
+}
+
+void mininez_write_json(mininez_writer_t *w, Tree *root) {
+  walk_stack_t s = { NULL, 0, 0 };
+  if (json_open(w, root, 0)) {
+    walk_push(&s, root);
+  }
+  while (s.size > 0) {
+    walk_frame_t *f = &s.frames[s.size - 1];
+    Tree *t = f->t;
+    if (f->i == t->size) {
+      writer_putc(w, ']');
+      writer_putc(w, '}');
+      s.size--;
+      continue;
+    }
+    size_t i = f->i++;
+    if (i > 0) {
+      writer_putc(w, ',');
+    }
+    if (json_open(w, t->childs[i], t->labels[i])) {
+      walk_push(&s, t->childs[i]);
+    }
+  }
+  free(s.frames);
+}
+
+/* Binary */
+static void binary_symbol(mininez_writer_t *w, symbol_t s) {
+  uint16_t len = s != NULL ? (uint16_t)strlen(s) : 0;
+  mininez_writer_write(w, &len, sizeof(len));
+  mininez_writer_write(w, s, len);
+}
+
+static int binary_open(mininez_writer_t *w, Tree *t) {
+  if (t == NULL) {
+    writer_putc(w, 0);
+    return 0;
+  }
+  writer_putc(w, t->size == 0 ? 1 : 2);
+  binary_symbol(w, t->tag);
+  if (t->size == 0) {
+    uint32_t len = (uint32_t)t->len;
+    mininez_writer_write(w, &len, sizeof(len));
+    mininez_writer_write(w, t->text, len);
+    return 0;
+  }
+  uint32_t size = (uint32_t)t->size;
+  mininez_writer_write(w, &size, sizeof(size));
+  return 1;
+}
+
+static void binary_write(mininez_writer_t *w, Tree *root) {
+  walk_stack_t s = { NULL, 0, 0 };
+  mininez_writer_write(w, "MNZT\1", 5);
+  if (binary_open(w, root)) {
+    walk_push(&s, root);
+  }
+  while (s.size > 0) {
+    walk_frame_t *f = &s.frames[s.size - 1];
+    Tree *t = f->t;
+    if (f->i == t->size) {
+      s.size--;
+      continue;
+    }
+    size_t i = f->i++;
+    binary_symbol(w, t->labels[i]);
+    if (binary_open(w, t->childs[i])) {
+      walk_push(&s, t->childs[i]);
+    }
+  }
+  free(s.frames);
+}
+
+void mininez_write_tree(mininez_writer_t *w, Tree *t, mininez_output_format_t format) {
+  switch (format) {
+  case MININEZ_OUTPUT_TEXT:
+    text_write(w, t);
+    writer_putc(w, '\n');
+    break;
+  case MININEZ_OUTPUT_JSON:
+    mininez_write_json(w, t);
+    writer_putc(w, '\n');
+    break;
+  case MININEZ_OUTPUT_BINARY:
+    binary_write(w, t);
+    break;
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "nezvm.h"
+
+typedef enum mininez_output_format_t {
+  MININEZ_OUTPUT_TEXT,   /* the indented format of dumpAST */
+  MININEZ_OUTPUT_JSON,   /* compact JSON, one document per tree */
+  MININEZ_OUTPUT_BINARY  /* see mininez_write_tree */
+} mininez_output_format_t;
+
+#define MININEZ_WRITER_BUFFER_SIZE (1024 * 1024)
+
+/* Buffered Writer
+ * Output is collected in one large buffer and handed to the kernel with a
+ * single write (or writev for chunks larger than the free space) per flush.
+ */
+typedef struct mininez_writer_t {
+  int fd;
+  int error;
+  size_t size;
+  char *buf;
+} mininez_writer_t;
+
+void mininez_writer_init(mininez_writer_t *w, int fd);
+void mininez_writer_write(mininez_writer_t *w, const void *p, size_t len);
+/* returns 0 when everything written so far reached the file */
+int mininez_writer_flush(mininez_writer_t *w);
+void mininez_writer_dispose(mininez_writer_t *w);
+
+/* returns -1 for an unknown name ("tree", "json", "binary") */
+int mininez_output_format(const char *name);
+
+/* Tree Serialisation
+ * Trees are walked without recursion, so deep trees do not exhaust the C
+ * stack. The binary format is in host byte order:
+ *   tree  := "MNZT" u8(version) node
+ *   node  := u8(0)                                   null
+ *          | u8(1) str(tag) u32(len) text            leaf
+ *          | u8(2) str(tag) u32(size) (str(label) node)*size
+ *   str   := u16(len) bytes                          len 0: no label
+ */
+void mininez_write_tree(mininez_writer_t *w, Tree *t, mininez_output_format_t format);
+/* The JSON document of t without the newline of mininez_write_tree */
+void mininez_write_json(mininez_writer_t *w, Tree *t);
+/* A quoted and escaped JSON string */
+void mininez_write_json_string(mininez_writer_t *w, const unsigned char *s, size_t len);
+
+#endif
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+static const char *perf_names[MININEZ_PERF_EVENTS] = {
+  "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses", "dTLB-misses"
+};
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_CACHE_MISS(CACHE) \
+  ((CACHE) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct { uint32_t type; uint64_t config; } perf_events[MININEZ_PERF_EVENTS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+  { PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+  { PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+};
+
+int mininez_perf_open(mininez_perf_t *p) {
+  int opened = 0;
+  memset(p, 0, sizeof(*p));
+  for (int i = 0; i < MININEZ_PERF_EVENTS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    p->fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (p->fds[i] < 0) {
+      p->fds[i] = -1;
+      if (p->error == 0) {
+        p->error = errno;
+      }
+      continue;
+    }
+    opened++;
+  }
+  return opened;
+}
+
+void mininez_perf_start(mininez_perf_t *p) {
+  for (int i = 0; i < MININEZ_PERF_EVENTS; i++) {
+    if (p->fds[i] >= 0) {
+      ioctl(p->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(p->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void mininez_perf_stop(mininez_perf_t *p) {
+  for (int i = 0; i < MININEZ_PERF_EVENTS; i++) {
+    if (p->fds[i] >= 0) {
+      ioctl(p->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (int i = 0; i < MININEZ_PERF_EVENTS; i++) {
+    uint64_t v[3]; /* value, time enabled, time running */
+    p->counts[i] = 0;
+    if (p->fds[i] < 0 || read(p->fds[i], v, sizeof(v)) != sizeof(v)) {
+      continue;
+    }
+    p->counts[i] = v[2] == 0 ? 0 : v[2] < v[1] ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+  }
+}
+
+void mininez_perf_close(mininez_perf_t *p) {
+  for (int i = 0; i < MININEZ_PERF_EVENTS; i++) {
+    if (p->fds[i] >= 0) {
+      close(p->fds[i]);
+      p->fds[i] = -1;
+    }
+  }
+}
+
+int mininez_perf_thread_open(mininez_perf_event_t event) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = perf_events[event].type;
+  attr.config = perf_events[event].config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  return fd < 0 ? -1 : fd;
+}
+
+uint64_t mininez_perf_thread_read(int fd) {
+  uint64_t value;
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+    return 0;
+  }
+  return value;
+}
+
+#else
+
+int mininez_perf_open(mininez_perf_t *p) {
+  memset(p, 0, sizeof(*p));
+  for (int i = 0; i < MININEZ_PERF_EVENTS; i++) {
+    p->fds[i] = -1;
+  }
+  p->error = ENOSYS;
+  return 0;
+}
+
+void mininez_perf_start(mininez_perf_t *p) {
+}
+
+void mininez_perf_stop(mininez_perf_t *p) {
+}
+
+void mininez_perf_close(mininez_perf_t *p) {
+}
+
+int mininez_perf_thread_open(mininez_perf_event_t event) {
+  errno = ENOSYS;
+  return -1;
+}
+
+uint64_t mininez_perf_thread_read(int fd) {
+  return 0;
+}
+
+#endif
+
+void mininez_perf_report(mininez_perf_t *p, size_t bytes, FILE *fp) {
+  uint64_t insns = p->counts[MININEZ_PERF_INSTRUCTIONS];
+  int has_insns = p->fds[MININEZ_PERF_INSTRUCTIONS] >= 0 && insns > 0;
+  fprintf(fp, "%-14s %16s %12s %12s\n", "counter", "count", "per byte", "per 1k inst");
+  for (int i = 0; i < MININEZ_PERF_EVENTS; i++) {
+    if (p->fds[i] < 0) {
+      fprintf(fp, "%-14s %16s\n", perf_names[i], "n/a");
+      continue;
+    }
+    fprintf(fp, "%-14s %16llu %12.3f", perf_names[i], (unsigned long long)p->counts[i],
+            bytes == 0 ? 0.0 : (double)p->counts[i] / bytes);
+    if (has_insns && i != MININEZ_PERF_INSTRUCTIONS) {
+      fprintf(fp, " %12.3f", (double)p->counts[i] * 1000 / insns);
+    }
+    fprintf(fp, "\n");
+  }
+  if (has_insns && p->fds[MININEZ_PERF_CYCLES] >= 0 && p->counts[MININEZ_PERF_CYCLES] > 0) {
+    fprintf(fp, "IPC: %.3f\n", (double)insns / p->counts[MININEZ_PERF_CYCLES]);
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Hardware Counters
+ * Linux perf_event_open counters of the calling thread and the threads it
+ * starts while they are enabled (so -s and -b workers count too), user space
+ * only. An event the CPU or kernel does not offer is left out; counts of
+ * events the kernel had to multiplex are scaled to the time they ran.
+ */
+typedef enum mininez_perf_event_t {
+  MININEZ_PERF_CYCLES,
+  MININEZ_PERF_INSTRUCTIONS,
+  MININEZ_PERF_BRANCH_MISSES,
+  MININEZ_PERF_L1D_MISSES,
+  MININEZ_PERF_LLC_MISSES,
+  MININEZ_PERF_DTLB_MISSES,
+  MININEZ_PERF_EVENTS
+} mininez_perf_event_t;
+
+typedef struct mininez_perf_t {
+  int fds[MININEZ_PERF_EVENTS];      /* -1: not counted */
+  uint64_t counts[MININEZ_PERF_EVENTS];
+  int error;                         /* errno of the first event that failed */
+} mininez_perf_t;
+
+/* Returns the number of events opened; 0 when none could be (see error) */
+int mininez_perf_open(mininez_perf_t *p);
+void mininez_perf_start(mininez_perf_t *p);
+void mininez_perf_stop(mininez_perf_t *p);
+/* Counts with ratios per input byte and per thousand instructions */
+void mininez_perf_report(mininez_perf_t *p, size_t bytes, FILE *fp);
+void mininez_perf_close(mininez_perf_t *p);
+
+/* A single counter of the calling thread alone, running from the open on:
+ * the difference of two reads is the count between them. Returns -1 with
+ * errno set when it cannot be opened; close(2) it when done. */
+int mininez_perf_thread_open(mininez_perf_event_t event);
+uint64_t mininez_perf_thread_read(int fd);
+
+#endif
@@ -0,0 +1,626 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "profile.h"
+
+static mininez_profile_t profile_total;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static int profile_registered = 0;
+static int profile_productions = 0;
+static const char *profile_folded = NULL;
+static const char *profile_heat_path = NULL;
+
+#define PROFILE_NONE UINT32_MAX
+
+mininez_profile_t *mininez_profile_new(void) {
+  mininez_profile_t *p = (mininez_profile_t *) calloc(1, sizeof(mininez_profile_t));
+  if (profile_productions) {
+    /* sized by the first mininez_profile_begin */
+    p->node_capacity = 64;
+    p->nodes = (mininez_profile_node_t *) VM_MALLOC(sizeof(mininez_profile_node_t) * p->node_capacity);
+    p->nodes[0].parent = PROFILE_NONE;
+    p->nodes[0].prod = PROFILE_NONE;
+    p->nodes[0].first = p->nodes[0].next = 0;
+    p->nodes[0].cycles = 0;
+    p->node_size = 1;
+  }
+  p->heatmap = profile_heat_path != NULL;
+  return p;
+}
+
+void mininez_profile_productions(const char *folded) {
+  profile_productions = 1;
+  profile_folded = folded;
+}
+
+void mininez_profile_heatmap(const char *path) {
+  profile_heat_path = path;
+}
+
+static void profile_at_exit(void) {
+  mininez_profile_print(&profile_total, stderr);
+  if (profile_total.prods != NULL) {
+    mininez_profile_print_productions(&profile_total, stderr);
+  }
+  if (profile_folded != NULL && mininez_profile_write_folded(&profile_total, profile_folded) != 0) {
+    fprintf(stderr, "profile error: cannot write %s\n", profile_folded);
+  }
+  if (profile_heat_path != NULL && profile_total.heat_buckets > 0
+      && mininez_profile_write_heatmap(&profile_total, profile_heat_path) != 0) {
+    fprintf(stderr, "profile error: cannot write %s\n", profile_heat_path);
+  }
+}
+
+/* The child of node n for production prod, added if needed */
+static uint32_t profile_child(mininez_profile_t *p, uint32_t n, uint32_t prod) {
+  uint32_t c;
+  for (c = p->nodes[n].first; c != 0; c = p->nodes[c].next) {
+    if (p->nodes[c].prod == prod) {
+      return c;
+    }
+  }
+  if (p->node_size == p->node_capacity) {
+    p->node_capacity *= 2;
+    p->nodes = (mininez_profile_node_t *) realloc(p->nodes, sizeof(mininez_profile_node_t) * p->node_capacity);
+  }
+  c = p->node_size++;
+  p->nodes[c].parent = n;
+  p->nodes[c].prod = prod;
+  p->nodes[c].first = 0;
+  p->nodes[c].next = p->nodes[n].first;
+  p->nodes[c].cycles = 0;
+  p->nodes[n].first = c;
+  return c;
+}
+
+/* Production names without the "_0." prefix, plus "(entry)" */
+static void profile_names(mininez_profile_t *p, mininez_constant_t *C) {
+  if (p->prod_names != NULL) {
+    return;
+  }
+  p->prod_names = (char **) VM_MALLOC(sizeof(char *) * (C->prod_size + 1));
+  for (uint16_t i = 0; i < C->prod_size; i++) {
+    const char *dot = strrchr(C->prod_names[i], '.');
+    p->prod_names[i] = strdup(dot != NULL ? dot + 1 : C->prod_names[i]);
+  }
+  p->prod_names[C->prod_size] = strdup("(entry)");
+  p->prod_size = C->prod_size;
+}
+
+static void profile_merge_productions(mininez_profile_t *p) {
+  mininez_profile_t *t = &profile_total;
+  if (t->prods == NULL) {
+    t->prods = (mininez_profile_production_t *) calloc(t->prod_size + 1, sizeof(mininez_profile_production_t));
+    t->node_capacity = p->node_capacity;
+    t->nodes = (mininez_profile_node_t *) VM_MALLOC(sizeof(mininez_profile_node_t) * t->node_capacity);
+    t->nodes[0] = p->nodes[0];
+    t->nodes[0].first = 0;
+    t->node_size = 1;
+  }
+  if (t->prod_size != p->prod_size) {
+    return; /* another grammar */
+  }
+  for (uint16_t i = 0; i <= p->prod_size; i++) {
+    t->prods[i].calls += p->prods[i].calls;
+    t->prods[i].inclusive += p->prods[i].inclusive;
+    t->prods[i].exclusive += p->prods[i].exclusive;
+    t->prods[i].consumed += p->prods[i].consumed;
+    t->prods[i].fails += p->prods[i].fails;
+    t->prods[i].backtracked += p->prods[i].backtracked;
+  }
+  /* parents come before their children */
+  uint32_t *map = (uint32_t *) VM_MALLOC(sizeof(uint32_t) * p->node_size);
+  map[0] = 0;
+  for (uint32_t n = 1; n < p->node_size; n++) {
+    map[n] = profile_child(t, map[p->nodes[n].parent], p->nodes[n].prod);
+    t->nodes[map[n]].cycles += p->nodes[n].cycles;
+  }
+  VM_FREE(map);
+}
+
+static void profile_grow_pcs(mininez_profile_t *p, uint64_t size) {
+  if (size <= p->pc_size) {
+    return;
+  }
+  p->pc_returns = (uint64_t *) realloc(p->pc_returns, sizeof(uint64_t) * size);
+  p->pc_bytes = (uint64_t *) realloc(p->pc_bytes, sizeof(uint64_t) * size);
+  p->pc_prod = (uint32_t *) realloc(p->pc_prod, sizeof(uint32_t) * size);
+  memset(p->pc_returns + p->pc_size, 0, sizeof(uint64_t) * (size - p->pc_size));
+  memset(p->pc_bytes + p->pc_size, 0, sizeof(uint64_t) * (size - p->pc_size));
+  memset(p->pc_prod + p->pc_size, 0, sizeof(uint32_t) * (size - p->pc_size));
+  p->pc_size = size;
+}
+
+static void profile_merge_heat(mininez_profile_t *p) {
+  mininez_profile_t *t = &profile_total;
+  if (t->heat_buckets == 0) {
+    t->heat_buckets = p->heat_buckets;
+    t->heat_returns = (uint64_t *) calloc(t->heat_buckets, sizeof(uint64_t));
+    t->heat_bytes = (uint64_t *) calloc(t->heat_buckets, sizeof(uint64_t));
+  }
+  /* both split their inputs evenly */
+  for (uint32_t i = 0; i < p->heat_buckets; i++) {
+    uint32_t k = (uint32_t)((uint64_t)i * t->heat_buckets / p->heat_buckets);
+    t->heat_returns[k] += p->heat_returns[i];
+    t->heat_bytes[k] += p->heat_bytes[i];
+  }
+  t->heat_inputs += p->heat_inputs;
+  t->heat_length = t->heat_length == 0 ? p->heat_length : t->heat_length;
+  profile_grow_pcs(t, p->pc_size);
+  for (uint64_t i = 0; i < p->pc_size; i++) {
+    t->pc_returns[i] += p->pc_returns[i];
+    t->pc_bytes[i] += p->pc_bytes[i];
+    if (p->pc_prod[i] != 0) {
+      t->pc_prod[i] = p->pc_prod[i];
+    }
+  }
+}
+
+static void profile_dispose(mininez_profile_t *p) {
+  if (p->prod_names != NULL) {
+    for (uint16_t i = 0; i <= p->prod_size; i++) {
+      VM_FREE(p->prod_names[i]);
+    }
+    VM_FREE(p->prod_names);
+  }
+  VM_FREE(p->prods);
+  VM_FREE(p->nodes);
+  VM_FREE(p->frames);
+  VM_FREE(p->prod_of);
+  VM_FREE(p->memos);
+  VM_FREE(p->heat_returns);
+  VM_FREE(p->heat_bytes);
+  VM_FREE(p->pc_returns);
+  VM_FREE(p->pc_bytes);
+  VM_FREE(p->pc_prod);
+  VM_FREE(p);
+}
+
+void mininez_profile_merge(mininez_profile_t *p) {
+  pthread_mutex_lock(&profile_lock);
+  for (int i = 0; i < MININEZ_PROFILE_OPCODES; i++) {
+    profile_total.counts[i] += p->counts[i];
+    profile_total.cycles[i] += p->cycles[i];
+  }
+  profile_total.runs += p->runs;
+  profile_total.consumed += p->consumed;
+  profile_total.fails += p->fails;
+  profile_total.backtracked += p->backtracked;
+  profile_total.rewound += p->rewound;
+  if (profile_total.prod_names == NULL && p->prod_names != NULL) {
+    /* the first grammar seen; the names move over */
+    profile_total.prod_names = p->prod_names;
+    profile_total.prod_size = p->prod_size;
+    p->prod_names = NULL;
+  }
+  if (p->prods != NULL) {
+    profile_merge_productions(p);
+  }
+  if (p->heat_buckets > 0) {
+    profile_merge_heat(p);
+  }
+  if (p->memo_size > 0) {
+    mininez_profile_memo(&profile_total, p->memo_size - 1);
+    for (uint32_t i = 0; i < p->memo_size; i++) {
+      profile_total.memos[i].hits += p->memos[i].hits;
+      profile_total.memos[i].fail_hits += p->memos[i].fail_hits;
+      profile_total.memos[i].misses += p->memos[i].misses;
+      profile_total.memos[i].stores += p->memos[i].stores;
+      profile_total.memos[i].collisions += p->memos[i].collisions;
+    }
+  }
+  if (p->memo_live >= profile_total.memo_live) {
+    profile_total.memo_slots = p->memo_slots;
+    profile_total.memo_live = p->memo_live;
+    profile_total.memo_trees = p->memo_trees;
+    profile_total.memo_retained = p->memo_retained;
+  }
+  if (!profile_registered) {
+    profile_registered = 1;
+    atexit(profile_at_exit);
+  }
+  pthread_mutex_unlock(&profile_lock);
+  profile_dispose(p);
+}
+
+mininez_profile_memo_t *mininez_profile_grow_memo(mininez_profile_t *p, uint16_t uid) {
+  uint32_t size = p->memo_size == 0 ? 16 : p->memo_size;
+  while (size <= uid) {
+    size *= 2;
+  }
+  p->memos = (mininez_profile_memo_t *) realloc(p->memos, sizeof(mininez_profile_memo_t) * size);
+  memset(p->memos + p->memo_size, 0, sizeof(mininez_profile_memo_t) * (size - p->memo_size));
+  p->memo_size = size;
+  return &p->memos[uid];
+}
+
+/* Pointer set for the distinct trees of the memo table */
+typedef struct profile_set_t {
+  const void **items;
+  size_t size;
+  size_t capacity;
+} profile_set_t;
+
+static int profile_set_add(profile_set_t *s, const void *p) {
+  if (s->size * 2 >= s->capacity) {
+    profile_set_t old = *s;
+    s->capacity = old.capacity == 0 ? 1024 : old.capacity * 2;
+    s->items = (const void **) calloc(s->capacity, sizeof(void *));
+    s->size = 0;
+    for (size_t i = 0; i < old.capacity; i++) {
+      if (old.items[i] != NULL) {
+        profile_set_add(s, old.items[i]);
+      }
+    }
+    VM_FREE(old.items);
+  }
+  size_t i = ((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ULL % s->capacity;
+  while (s->items[i] != NULL) {
+    if (s->items[i] == p) {
+      return 0;
+    }
+    i = (i + 1) % s->capacity;
+  }
+  s->items[i] = p;
+  s->size++;
+  return 1;
+}
+
+static size_t profile_retained(profile_set_t *set, Tree *root) {
+  size_t bytes = 0, depth = 0, capacity = 64;
+  Tree **stack = (Tree **) VM_MALLOC(sizeof(Tree *) * capacity);
+  stack[depth++] = root;
+  while (depth > 0) {
+    Tree *t = stack[--depth];
+    if (t == NULL || !profile_set_add(set, t)) {
+      continue;
+    }
+    bytes += sizeof(Tree) + t->size * (sizeof(symbol_t) + sizeof(Tree *));
+    if (depth + t->size > capacity) {
+      capacity = (depth + t->size) * 2;
+      stack = (Tree **) realloc(stack, sizeof(Tree *) * capacity);
+    }
+    for (size_t i = 0; i < t->size; i++) {
+      stack[depth++] = t->childs[i];
+    }
+  }
+  VM_FREE(stack);
+  return bytes;
+}
+
+void mininez_profile_memo_table(mininez_profile_t *p, ParserContext *ctx, int trees) {
+  profile_set_t set = { NULL, 0, 0 };
+  p->memo_slots = ctx->memoSize;
+  p->memo_live = p->memo_trees = p->memo_retained = 0;
+  for (size_t i = 0; i < ctx->memoSize; i++) {
+    MemoEntry *m = &ctx->memoArray[i];
+    if (m->key == -1LL) {
+      continue;
+    }
+    p->memo_live++;
+    if (m->memoTree != NULL) {
+      p->memo_trees++;
+      if (trees) {
+        p->memo_retained += profile_retained(&set, m->memoTree);
+      }
+    }
+  }
+  VM_FREE(set.items);
+}
+
+void mininez_profile_begin(mininez_profile_t *p, mininez_runtime_t *r, const mininez_inst_t *inst, uint64_t entry, const unsigned char *pos) {
+  mininez_constant_t *C = r->C;
+  profile_names(p, C);
+  if (p->prods == NULL) {
+    p->prods = (mininez_profile_production_t *) calloc(p->prod_size + 1, sizeof(mininez_profile_production_t));
+  }
+  if (p->code != inst) {
+    uint64_t size = mininez_code_size(r, (mininez_inst_t *)inst);
+    const mininez_inst_t *pc = inst;
+    VM_FREE(p->prod_of);
+    p->prod_of = (uint32_t *) calloc(size + 1, sizeof(uint32_t));
+    for (uint64_t i = 0; i < mininez_code_length(inst); i++) {
+      if (*pc == Nop) {
+        p->prod_of[(pc - inst) + opcode_length(Nop)] = *(const uint16_t *)(pc + 1) + 1;
+      }
+      pc += opcode_length(*pc);
+    }
+    p->code = inst;
+  }
+  if (inst[entry] == Nop) {
+    entry += opcode_length(Nop);
+  }
+  p->last_tick = mininez_profile_tick();
+  p->frame_size = 0;
+  /* the entry frame is only left by mininez_profile_end */
+  mininez_profile_enter(p, entry, INT64_MIN, pos);
+  if (p->frame_size == 0) {
+    mininez_profile_enter(p, PROFILE_NONE, INT64_MIN, pos);
+  }
+}
+
+void mininez_profile_heat_begin(mininez_profile_t *p, mininez_runtime_t *r, const mininez_inst_t *inst, size_t length) {
+  mininez_constant_t *C = r->C;
+  profile_names(p, C);
+  if (p->heat_buckets == 0) {
+    p->heat_buckets = length < MININEZ_PROFILE_BUCKETS ? (uint32_t)length + 1 : MININEZ_PROFILE_BUCKETS;
+    p->heat_returns = (uint64_t *) calloc(p->heat_buckets, sizeof(uint64_t));
+    p->heat_bytes = (uint64_t *) calloc(p->heat_buckets, sizeof(uint64_t));
+  }
+  if (p->heat_code != inst) {
+    /* code between two Nop markers belongs to the first one's production */
+    const mininez_inst_t *pc = inst;
+    uint32_t prod = 0;
+    profile_grow_pcs(p, mininez_code_size(r, (mininez_inst_t *)inst) + 1);
+    for (uint64_t i = 0; i < mininez_code_length(inst); i++) {
+      if (*pc == Nop) {
+        prod = *(const uint16_t *)(pc + 1) + 1;
+      }
+      for (int k = 0; k < opcode_length(*pc); k++) {
+        p->pc_prod[(pc - inst) + k] = prod;
+      }
+      pc += opcode_length(*pc);
+    }
+    p->heat_code = inst;
+  }
+  p->heat_length = length;
+  p->heat_inputs += length;
+}
+
+void mininez_profile_backtrack(mininez_profile_t *p, uint64_t pos, uint64_t rescanned, uint64_t pc) {
+  uint32_t bucket = (uint32_t)(pos * p->heat_buckets / (p->heat_length + 1));
+  p->heat_returns[bucket]++;
+  p->heat_bytes[bucket] += rescanned;
+  if (pc < p->pc_size) {
+    p->pc_returns[pc]++;
+    p->pc_bytes[pc] += rescanned;
+  }
+}
+
+static void profile_account(mininez_profile_t *p, uint64_t now) {
+  if (p->frame_size > 0) {
+    mininez_profile_frame_t *f = &p->frames[p->frame_size - 1];
+    p->nodes[f->node].cycles += now - p->last_tick;
+    p->prods[f->prod].exclusive += now - p->last_tick;
+  }
+  p->last_tick = now;
+}
+
+void mininez_profile_enter(mininez_profile_t *p, uint64_t target, int64_t depth, const unsigned char *pos) {
+  uint32_t prod;
+  if (target == PROFILE_NONE) {
+    prod = p->prod_size;
+  } else if (p->prod_of[target] != 0) {
+    prod = p->prod_of[target] - 1;
+  } else {
+    return;
+  }
+  uint64_t now = mininez_profile_tick();
+  profile_account(p, now);
+  if (p->frame_size == p->frame_capacity) {
+    p->frame_capacity = p->frame_capacity == 0 ? 64 : p->frame_capacity * 2;
+    p->frames = (mininez_profile_frame_t *) realloc(p->frames, sizeof(mininez_profile_frame_t) * p->frame_capacity);
+  }
+  mininez_profile_frame_t *f = &p->frames[p->frame_size];
+  f->depth = depth;
+  f->node = profile_child(p, p->frame_size == 0 ? 0 : p->frames[p->frame_size - 1].node, prod);
+  f->prod = prod;
+  f->pos = pos;
+  f->tick = now;
+  p->frame_size++;
+  p->prods[prod].calls++;
+  p->prods[prod].active++;
+}
+
+static void profile_pop(mininez_profile_t *p, uint64_t now, const unsigned char *pos, int failed) {
+  mininez_profile_frame_t *f = &p->frames[--p->frame_size];
+  mininez_profile_production_t *prod = &p->prods[f->prod];
+  if (--prod->active == 0) {
+    prod->inclusive += now - f->tick;
+  }
+  if (failed) {
+    prod->fails++;
+    prod->backtracked += pos > f->pos ? pos - f->pos : 0;
+  } else {
+    prod->consumed += pos > f->pos ? pos - f->pos : 0;
+  }
+}
+
+void mininez_profile_leave(mininez_profile_t *p, int64_t depth, const unsigned char *pos, int failed) {
+  if (p->frame_size == 0 || p->frames[p->frame_size - 1].depth <= depth) {
+    return;
+  }
+  uint64_t now = mininez_profile_tick();
+  profile_account(p, now);
+  while (p->frame_size > 0 && p->frames[p->frame_size - 1].depth > depth) {
+    profile_pop(p, now, pos, failed);
+  }
+}
+
+void mininez_profile_end(mininez_profile_t *p, const unsigned char *pos, int failed) {
+  uint64_t now = mininez_profile_tick();
+  profile_account(p, now);
+  while (p->frame_size > 0) {
+    profile_pop(p, now, pos, failed);
+  }
+}
+
+static const mininez_profile_t *profile_sorting;
+
+/* by cycles, then by count */
+static int profile_compare(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  const mininez_profile_t *p = profile_sorting;
+  if (p->cycles[x] != p->cycles[y]) {
+    return p->cycles[x] < p->cycles[y] ? 1 : -1;
+  }
+  if (p->counts[x] != p->counts[y]) {
+    return p->counts[x] < p->counts[y] ? 1 : -1;
+  }
+  return x - y;
+}
+
+void mininez_profile_print(const mininez_profile_t *p, FILE *fp) {
+  int order[MININEZ_PROFILE_OPCODES];
+  int size = 0;
+  uint64_t total_count = 0, total_cycles = 0;
+  for (int i = 0; i < MININEZ_PROFILE_OPCODES; i++) {
+    total_count += p->counts[i];
+    total_cycles += p->cycles[i];
+    if (p->counts[i] != 0) {
+      order[size++] = i;
+    }
+  }
+  profile_sorting = p;
+  qsort(order, size, sizeof(int), profile_compare);
+  fprintf(fp, "\n========= Opcode Profile =========\n");
+  fprintf(fp, "%-10s %14s %7s %16s %7s %9s\n", "opcode", "count", "count%", "cycles", "cycles%", "cyc/op");
+  for (int k = 0; k < size; k++) {
+    int i = order[k];
+    fprintf(fp, "%-10s %14llu %6.2f%% %16llu %6.2f%% %9.1f\n", opcode_to_string(i),
+            (unsigned long long)p->counts[i], 100.0 * p->counts[i] / total_count,
+            (unsigned long long)p->cycles[i],
+            total_cycles == 0 ? 0.0 : 100.0 * p->cycles[i] / total_cycles,
+            (double)p->cycles[i] / p->counts[i]);
+  }
+  fprintf(fp, "%-10s %14llu %7s %16llu\n", "total",
+          (unsigned long long)total_count, "", (unsigned long long)total_cycles);
+  fprintf(fp, "runs: %llu, consumed: %llu bytes, fails: %llu, backtracked: %llu bytes, rewound: %llu bytes\n",
+          (unsigned long long)p->runs, (unsigned long long)p->consumed, (unsigned long long)p->fails,
+          (unsigned long long)p->backtracked, (unsigned long long)p->rewound);
+  if (p->consumed != 0) {
+    fprintf(fp, "instructions/byte: %.2f, cycles/byte: %.2f\n",
+            (double)total_count / p->consumed, (double)total_cycles / p->consumed);
+  }
+  if (p->memo_slots == 0) {
+    return;
+  }
+  fprintf(fp, "\n========= Memo Profile =========\n");
+  fprintf(fp, "%-6s %12s %7s %12s %12s %12s %12s\n", "point", "lookups", "hit%", "fail hits", "misses", "stores", "collisions");
+  for (uint32_t i = 0; i < p->memo_size; i++) {
+    const mininez_profile_memo_t *m = &p->memos[i];
+    uint64_t lookups = m->hits + m->fail_hits + m->misses;
+    if (lookups == 0 && m->stores == 0) {
+      continue;
+    }
+    fprintf(fp, "%-6u %12llu %6.2f%% %12llu %12llu %12llu %12llu\n", i, (unsigned long long)lookups,
+            lookups == 0 ? 0.0 : 100.0 * (m->hits + m->fail_hits) / lookups,
+            (unsigned long long)m->fail_hits, (unsigned long long)m->misses,
+            (unsigned long long)m->stores, (unsigned long long)m->collisions);
+  }
+  fprintf(fp, "table: %llu slots, %llu live (%.2f%%), %llu holding trees, %llu bytes of trees retained\n",
+          (unsigned long long)p->memo_slots, (unsigned long long)p->memo_live,
+          100.0 * p->memo_live / p->memo_slots, (unsigned long long)p->memo_trees,
+          (unsigned long long)p->memo_retained);
+}
+
+static const mininez_profile_production_t *profile_prods;
+
+/* by inclusive cycles */
+static int profile_compare_productions(const void *a, const void *b) {
+  const mininez_profile_production_t *x = &profile_prods[*(const uint32_t *)a];
+  const mininez_profile_production_t *y = &profile_prods[*(const uint32_t *)b];
+  if (x->inclusive != y->inclusive) {
+    return x->inclusive < y->inclusive ? 1 : -1;
+  }
+  return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+void mininez_profile_print_productions(const mininez_profile_t *p, FILE *fp) {
+  uint32_t *order = (uint32_t *) VM_MALLOC(sizeof(uint32_t) * (p->prod_size + 1));
+  uint32_t size = 0;
+  for (uint32_t i = 0; i <= p->prod_size; i++) {
+    if (p->prods[i].calls != 0) {
+      order[size++] = i;
+    }
+  }
+  profile_prods = p->prods;
+  qsort(order, size, sizeof(uint32_t), profile_compare_productions);
+  fprintf(fp, "\n========= Production Profile =========\n");
+  fprintf(fp, "%-20s %12s %16s %16s %12s %10s %12s\n",
+          "production", "calls", "inclusive", "exclusive", "consumed", "fails", "backtracked");
+  for (uint32_t k = 0; k < size; k++) {
+    const mininez_profile_production_t *s = &p->prods[order[k]];
+    fprintf(fp, "%-20s %12llu %16llu %16llu %12llu %10llu %12llu\n", p->prod_names[order[k]],
+            (unsigned long long)s->calls, (unsigned long long)s->inclusive,
+            (unsigned long long)s->exclusive, (unsigned long long)s->consumed,
+            (unsigned long long)s->fails, (unsigned long long)s->backtracked);
+  }
+  VM_FREE(order);
+}
+
+static void profile_write_path(const mininez_profile_t *p, uint32_t n, FILE *fp) {
+  if (p->nodes[n].parent != 0) {
+    profile_write_path(p, p->nodes[n].parent, fp);
+    fputc(';', fp);
+  }
+  fputs(p->prod_names[p->nodes[n].prod], fp);
+}
+
+int mininez_profile_write_folded(const mininez_profile_t *p, const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  for (uint32_t n = 1; n < p->node_size; n++) {
+    if (p->nodes[n].cycles != 0) {
+      profile_write_path(p, n, fp);
+      fprintf(fp, " %llu\n", (unsigned long long)p->nodes[n].cycles);
+    }
+  }
+  return fclose(fp);
+}
+
+static const mininez_profile_t *profile_heat;
+
+/* by rescanned bytes, then by returns */
+static int profile_compare_pcs(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  const mininez_profile_t *p = profile_heat;
+  if (p->pc_bytes[x] != p->pc_bytes[y]) {
+    return p->pc_bytes[x] < p->pc_bytes[y] ? 1 : -1;
+  }
+  if (p->pc_returns[x] != p->pc_returns[y]) {
+    return p->pc_returns[x] < p->pc_returns[y] ? 1 : -1;
+  }
+  return x < y ? -1 : 1;
+}
+
+int mininez_profile_write_heatmap(const mininez_profile_t *p, const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  uint64_t width = p->heat_length / p->heat_buckets + 1;
+  fprintf(fp, "# backtracking heatmap: %u buckets of %llu bytes (%llu input bytes in all)\n",
+          p->heat_buckets, (unsigned long long)width, (unsigned long long)p->heat_inputs);
+  fprintf(fp, "# offset returns rescanned\n");
+  for (uint32_t i = 0; i < p->heat_buckets; i++) {
+    if (p->heat_returns[i] != 0) {
+      fprintf(fp, "%llu %llu %llu\n", (unsigned long long)((p->heat_length + 1) * i / p->heat_buckets),
+              (unsigned long long)p->heat_returns[i], (unsigned long long)p->heat_bytes[i]);
+    }
+  }
+  uint64_t *order = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (p->pc_size + 1));
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < p->pc_size; i++) {
+    if (p->pc_returns[i] != 0) {
+      order[size++] = i;
+    }
+  }
+  profile_heat = p;
+  qsort(order, size, sizeof(uint64_t), profile_compare_pcs);
+  fprintf(fp, "# top choice points: pc production returns rescanned\n");
+  for (uint64_t k = 0; k < size && k < MININEZ_PROFILE_TOP; k++) {
+    uint64_t i = order[k];
+    const char *prod = p->pc_prod[i] == 0 || p->prod_names == NULL ? "?" : p->prod_names[p->pc_prod[i] - 1];
+    fprintf(fp, "# %llu %s %llu %llu\n", (unsigned long long)i, prod,
+            (unsigned long long)p->pc_returns[i], (unsigned long long)p->pc_bytes[i]);
+  }
+  VM_FREE(order);
+  return fclose(fp);
+}
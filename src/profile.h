@@ -0,0 +1,155 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <time.h>
+#include "nezvm.h"
+
+/* Profiling Build
+ * With MININEZ_PROFILE=1 (cmake -DMININEZ_PROFILE=ON) every runtime counts
+ * the instructions its VM dispatches and the cycles spent until the next
+ * dispatch, by opcode, along with choice point failures and the input they
+ * give back. Runtimes add their counts to a process-wide total when they are
+ * disposed, and the total is printed on stderr at exit.
+ */
+#define MININEZ_PROFILE_OPCODES 64
+
+/* Productions
+ * With mininez_profile_productions, Call and Ret also enter and leave the
+ * production at the call target (the one after its Nop marker). A production
+ * whose call frame is dropped when a choice point fails has failed.
+ * Exclusive cycles are kept per call path too, for folded stacks.
+ */
+typedef struct mininez_profile_production_t {
+  uint64_t calls;
+  uint64_t inclusive;   /* cycles, outermost activation only */
+  uint64_t exclusive;
+  uint64_t consumed;    /* bytes matched by successful calls */
+  uint64_t fails;
+  uint64_t backtracked; /* bytes read by failed calls */
+  uint32_t active;
+} mininez_profile_production_t;
+
+typedef struct mininez_profile_node_t {
+  uint32_t parent;
+  uint32_t prod;
+  uint32_t first;
+  uint32_t next;
+  uint64_t cycles;      /* exclusive */
+} mininez_profile_node_t;
+
+typedef struct mininez_profile_frame_t {
+  int64_t depth;        /* call stack size after the call */
+  uint32_t node;
+  uint32_t prod;
+  const unsigned char *pos;
+  uint64_t tick;
+} mininez_profile_frame_t;
+
+/* Memo Points
+ * Lookups by outcome and stores per memo point; a store that evicts a live
+ * entry of another key is a collision. The table itself is measured when a
+ * run exits: live slots and the trees its entries keep alive.
+ */
+typedef struct mininez_profile_memo_t {
+  uint64_t hits;
+  uint64_t fail_hits;
+  uint64_t misses;
+  uint64_t stores;
+  uint64_t collisions;
+} mininez_profile_memo_t;
+
+/* Backtracking Heatmap
+ * Every choice point that fails returns the VM to the position it saved;
+ * the heatmap counts those returns and the bytes read again from there, by
+ * input position and by the pc the VM resumes at (the alternative).
+ * Positions are bucketed, each input split evenly into heat_buckets.
+ */
+#define MININEZ_PROFILE_BUCKETS 1024
+#define MININEZ_PROFILE_TOP 20
+
+typedef struct mininez_profile_t {
+  uint64_t counts[MININEZ_PROFILE_OPCODES];
+  uint64_t cycles[MININEZ_PROFILE_OPCODES];
+  uint64_t runs;
+  uint64_t consumed;    /* bytes from entry to exit position */
+  uint64_t fails;       /* choice points popped on failure */
+  uint64_t backtracked; /* bytes given back by those */
+  uint64_t rewound;     /* bytes given back by lookaheads (Back) */
+  /* productions; prods is NULL unless enabled. The last one stands for
+   * code entered elsewhere than at a production. */
+  mininez_profile_production_t *prods;
+  char **prod_names;
+  uint16_t prod_size;
+  mininez_profile_node_t *nodes; /* node 0 is the root of all paths */
+  uint32_t node_size;
+  uint32_t node_capacity;
+  mininez_profile_frame_t *frames;
+  uint32_t frame_size;
+  uint32_t frame_capacity;
+  uint64_t last_tick;
+  const mininez_inst_t *code;
+  uint32_t *prod_of;    /* by code offset: production id + 1, or 0 */
+  /* memo points by uid, and the largest table measured */
+  mininez_profile_memo_t *memos;
+  uint32_t memo_size;
+  uint64_t memo_slots;
+  uint64_t memo_live;
+  uint64_t memo_trees;    /* live entries holding a tree */
+  uint64_t memo_retained; /* bytes of the distinct nodes they reach; 0 for other builders */
+  /* heatmap; heat_buckets is 0 unless enabled */
+  int heatmap;
+  uint64_t *heat_returns;
+  uint64_t *heat_bytes;
+  uint32_t heat_buckets;
+  uint64_t heat_length;   /* of the input being parsed */
+  uint64_t heat_inputs;   /* bytes of all inputs */
+  uint64_t *pc_returns;   /* by code offset */
+  uint64_t *pc_bytes;
+  uint32_t *pc_prod;      /* production id + 1 of the code at an offset */
+  uint64_t pc_size;
+  const mininez_inst_t *heat_code;
+} mininez_profile_t;
+
+/* rdtsc where there is one */
+static inline uint64_t mininez_profile_tick(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return (uint64_t)clock();
+#endif
+}
+
+mininez_profile_memo_t *mininez_profile_grow_memo(mininez_profile_t *p, uint16_t uid);
+
+static inline mininez_profile_memo_t *mininez_profile_memo(mininez_profile_t *p, uint16_t uid) {
+  return uid < p->memo_size ? &p->memos[uid] : mininez_profile_grow_memo(p, uid);
+}
+
+mininez_profile_t *mininez_profile_new(void);
+/* Adds p to the process total and frees it */
+void mininez_profile_merge(mininez_profile_t *p);
+void mininez_profile_print(const mininez_profile_t *p, FILE *fp);
+/* Measures the memo table of ctx; trees: whether it holds Trees (NEW) */
+void mininez_profile_memo_table(mininez_profile_t *p, ParserContext *ctx, int trees);
+
+/* Tracks productions in runtimes created from now on; at exit their table is
+ * printed and, if folded is not NULL, the folded stacks are written there
+ * (one "Prod;Prod;... cycles" line per call path, as flamegraph.pl reads) */
+void mininez_profile_productions(const char *folded);
+void mininez_profile_begin(mininez_profile_t *p, mininez_runtime_t *r, const mininez_inst_t *inst, uint64_t entry, const unsigned char *pos);
+void mininez_profile_enter(mininez_profile_t *p, uint64_t target, int64_t depth, const unsigned char *pos);
+/* Leaves every production whose call frame is above depth */
+void mininez_profile_leave(mininez_profile_t *p, int64_t depth, const unsigned char *pos, int failed);
+void mininez_profile_end(mininez_profile_t *p, const unsigned char *pos, int failed);
+void mininez_profile_print_productions(const mininez_profile_t *p, FILE *fp);
+int mininez_profile_write_folded(const mininez_profile_t *p, const char *path);
+
+/* Keeps a backtracking heatmap in runtimes created from now on, written to
+ * path at exit */
+void mininez_profile_heatmap(const char *path);
+void mininez_profile_heat_begin(mininez_profile_t *p, mininez_runtime_t *r, const mininez_inst_t *inst, size_t length);
+void mininez_profile_backtrack(mininez_profile_t *p, uint64_t pos, uint64_t rescanned, uint64_t pc);
+int mininez_profile_write_heatmap(const mininez_profile_t *p, const char *path);
+
+#endif
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "program.h"
+
+#define NO_INSN ((uint64_t)-1)
+
+static uint64_t program_index(uint64_t *index, uint64_t code_size, int64_t addr) {
+  if (addr < 0 || (uint64_t)addr >= code_size || index[addr] == NO_INSN) {
+    nez_PrintErrorInfo("program error: branch into the middle of an instruction");
+  }
+  return index[addr];
+}
+
+void mininez_program_decode(mininez_program_t *p, mininez_runtime_t *r, mininez_inst_t *inst) {
+  mininez_constant_t *C = r->C;
+  uint64_t code_size = mininez_code_size(r, inst);
+  uint64_t *index = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * code_size);
+  for (uint64_t i = 0; i < code_size; i++) {
+    index[i] = NO_INSN;
+  }
+  mininez_inst_t *pc = inst;
+  for (uint64_t i = 0; i < mininez_code_length(inst); i++) {
+    index[pc - inst] = i;
+    pc += opcode_length(*pc);
+  }
+
+  p->size = mininez_code_length(inst);
+  p->insns = (mininez_insn_t *) VM_MALLOC(sizeof(mininez_insn_t) * p->size);
+  memset(p->insns, 0, sizeof(mininez_insn_t) * p->size);
+  p->start = program_index(index, code_size, mininez_code_start(inst));
+  pc = inst;
+  for (uint64_t i = 0; i < p->size; i++) {
+    mininez_insn_t *insn = &p->insns[i];
+    int len = opcode_length(*pc);
+    int64_t next = (pc - inst) + len;
+    insn->opcode = *pc;
+    memcpy(insn->operand, pc + 1, len - 1);
+    switch (insn->opcode) {
+    case Jump:
+      insn->target = program_index(index, code_size, next + *(int16_t *)(pc + 1));
+      break;
+    case Call:
+      insn->target = program_index(index, code_size, next + *(int16_t *)(pc + 1));
+      insn->ret = program_index(index, code_size, *(uint16_t *)(pc + 3));
+      break;
+    case Alt:
+      insn->target = program_index(index, code_size, *(uint16_t *)(pc + 1));
+      break;
+    case Lookup: case TLookup:
+      insn->target = program_index(index, code_size, next + *(int16_t *)(pc + 3));
+      break;
+    case Dispatch: case DDispatch: {
+      uint16_t id = *(uint16_t *)(pc + 1);
+      insn->case_size = mininez_table_length(C->jump_indexs[id]);
+      insn->cases = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * insn->case_size);
+      for (uint16_t k = 0; k < insn->case_size; k++) {
+        /* the compiler emits signed offsets here, too */
+        insn->cases[k] = program_index(index, code_size, next + (int16_t)C->jump_tables[id][k]);
+      }
+      break;
+    }
+    }
+    pc += len;
+  }
+  VM_FREE(index);
+}
+
+static uint16_t program_absolute(uint64_t addr) {
+  if (addr > UINT16_MAX) {
+    nez_PrintErrorInfo("program error: address out of range");
+  }
+  return (uint16_t)addr;
+}
+
+static int16_t program_relative(uint64_t from, uint64_t to) {
+  int64_t offset = (int64_t)to - (int64_t)from;
+  if (offset < INT16_MIN || offset > INT16_MAX) {
+    nez_PrintErrorInfo("program error: jump out of range");
+  }
+  return (int16_t)offset;
+}
+
+mininez_inst_t *mininez_program_encode(mininez_program_t *p, mininez_runtime_t *r) {
+  mininez_constant_t *C = r->C;
+  /* a removed instruction takes the address of the next one kept */
+  uint64_t *addr = (uint64_t *) VM_MALLOC(sizeof(uint64_t) * (p->size + 1));
+  uint64_t size = 0;
+  uint64_t length = 0;
+  for (uint64_t i = 0; i < p->size; i++) {
+    addr[i] = size;
+    if (!p->insns[i].removed) {
+      size += opcode_length(p->insns[i].opcode);
+      length++;
+    }
+  }
+  addr[p->size] = size;
+
+  mininez_inst_t *code = mininez_alloc_code(sizeof(mininez_inst_t) * size, length, addr[p->start]);
+  mininez_inst_t *pc = code;
+  for (uint64_t i = 0; i < p->size; i++) {
+    mininez_insn_t *insn = &p->insns[i];
+    if (insn->removed) {
+      continue;
+    }
+    int len = opcode_length(insn->opcode);
+    uint64_t next = addr[i] + len;
+    pc[0] = insn->opcode;
+    memcpy(pc + 1, insn->operand, len - 1);
+    switch (insn->opcode) {
+    case Jump:
+      *(int16_t *)(pc + 1) = program_relative(next, addr[insn->target]);
+      break;
+    case Call:
+      *(int16_t *)(pc + 1) = program_relative(next, addr[insn->target]);
+      *(uint16_t *)(pc + 3) = program_absolute(addr[insn->ret]);
+      break;
+    case Alt:
+      *(uint16_t *)(pc + 1) = program_absolute(addr[insn->target]);
+      break;
+    case Lookup: case TLookup:
+      *(int16_t *)(pc + 3) = program_relative(next, addr[insn->target]);
+      break;
+    case Dispatch: case DDispatch: {
+      uint8_t *index = (uint8_t *) VM_MALLOC(sizeof(uint8_t) * 256);
+      uint16_t *table = (uint16_t *) VM_MALLOC(sizeof(uint16_t) * insn->case_size);
+      memcpy(index, C->jump_indexs[*(uint16_t *)insn->operand], 256);
+      for (uint16_t k = 0; k < insn->case_size; k++) {
+        table[k] = (uint16_t)program_relative(next, addr[insn->cases[k]]);
+      }
+      *(uint16_t *)(pc + 1) = mininez_add_table(C, index, table);
+      break;
+    }
+    }
+    pc += len;
+  }
+  VM_FREE(addr);
+  return code;
+}
+
+void mininez_program_dispose(mininez_program_t *p) {
+  for (uint64_t i = 0; i < p->size; i++) {
+    if (p->insns[i].cases != NULL) {
+      VM_FREE(p->insns[i].cases);
+    }
+  }
+  VM_FREE(p->insns);
+  p->insns = NULL;
+  p->size = 0;
+}
+
+int mininez_insn_ends_flow(uint8_t opcode) {
+  switch (opcode) {
+  case Jump: case Call: case Ret: case Exit: case Fail: case MemoFail:
+  case Dispatch: case DDispatch:
+    return 1;
+  }
+  return 0;
+}
+
+uint64_t mininez_program_prologue(mininez_program_t *p) {
+  uint64_t i = 0;
+  while (i < p->size && p->insns[i].opcode != Nop) {
+    i++;
+  }
+  return i;
+}
+
+int mininez_program_glued(mininez_program_t *p, uint64_t i) {
+  uint8_t prev = i > 0 ? p->insns[i - 1].opcode : Nop;
+  return (prev == TLookup && p->insns[i].opcode == Alt)
+      || (prev == Jump && i > 1 && p->insns[i - 2].opcode == Step && p->insns[i].opcode == Succ);
+}
+
+void mininez_program_replace(mininez_program_t *p, mininez_insn_t *insns, uint64_t size, const uint64_t *map) {
+  for (uint64_t i = 0; i < size; i++) {
+    mininez_insn_t *insn = &insns[i];
+    switch (insn->opcode) {
+    case Jump: case Alt: case Lookup: case TLookup:
+      insn->target = map[insn->target];
+      break;
+    case Call:
+      insn->target = map[insn->target];
+      insn->ret = map[insn->ret];
+      break;
+    case Dispatch: case DDispatch:
+      for (uint16_t k = 0; k < insn->case_size; k++) {
+        insn->cases[k] = map[insn->cases[k]];
+      }
+      break;
+    }
+  }
+  p->start = map[p->start];
+  VM_FREE(p->insns);
+  p->insns = insns;
+  p->size = size;
+}
+
+void mininez_insn_strip_tree(mininez_insn_t *insn) {
+  switch (insn->opcode) {
+  case TPush: case TPop: case TBegin: case TEnd:
+  case TTag: case TReplace: case TLink: case TFold:
+    insn->removed = 1;
+    break;
+  case TLookup:
+    insn->opcode = Lookup;
+    break;
+  case TMemo:
+    insn->opcode = Memo;
+    break;
+  }
+}
+
+mininez_inst_t *mininez_strip_tree(mininez_runtime_t *r, mininez_inst_t *inst) {
+  mininez_program_t p;
+  mininez_program_decode(&p, r, inst);
+  for (uint64_t i = 0; i < p.size; i++) {
+    mininez_insn_strip_tree(&p.insns[i]);
+  }
+  mininez_inst_t *code = mininez_program_encode(&p, r);
+  mininez_program_dispose(&p);
+  return code;
+}
@@ -0,0 +1,54 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include "nezvm.h"
+
+/* Decoded Program
+ * A loaded code block as a list of instructions whose branch operands are
+ * instruction indices instead of byte offsets, so that instructions can be
+ * removed or rewritten and the code encoded again.
+ */
+typedef struct mininez_insn_t {
+  uint8_t opcode;
+  uint8_t removed;
+  uint8_t operand[5];  /* operands as loaded */
+  uint64_t target;     /* Jump, Call, Alt, Lookup, TLookup */
+  uint64_t ret;        /* Call */
+  uint64_t *cases;     /* Dispatch, DDispatch: one target per table entry */
+  uint16_t case_size;
+} mininez_insn_t;
+
+typedef struct mininez_program_t {
+  mininez_insn_t *insns;
+  uint64_t size;
+  uint64_t start;
+} mininez_program_t;
+
+void mininez_program_decode(mininez_program_t *p, mininez_runtime_t *r, mininez_inst_t *inst);
+/* Encodes a new code block, which carries its own length and start point
+ * (mininez_code_length); rewritten dispatch tables are added to r->C. */
+mininez_inst_t *mininez_program_encode(mininez_program_t *p, mininez_runtime_t *r);
+void mininez_program_dispose(mininez_program_t *p);
+
+/* Instructions that never go on with the next one */
+int mininez_insn_ends_flow(uint8_t opcode);
+/* The Exit instructions before the first production are addressed by the
+ * initial frames (mininez_init_vm) and stay where they are */
+uint64_t mininez_program_prologue(mininez_program_t *p);
+/* Pairs the event stream rewrites by their adjacency (see stream_prepare):
+ * a memo lookup and its Alt, and a loop's Step, Jump and exit */
+int mininez_program_glued(mininez_program_t *p, uint64_t i);
+/* Replaces the instructions of p by insns, whose branch operands are still
+ * indices of the old program and are mapped by map; the cases arrays move
+ * with them */
+void mininez_program_replace(mininez_program_t *p, mininez_insn_t *insns, uint64_t size, const uint64_t *map);
+
+/* Recognition Program
+ * Returns a copy of inst without tree construction, to be run by
+ * mininez_recognize. The original code is left untouched.
+ */
+mininez_inst_t *mininez_strip_tree(mininez_runtime_t *r, mininez_inst_t *inst);
+/* Removes or lowers a single tree instruction the same way */
+void mininez_insn_strip_tree(mininez_insn_t *insn);
+
+#endif
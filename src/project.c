@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "program.h"
+#include "project.h"
+
+void mininez_projection_init(mininez_projection_t *p, mininez_constant_t *C, const char *spec) {
+  size_t len = strlen(spec);
+  uint32_t capacity = 1;
+  for (const char *s = spec; *s != 0; s++) {
+    capacity += *s == ',';
+  }
+  p->spec = (char *) VM_MALLOC(len + 1);
+  memcpy(p->spec, spec, len + 1);
+  p->entries = (mininez_projection_entry_t *) VM_MALLOC(sizeof(mininez_projection_entry_t) * capacity);
+  p->size = 0;
+  p->symbol_size = C->symbol_size;
+  p->flags = (uint8_t *) calloc(C->symbol_size, sizeof(uint8_t));
+
+  char *s = p->spec;
+  while (s != NULL) {
+    char *end = strchr(s, ',');
+    if (end != NULL) {
+      *end = 0;
+    }
+    if (*s != 0) {
+      mininez_projection_entry_t *e = &p->entries[p->size++];
+      char *label = strchr(s, '$');
+      e->label = 0;
+      e->text = NULL;
+      e->len = 0;
+      if (label != NULL) {
+        char *text = strchr(label, '=');
+        if (text == NULL) {
+          nez_PrintErrorInfo("projection error: expected Tag$label=text");
+        }
+        *label++ = 0;
+        *text++ = 0;
+        e->label = mininez_find_symbol(C, label);
+        if (e->label == 0) {
+          nez_PrintErrorInfo("projection error: unknown label");
+        }
+        e->text = text;
+        e->len = strlen(text);
+        p->flags[e->label] |= MININEZ_PROJECT_LABEL;
+      }
+      e->tag = mininez_find_symbol(C, *s == '#' ? s + 1 : s);
+      if (e->tag == 0) {
+        nez_PrintErrorInfo("projection error: unknown tag");
+      }
+      p->flags[e->tag] |= MININEZ_PROJECT_TAG;
+    }
+    s = end != NULL ? end + 1 : NULL;
+  }
+  if (p->size == 0) {
+    nez_PrintErrorInfo("projection error: empty projection");
+  }
+}
+
+void mininez_projection_dispose(mininez_projection_t *p) {
+  VM_FREE(p->entries);
+  VM_FREE(p->flags);
+  VM_FREE(p->spec);
+  p->entries = NULL;
+  p->flags = NULL;
+  p->spec = NULL;
+}
+
+/* Productions
+ * A production is the code reachable from a call target (or the start)
+ * without entering other calls. One that cannot produce a wanted node is
+ * stripped of tree construction when every call to it from code that keeps
+ * its trees has the form TPush; Call; TLink: the pair only links the node
+ * the callee builds, so it goes too. Anything else keeps its trees.
+ */
+typedef struct project_list_t {
+  uint64_t *items;
+  size_t size;
+  size_t capacity;
+} project_list_t;
+
+static void project_push(project_list_t *l, uint64_t v) {
+  if (l->size == l->capacity) {
+    l->capacity = l->capacity == 0 ? 16 : l->capacity * 2;
+    l->items = (uint64_t *) realloc(l->items, sizeof(uint64_t) * l->capacity);
+  }
+  l->items[l->size++] = v;
+}
+
+typedef struct project_region_t {
+  project_list_t insns;
+  int kept;
+} project_region_t;
+
+typedef struct project_graph_t {
+  mininez_program_t prog;
+  project_region_t *regions;
+  uint32_t size;
+  uint32_t *region_of; /* entry instruction -> region + 1 */
+} project_graph_t;
+
+static uint32_t project_region(project_graph_t *g, uint64_t entry) {
+  if (g->region_of[entry] == 0) {
+    g->region_of[entry] = ++g->size;
+  }
+  return g->region_of[entry] - 1;
+}
+
+static void project_walk(project_graph_t *g, uint32_t id, uint64_t entry, uint32_t *stamp, uint32_t *owners) {
+  mininez_insn_t *insns = g->prog.insns;
+  project_list_t stack = { NULL, 0, 0 };
+  project_push(&stack, entry);
+  while (stack.size > 0) {
+    uint64_t i = stack.items[--stack.size];
+    if (i >= g->prog.size || stamp[i] == id + 1) {
+      continue;
+    }
+    stamp[i] = id + 1;
+    owners[i]++;
+    project_push(&g->regions[id].insns, i);
+    switch (insns[i].opcode) {
+    case Ret: case Fail: case MemoFail: case Exit:
+      break;
+    case Jump:
+      project_push(&stack, insns[i].target);
+      break;
+    case Call:
+      project_push(&stack, insns[i].ret);
+      break;
+    case Alt: case Lookup: case TLookup:
+      project_push(&stack, i + 1);
+      project_push(&stack, insns[i].target);
+      break;
+    case Dispatch: case DDispatch:
+      for (uint16_t k = 0; k < insns[i].case_size; k++) {
+        project_push(&stack, insns[i].cases[k]);
+      }
+      break;
+    default:
+      project_push(&stack, i + 1);
+    }
+  }
+  VM_FREE(stack.items);
+}
+
+static int project_wanted(mininez_constant_t *C, mininez_insn_t *insn, const mininez_projection_t *p) {
+  uint16_t tag;
+  switch (insn->opcode) {
+  case TTag:
+    memcpy(&tag, insn->operand, sizeof(tag));
+    break;
+  case TEnd:
+    memcpy(&tag, insn->operand + 1, sizeof(tag));
+    break;
+  default:
+    return 0;
+  }
+  return mininez_projection_has(p, mininez_symbol_id(C->tags[tag]), MININEZ_PROJECT_TAG);
+}
+
+/* TPush; Call; TLink with a label no condition looks at */
+static int project_linked_only(mininez_constant_t *C, mininez_program_t *prog, uint64_t i, const mininez_projection_t *p) {
+  mininez_insn_t *insns = prog->insns;
+  uint16_t label;
+  if (i == 0 || i + 1 >= prog->size || insns[i - 1].opcode != TPush
+      || insns[i + 1].opcode != TLink || insns[i].ret != i + 1) {
+    return 0;
+  }
+  memcpy(&label, insns[i + 1].operand, sizeof(label));
+  return !mininez_projection_has(p, mininez_symbol_id(C->tags[label]), MININEZ_PROJECT_LABEL);
+}
+
+mininez_inst_t *mininez_project_program(mininez_runtime_t *r, mininez_inst_t *inst, const mininez_projection_t *p) {
+  mininez_constant_t *C = r->C;
+  project_graph_t g;
+  mininez_program_decode(&g.prog, r, inst);
+  mininez_insn_t *insns = g.prog.insns;
+  uint64_t size = g.prog.size;
+  g.size = 0;
+  g.region_of = (uint32_t *) calloc(size, sizeof(uint32_t));
+  project_region(&g, g.prog.start);
+  for (uint64_t i = 0; i < size; i++) {
+    if (insns[i].opcode == Call) {
+      project_region(&g, insns[i].target);
+    }
+  }
+  g.regions = (project_region_t *) calloc(g.size, sizeof(project_region_t));
+  uint32_t *stamp = (uint32_t *) calloc(size, sizeof(uint32_t));
+  uint32_t *owners = (uint32_t *) calloc(size, sizeof(uint32_t));
+  for (uint64_t i = 0; i < size; i++) {
+    if (g.region_of[i] != 0) {
+      project_walk(&g, g.region_of[i] - 1, i, stamp, owners);
+    }
+  }
+
+  /* shared code is never stripped for one caller only */
+  g.regions[g.region_of[g.prog.start] - 1].kept = 1;
+  for (uint32_t id = 0; id < g.size; id++) {
+    project_list_t *l = &g.regions[id].insns;
+    for (size_t k = 0; k < l->size; k++) {
+      if (owners[l->items[k]] > 1 || project_wanted(C, &insns[l->items[k]], p)) {
+        g.regions[id].kept = 1;
+      }
+    }
+  }
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (uint32_t id = 0; id < g.size; id++) {
+      project_list_t *l = &g.regions[id].insns;
+      for (size_t k = 0; k < l->size; k++) {
+        uint64_t i = l->items[k];
+        if (insns[i].opcode != Call) {
+          continue;
+        }
+        project_region_t *callee = &g.regions[g.region_of[insns[i].target] - 1];
+        if (!g.regions[id].kept && callee->kept) {
+          /* the caller links the wanted nodes of the callee */
+          g.regions[id].kept = 1;
+          changed = 1;
+        } else if (g.regions[id].kept && !callee->kept && !project_linked_only(C, &g.prog, i, p)) {
+          callee->kept = 1;
+          changed = 1;
+        }
+      }
+    }
+  }
+
+  for (uint32_t id = 0; id < g.size; id++) {
+    project_list_t *l = &g.regions[id].insns;
+    for (size_t k = 0; k < l->size; k++) {
+      uint64_t i = l->items[k];
+      if (!g.regions[id].kept) {
+        mininez_insn_strip_tree(&insns[i]);
+      } else if (insns[i].opcode == Call && !g.regions[g.region_of[insns[i].target] - 1].kept) {
+        insns[i - 1].removed = 1;
+        insns[i + 1].removed = 1;
+      }
+    }
+  }
+  mininez_inst_t *code = mininez_program_encode(&g.prog, r);
+
+  for (uint32_t id = 0; id < g.size; id++) {
+    VM_FREE(g.regions[id].insns.items);
+  }
+  VM_FREE(g.regions);
+  VM_FREE(g.region_of);
+  VM_FREE(stamp);
+  VM_FREE(owners);
+  mininez_program_dispose(&g.prog);
+  return code;
+}
+
+static int project_match(mininez_flat_tree_t *t, const mininez_projection_t *p, mininez_node_t n) {
+  for (uint32_t k = 0; k < p->size; k++) {
+    const mininez_projection_entry_t *e = &p->entries[k];
+    if (e->tag != t->tags[n]) {
+      continue;
+    }
+    if (e->label == 0) {
+      return 1;
+    }
+    for (mininez_node_t c = t->firsts[n]; c != 0; c = t->nexts[c]) {
+      size_t len;
+      const unsigned char *text = mininez_flat_text(t, c, &len);
+      if (t->labels[c] == e->label && len == e->len && memcmp(text, e->text, len) == 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+size_t mininez_project_write(mininez_writer_t *w, mininez_flat_tree_t *t, const mininez_projection_t *p) {
+  size_t count = 0;
+  /* compacted nodes are in preorder, i.e. document order */
+  for (mininez_node_t n = 1; n < t->size; n++) {
+    if (!mininez_projection_has(p, t->tags[n], MININEZ_PROJECT_TAG) || !project_match(t, p, n)) {
+      continue;
+    }
+    const char *tag = mininez_flat_tag(t, n);
+    size_t len;
+    const unsigned char *text = mininez_flat_text(t, n, &len);
+    char buf[32];
+    mininez_writer_write(w, "{\"tag\":", 7);
+    mininez_write_json_string(w, (const unsigned char *)tag, strlen(tag));
+    if ((t->lens[n] & MININEZ_FLAT_SYMBOL) == 0) {
+      int size = snprintf(buf, sizeof(buf), ",\"pos\":%u", t->starts[n]);
+      mininez_writer_write(w, buf, size);
+    }
+    mininez_writer_write(w, ",\"text\":", 8);
+    mininez_write_json_string(w, text, len);
+    mininez_writer_write(w, "}\n", 2);
+    count++;
+  }
+  return count;
+}
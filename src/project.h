@@ -0,0 +1,47 @@
+#ifndef PROJECT_H
+#define PROJECT_H
+
+#include "nezvm.h"
+#include "output.h"
+#include "flat.h"
+
+/* Projection
+ * A spec lists the nodes that are wanted, as comma separated entries:
+ *   Tag              every node tagged #Tag
+ *   Tag$label=text   only those whose child $label has exactly this text
+ * e.g. "KeyValue$key=id,Element". Productions that cannot produce a wanted
+ * node run without tree construction (mininez_project_program), and the
+ * flat tree built with the projection drops the leaves nothing asks for.
+ */
+typedef struct mininez_projection_entry_t {
+  uint32_t tag;
+  uint32_t label;     /* 0: no condition */
+  const char *text;
+  size_t len;
+} mininez_projection_entry_t;
+
+#define MININEZ_PROJECT_TAG   1 /* a wanted tag */
+#define MININEZ_PROJECT_LABEL 2 /* the label of a condition */
+
+typedef struct mininez_projection_t {
+  mininez_projection_entry_t *entries;
+  uint32_t size;
+  uint8_t *flags;     /* by symbol id */
+  uint32_t symbol_size;
+  char *spec;
+} mininez_projection_t;
+
+void mininez_projection_init(mininez_projection_t *p, mininez_constant_t *C, const char *spec);
+void mininez_projection_dispose(mininez_projection_t *p);
+
+static inline int mininez_projection_has(const mininez_projection_t *p, uint32_t id, int flag) {
+  return id < p->symbol_size && (p->flags[id] & flag) != 0;
+}
+
+/* A copy of inst that builds only the trees p can reach */
+mininez_inst_t *mininez_project_program(mininez_runtime_t *r, mininez_inst_t *inst, const mininez_projection_t *p);
+/* Writes the matching nodes of a projected flat tree, one JSON object per
+ * line in document order; returns their number */
+size_t mininez_project_write(mininez_writer_t *w, mininez_flat_tree_t *t, const mininez_projection_t *p);
+
+#endif
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "nezvm.h"
+#include "sample.h"
+
+#define SAMPLE_NONE UINT32_MAX
+
+typedef struct sample_node_t {
+  uint32_t parent;
+  uint32_t prod;
+  uint32_t first;
+  uint32_t next;
+  uint64_t samples; /* with this node as leaf */
+} sample_node_t;
+
+/* Written by the handler only while it holds sample_busy */
+static sample_node_t *sample_nodes;
+static uint32_t sample_node_size;
+static char **sample_names; /* by production id, then "(unknown)" and "(truncated)" */
+static uint16_t sample_prod_size;
+static uint64_t sample_count;
+static uint64_t sample_outside; /* ticks with no VM running on the thread */
+static uint64_t sample_dropped; /* contended, or out of nodes */
+static volatile int sample_busy;
+static unsigned sample_hz;
+static struct sigaction sample_saved;
+
+/* The child of node n for production prod, added if there is room */
+static uint32_t sample_child(uint32_t n, uint32_t prod) {
+  uint32_t c;
+  for (c = sample_nodes[n].first; c != 0; c = sample_nodes[c].next) {
+    if (sample_nodes[c].prod == prod) {
+      return c;
+    }
+  }
+  if (sample_node_size == MININEZ_SAMPLE_NODES) {
+    return SAMPLE_NONE;
+  }
+  c = sample_node_size++;
+  sample_nodes[c].parent = n;
+  sample_nodes[c].prod = prod;
+  sample_nodes[c].first = 0;
+  sample_nodes[c].next = sample_nodes[n].first;
+  sample_nodes[c].samples = 0;
+  sample_nodes[n].first = c;
+  return c;
+}
+
+/* Call frames carry MININEZ_CALL_FRAME in value and the production called
+ * in num; everything else on the stack is skipped */
+static void sample_record(ParserContext *ctx) {
+  uint32_t path[MININEZ_SAMPLE_DEPTH];
+  uint32_t depth = 0;
+  uint32_t n = 0;
+  Wstack *stacks = ctx->stacks;
+  for (size_t i = ctx->unused_stack; i > 0; i--) {
+    if ((stacks[i].value & MININEZ_CALL_FRAME) == 0) {
+      continue;
+    }
+    if (depth == MININEZ_SAMPLE_DEPTH) {
+      n = sample_child(0, sample_prod_size + 1);
+      break;
+    }
+    path[depth++] = stacks[i].num < sample_prod_size ? (uint32_t)stacks[i].num : sample_prod_size;
+  }
+  while (depth > 0 && n != SAMPLE_NONE) {
+    n = sample_child(n, path[--depth]);
+  }
+  if (n == SAMPLE_NONE || n == 0) {
+    sample_dropped++;
+    return;
+  }
+  sample_nodes[n].samples++;
+  sample_count++;
+}
+
+static void sample_tick(int sig) {
+  int saved = errno;
+  mininez_runtime_t *r = mininez_running;
+  (void)sig;
+  if (r == NULL) {
+    __sync_fetch_and_add(&sample_outside, 1);
+  } else if (__sync_lock_test_and_set(&sample_busy, 1)) {
+    __sync_fetch_and_add(&sample_dropped, 1);
+  } else {
+    sample_record(r->ctx);
+    __sync_lock_release(&sample_busy);
+  }
+  errno = saved;
+}
+
+static int sample_timer(unsigned hz) {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  if (hz != 0) {
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+  }
+  return setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+int mininez_sample_start(mininez_constant_t *C, unsigned hz) {
+  struct sigaction action;
+  mininez_sample_dispose();
+  sample_prod_size = C->prod_size;
+  sample_names = (char **) VM_MALLOC(sizeof(char *) * (C->prod_size + 2));
+  for (uint16_t i = 0; i < C->prod_size; i++) {
+    const char *dot = strrchr(C->prod_names[i], '.');
+    sample_names[i] = strdup(dot != NULL ? dot + 1 : C->prod_names[i]);
+  }
+  sample_names[C->prod_size] = strdup("(unknown)");
+  sample_names[C->prod_size + 1] = strdup("(truncated)");
+  sample_nodes = (sample_node_t *) calloc(MININEZ_SAMPLE_NODES, sizeof(sample_node_t));
+  sample_nodes[0].parent = SAMPLE_NONE;
+  sample_nodes[0].prod = SAMPLE_NONE;
+  sample_node_size = 1;
+  sample_count = sample_outside = sample_dropped = 0;
+  sample_hz = hz == 0 ? MININEZ_SAMPLE_DEFAULT_HZ : hz;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = sample_tick;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &sample_saved) != 0) {
+    return -1;
+  }
+  if (sample_timer(sample_hz) != 0) {
+    sigaction(SIGPROF, &sample_saved, NULL);
+    return -1;
+  }
+  return 0;
+}
+
+void mininez_sample_stop(void) {
+  sample_timer(0);
+  sigaction(SIGPROF, &sample_saved, NULL);
+}
+
+void mininez_sample_dispose(void) {
+  if (sample_names != NULL) {
+    for (uint32_t i = 0; i < (uint32_t)sample_prod_size + 2; i++) {
+      VM_FREE(sample_names[i]);
+    }
+    VM_FREE(sample_names);
+    sample_names = NULL;
+  }
+  VM_FREE(sample_nodes);
+  sample_nodes = NULL;
+  sample_node_size = 0;
+}
+
+static const uint64_t *sample_self;
+
+/* by self samples */
+static int sample_compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  if (sample_self[x] != sample_self[y]) {
+    return sample_self[x] < sample_self[y] ? 1 : -1;
+  }
+  return x < y ? -1 : 1;
+}
+
+void mininez_sample_report(FILE *fp) {
+  uint32_t names = (uint32_t)sample_prod_size + 2;
+  uint64_t *self = (uint64_t *) calloc(names, sizeof(uint64_t));
+  uint64_t *total = (uint64_t *) calloc(names, sizeof(uint64_t));
+  uint32_t *seen = (uint32_t *) calloc(names, sizeof(uint32_t));
+  uint32_t *order = (uint32_t *) VM_MALLOC(sizeof(uint32_t) * names);
+  uint32_t size = 0;
+  for (uint32_t n = 1; n < sample_node_size; n++) {
+    if (sample_nodes[n].samples == 0) {
+      continue;
+    }
+    self[sample_nodes[n].prod] += sample_nodes[n].samples;
+    /* a production recursing on the stack counts once */
+    for (uint32_t a = n; a != 0; a = sample_nodes[a].parent) {
+      uint32_t prod = sample_nodes[a].prod;
+      if (seen[prod] != n) {
+        seen[prod] = n;
+        total[prod] += sample_nodes[n].samples;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < names; i++) {
+    if (total[i] != 0) {
+      order[size++] = i;
+    }
+  }
+  sample_self = self;
+  qsort(order, size, sizeof(uint32_t), sample_compare);
+  fprintf(fp, "\n========= Samples =========\n");
+  fprintf(fp, "Samples: %llu at %u Hz (outside the VM: %llu, dropped: %llu)\n",
+          (unsigned long long)sample_count, sample_hz,
+          (unsigned long long)sample_outside, (unsigned long long)sample_dropped);
+  fprintf(fp, "%-20s %10s %8s %10s %8s\n", "production", "self", "self%", "total", "total%");
+  for (uint32_t k = 0; k < size; k++) {
+    uint32_t i = order[k];
+    fprintf(fp, "%-20s %10llu %7.2f%% %10llu %7.2f%%\n", sample_names[i],
+            (unsigned long long)self[i], sample_count == 0 ? 0.0 : 100.0 * self[i] / sample_count,
+            (unsigned long long)total[i], sample_count == 0 ? 0.0 : 100.0 * total[i] / sample_count);
+  }
+  VM_FREE(self);
+  VM_FREE(total);
+  VM_FREE(seen);
+  VM_FREE(order);
+}
+
+static void sample_write_path(uint32_t n, FILE *fp) {
+  if (sample_nodes[n].parent != 0) {
+    sample_write_path(sample_nodes[n].parent, fp);
+    fputc(';', fp);
+  }
+  fputs(sample_names[sample_nodes[n].prod], fp);
+}
+
+int mininez_sample_write_folded(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  for (uint32_t n = 1; n < sample_node_size; n++) {
+    if (sample_nodes[n].samples != 0) {
+      sample_write_path(n, fp);
+      fprintf(fp, " %llu\n", (unsigned long long)sample_nodes[n].samples);
+    }
+  }
+  return fclose(fp);
+}
@@ -0,0 +1,29 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stdio.h>
+#include "nezvm.h"
+
+/* Sampling Profiler
+ * A SIGPROF interval timer (setitimer ITIMER_PROF, process CPU time) stops
+ * whichever thread runs; when that thread is inside the VM, the production
+ * stack is read off its call frames (each holds the production it called,
+ * see PUSH_CALL) and counted. The VM does no extra work per instruction, so
+ * this fits production runs; samples only land at the timer resolution of
+ * the kernel. One sampler per process.
+ */
+#define MININEZ_SAMPLE_DEFAULT_HZ 997
+#define MININEZ_SAMPLE_DEPTH 128   /* deeper stacks keep their leaf end */
+#define MININEZ_SAMPLE_NODES 65536 /* distinct stacks; more are dropped */
+
+/* Names the productions of C (shared by the runtimes sampled) and starts the
+ * timer; returns -1 if the timer cannot be set */
+int mininez_sample_start(mininez_constant_t *C, unsigned hz);
+void mininez_sample_stop(void);
+/* Samples by production, self and total, on fp */
+void mininez_sample_report(FILE *fp);
+/* One "Prod;Prod;... samples" line per stack, as flamegraph.pl reads */
+int mininez_sample_write_folded(const char *path);
+void mininez_sample_dispose(void);
+
+#endif
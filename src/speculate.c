@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "loader.h"
+#include "speculate.h"
+
+typedef struct mininez_speculation_entry_t {
+  size_t start;
+  size_t end;
+  Tree *tree;
+} mininez_speculation_entry_t;
+
+typedef struct mininez_speculation_chunk_t {
+  size_t start;
+  size_t end;
+  int aligned;
+  mininez_speculation_entry_t *entries;
+  size_t size;
+  size_t capacity;
+} mininez_speculation_chunk_t;
+
+typedef struct mininez_speculation_t {
+  mininez_runtime_t *r;
+  mininez_inst_t *inst;
+  uint64_t entry;
+  const char *delims;
+  mininez_speculation_chunk_t *chunks;
+  size_t chunk_size;
+  size_t next_chunk;
+  /* the merged, position-ordered view used by the splice trap */
+  mininez_speculation_entry_t *entries;
+  size_t size;
+  size_t cursor;
+  size_t spliced;
+  /* one deadline for the workers and the stitch; the first limit hit
+   * stops every worker */
+  uint64_t deadline_ns;
+  volatile int limit_hit;
+  uint64_t steps;
+} mininez_speculation_t;
+
+static int spec_is_gap(mininez_speculation_t *s, unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || (c != 0 && strchr(s->delims, c) != NULL);
+}
+
+/* the next candidate boundary at or after pos */
+static size_t spec_scan(mininez_speculation_t *s, const unsigned char *text, size_t len, size_t pos) {
+  while (pos < len && (text[pos] == 0 || strchr(s->delims, text[pos]) == NULL)) {
+    pos++;
+  }
+  while (pos < len && spec_is_gap(s, text[pos])) {
+    pos++;
+  }
+  return pos;
+}
+
+static void spec_add(mininez_speculation_chunk_t *c, size_t start, size_t end, Tree *tree) {
+  if (c->size == c->capacity) {
+    c->capacity = c->capacity == 0 ? 256 : c->capacity * 2;
+    c->entries = (mininez_speculation_entry_t *) realloc(c->entries, sizeof(mininez_speculation_entry_t) * c->capacity);
+  }
+  c->entries[c->size].start = start;
+  c->entries[c->size].end = end;
+  c->entries[c->size].tree = tree;
+  c->size++;
+}
+
+/* Parse the production at pos in isolation; returns the end position or -1 */
+static long spec_parse_one(mininez_speculation_t *s, mininez_runtime_t *w, size_t pos, Tree **tree) {
+  ParserContext *ctx = w->ctx;
+  size_t log = ParserContext_saveLog(ctx);
+  ctx->unused_stack = 0;
+  ctx->fail_stack = 0;
+  ctx->pos = ctx->inputs + pos;
+  GCDEC(ctx, ctx->left);
+  ctx->left = NULL;
+  mininez_init_vm(ctx);
+  if (mininez_parse_from(w, s->inst, s->entry) != 1) {
+    return -1;
+  }
+  /* a production that leaves tree logs behind depends on its caller */
+  if (ParserContext_saveLog(ctx) != log || ctx->left == NULL) {
+    ParserContext_backLog(ctx, log);
+    return -1;
+  }
+  *tree = ctx->left;
+  GCINC(ctx, *tree);
+  return (long)(ctx->pos - ctx->inputs);
+}
+
+static void spec_run_chunk(mininez_speculation_t *s, mininez_runtime_t *w, mininez_speculation_chunk_t *c) {
+  const unsigned char *text = w->ctx->inputs;
+  size_t len = w->ctx->length;
+  size_t pos = c->start;
+  while (pos < c->end && w->limit_hit == 0 && s->limit_hit == 0) {
+    Tree *tree = NULL;
+    long end = spec_parse_one(s, w, pos, &tree);
+    if (end < 0 || (size_t)end == pos) {
+      /* not an element start after all; resynchronise on the next boundary */
+      pos = spec_scan(s, text, len, pos + 1);
+      continue;
+    }
+    spec_add(c, pos, (size_t)end, tree);
+    pos = (size_t)end;
+    while (pos < len && spec_is_gap(s, text[pos])) {
+      pos++;
+    }
+  }
+  c->aligned = pos == c->end;
+}
+
+static void *spec_worker(void *arg) {
+  mininez_speculation_t *s = (mininez_speculation_t *)arg;
+  ParserContext *ctx = s->r->ctx;
+  mininez_runtime_t *w = mininez_fork_runtime(s->r, ctx->inputs, ctx->length);
+  size_t i;
+  /* the steps of a worker count over all the elements it parses */
+  mininez_limit_hold(w, s->deadline_ns);
+  while (w->limit_hit == 0 && (i = __sync_fetch_and_add(&s->next_chunk, 1)) < s->chunk_size) {
+    spec_run_chunk(s, w, &s->chunks[i]);
+  }
+  if (w->limit_hit != 0 && __sync_bool_compare_and_swap(&s->limit_hit, 0, w->limit_hit)) {
+    s->steps = w->steps;
+  }
+  mininez_dispose_runtime(w);
+  return NULL;
+}
+
+static mininez_speculation_entry_t *spec_lookup(mininez_speculation_t *s, size_t pos) {
+  size_t lo = 0, hi = s->size;
+  if (s->cursor < s->size && s->entries[s->cursor].start == pos) {
+    return &s->entries[s->cursor++];
+  }
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (s->entries[mid].start < pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < s->size && s->entries[lo].start == pos) {
+    s->cursor = lo + 1;
+    return &s->entries[lo];
+  }
+  return NULL;
+}
+
+/* Trap placed at the production entry: take the worker result if there is one */
+static int spec_splice(mininez_runtime_t *r, uint16_t id) {
+  mininez_speculation_t *s = (mininez_speculation_t *)r->trap_data;
+  ParserContext *ctx = r->ctx;
+  mininez_speculation_entry_t *e = spec_lookup(s, ctx->pos - ctx->inputs);
+  if (e == NULL) {
+    return 0;
+  }
+  GCSET(ctx, ctx->left, e->tree);
+  ctx->left = e->tree;
+  ctx->pos = ctx->inputs + e->end;
+  s->spliced++;
+  return 1;
+}
+
+/* A copy of the program whose calls to the production go through a Trap */
+static mininez_inst_t *spec_patch(mininez_runtime_t *r, mininez_inst_t *inst, uint64_t entry) {
+  uint64_t trap = entry - opcode_length(Nop);
+  mininez_inst_t *code = mininez_copy_code(r, inst);
+  mininez_inst_t *pc = code;
+  for (uint64_t i = 0; i < mininez_code_length(code); i++) {
+    if (*pc == Call) {
+      uint64_t next = (pc - code) + opcode_length(Call);
+      if (next + *(int16_t *)(pc + 1) == entry) {
+        *(int16_t *)(pc + 1) = (int16_t)(trap - next);
+      }
+    }
+    pc += opcode_length(*pc);
+  }
+  code[trap] = Trap;
+  *(uint16_t *)(code + trap + 1) = 0;
+  return code;
+}
+
+int mininez_speculate(mininez_runtime_t *r, mininez_inst_t *inst,
+                      const char *production, const char *delims, int nthreads,
+                      mininez_speculation_result_t *result) {
+  mininez_speculation_t s;
+  ParserContext *ctx = r->ctx;
+  int64_t entry = mininez_find_production(r, inst, production);
+  if (entry < 0) {
+    nez_PrintErrorInfo("speculation error: unknown production");
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  s.r = r;
+  s.inst = inst;
+  s.entry = (uint64_t)entry;
+  s.delims = delims;
+  s.chunk_size = (size_t)nthreads * 4;
+  s.next_chunk = 0;
+  s.chunks = (mininez_speculation_chunk_t *) VM_MALLOC(sizeof(mininez_speculation_chunk_t) * s.chunk_size);
+  s.deadline_ns = r->timeout_ns != 0 ? mininez_now_ns() + r->timeout_ns : 0;
+  s.limit_hit = 0;
+  s.steps = 0;
+
+  /* pre-scan: candidate boundaries after evenly spaced split points */
+  size_t prev = 0;
+  for (size_t i = 0; i < s.chunk_size; i++) {
+    size_t split = ctx->length / s.chunk_size * i;
+    size_t start = spec_scan(&s, ctx->inputs, ctx->length, split);
+    s.chunks[i].start = start < prev ? prev : start;
+    s.chunks[i].entries = NULL;
+    s.chunks[i].size = 0;
+    s.chunks[i].capacity = 0;
+    s.chunks[i].aligned = 0;
+    prev = s.chunks[i].start;
+  }
+  for (size_t i = 0; i < s.chunk_size; i++) {
+    s.chunks[i].end = i + 1 < s.chunk_size ? s.chunks[i + 1].start : ctx->length;
+  }
+
+  pthread_t *threads = (pthread_t *) VM_MALLOC(sizeof(pthread_t) * nthreads);
+  for (int i = 1; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, spec_worker, &s);
+  }
+  spec_worker(&s);
+  for (int i = 1; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  VM_FREE(threads);
+
+  memset(result, 0, sizeof(*result));
+  result->chunks = s.chunk_size;
+  s.size = 0;
+  for (size_t i = 0; i < s.chunk_size; i++) {
+    s.size += s.chunks[i].size;
+    result->aligned += s.chunks[i].aligned;
+  }
+  s.entries = (mininez_speculation_entry_t *) VM_MALLOC(sizeof(mininez_speculation_entry_t) * (s.size + 1));
+  s.size = 0;
+  for (size_t i = 0; i < s.chunk_size; i++) {
+    memcpy(s.entries + s.size, s.chunks[i].entries, sizeof(mininez_speculation_entry_t) * s.chunks[i].size);
+    s.size += s.chunks[i].size;
+    free(s.chunks[i].entries);
+  }
+  VM_FREE(s.chunks);
+  s.cursor = 0;
+  s.spliced = 0;
+
+  /* stitch: a sequential parse that splices in the worker subtrees */
+  int parsed = MININEZ_ABORTED;
+  if (s.limit_hit != 0) {
+    r->limit_hit = s.limit_hit;
+    r->steps = s.steps;
+  } else {
+    mininez_inst_t *code = spec_patch(r, inst, s.entry);
+    r->trap = spec_splice;
+    r->trap_data = &s;
+    ctx->pos = ctx->inputs;
+    ctx->unused_stack = 0;
+    mininez_init_vm(ctx);
+    mininez_limit_hold(r, s.deadline_ns);
+    parsed = mininez_parse(r, code);
+    mininez_limit_release(r);
+    r->trap = NULL;
+    r->trap_data = NULL;
+    mininez_dispose_instructions(code);
+  }
+
+  for (size_t i = 0; i < s.size; i++) {
+    GCDEC(ctx, s.entries[i].tree);
+  }
+  VM_FREE(s.entries);
+  result->elements = s.size;
+  result->spliced = s.spliced;
+  return parsed;
+}
+
+void mininez_speculation_report(mininez_speculation_result_t *result, FILE *fp) {
+  fprintf(fp, "Speculation: chunks %zu (aligned %zu), elements %zu, spliced %zu\n",
+          result->chunks, result->aligned, result->elements, result->spliced);
+}
@@ -0,0 +1,30 @@
+#ifndef SPECULATE_H
+#define SPECULATE_H
+
+#include <stdio.h>
+#include "nezvm.h"
+
+typedef struct mininez_speculation_result_t {
+  size_t chunks;
+  size_t aligned;  /* chunks whose element chain ended on the next boundary */
+  size_t elements; /* subtrees parsed speculatively by the workers */
+  size_t spliced;  /* subtrees reused by the sequential pass */
+} mininez_speculation_result_t;
+
+/* Speculative Parallel Parsing
+ * The input is cut into chunks at candidate boundaries: the first byte of
+ * delims after a split point, followed by any run of delims and white space.
+ * Workers parse the repeated production from each boundary onwards, and
+ * the main thread then runs the whole grammar, splicing in every worker
+ * subtree whose start position it reaches. Anything that does not line up
+ * is parsed sequentially as usual.
+ * The limits of r (mininez_set_limits) bound the whole of it: workers and
+ * the sequential pass share one deadline, and a worker counts its steps
+ * over every element it parses. A limit hit returns MININEZ_ABORTED.
+ */
+int mininez_speculate(mininez_runtime_t *r, mininez_inst_t *inst,
+                      const char *production, const char *delims, int nthreads,
+                      mininez_speculation_result_t *result);
+void mininez_speculation_report(mininez_speculation_result_t *result, FILE *fp);
+
+#endif
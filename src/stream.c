@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nezvm.h"
+#include "instruction.h"
+#include "loader.h"
+#include "stream.h"
+
+/* log entry of a node whose BEGIN has been emitted; tree counts its children */
+#define OpBegun 4
+
+/* stands in for a node that has already been emitted */
+static Tree streamed_tree;
+#define STREAMED (&streamed_tree)
+
+static void stream_gc(void *parent, int c, void *thunk) {
+  if (parent != STREAMED) {
+    GC(parent, c, thunk);
+  }
+}
+
+static void stream_emit(mininez_stream_t *s, mininez_event_type_t type, const char *name,
+                        const unsigned char *text, size_t len) {
+  mininez_event_t e;
+  e.type = type;
+  e.name = name;
+  e.text = text;
+  e.len = len;
+  s->events++;
+  s->callback(&e, s->data);
+}
+
+static void stream_tree(mininez_stream_t *s, Tree *t) {
+  if (t == NULL || t == STREAMED) {
+    return;
+  }
+  stream_emit(s, MININEZ_EVENT_BEGIN, NULL, NULL, 0);
+  for (size_t i = 0; i < t->size; i++) {
+    stream_tree(s, t->childs[i]);
+    if (t->labels[i] != NULL) {
+      stream_emit(s, MININEZ_EVENT_LABEL, t->labels[i], NULL, 0);
+    }
+  }
+  if (t->tag != NULL) {
+    stream_emit(s, MININEZ_EVENT_TAG, t->tag, NULL, 0);
+  }
+  if (t->size == 0) {
+    stream_emit(s, MININEZ_EVENT_TEXT, NULL, t->text, t->len);
+  }
+  stream_emit(s, MININEZ_EVENT_END, NULL, NULL, 0);
+}
+
+static void stream_link(mininez_stream_t *s, TreeLog *l) {
+  stream_tree(s, l->tree);
+  if (l->value != NULL) {
+    stream_emit(s, MININEZ_EVENT_LABEL, (const char *)l->value, NULL, 0);
+  }
+}
+
+/* Oldest log index a live choice point can still roll back to.
+ * A loop frame whose exit is a Succ pops the frame below it without ever
+ * backtracking into it, so that frame no longer holds anything back. */
+static size_t stream_frontier(mininez_stream_t *s, ParserContext *ctx) {
+  size_t frontier = ctx->unused_log;
+  size_t f = ctx->fail_stack;
+  int shadowed = 0;
+  while (f != 0) {
+    if (!shadowed) {
+      frontier = ctx->stacks[f + 2].value;
+    }
+    shadowed = s->loop_exit[ctx->stacks[f + 1].num];
+    f = ctx->stacks[f].value;
+  }
+  return frontier;
+}
+
+/* Emit every committed child and drop it from the tree log */
+void mininez_stream_flush(mininez_runtime_t *r) {
+  mininez_stream_t *s = r->stream;
+  ParserContext *ctx = r->ctx;
+  if (!s->eager || ctx->unused_log <= s->pending) {
+    return;
+  }
+  size_t saved = ctx->fail_stack == 0 ? 0 : ctx->stacks[ctx->fail_stack + 2].value;
+  if (ctx->unused_log == s->last_log && ctx->fail_stack == s->last_fail && saved == s->last_saved) {
+    return;
+  }
+  s->last_log = ctx->unused_log;
+  s->last_fail = ctx->fail_stack;
+  s->last_saved = saved;
+
+  size_t frontier = stream_frontier(s, ctx);
+  if (frontier <= s->pending) {
+    return;
+  }
+  size_t w = s->pending;
+  long parent = -1;
+  for (size_t i = 0; i < s->pending; i++) {
+    if (ctx->logs[i].op == OpBegun) {
+      parent = i;
+    }
+  }
+  for (size_t i = s->pending; i < frontier; i++) {
+    TreeLog *l = ctx->logs + i;
+    if (l->op == OpNew) {
+      stream_emit(s, MININEZ_EVENT_BEGIN, NULL, NULL, 0);
+      l->op = OpBegun;
+      l->tree = NULL;
+    }
+    if (l->op == OpLink && parent >= 0) {
+      stream_link(s, l);
+      ctx->logs[parent].tree = (Tree *)((size_t)ctx->logs[parent].tree + 1);
+      GCDEC(ctx, l->tree);
+      l->op = 0;
+      l->value = NULL;
+      l->tree = NULL;
+      continue;
+    }
+    if (l->op == OpBegun) {
+      parent = w;
+    }
+    if (w != i) {
+      ctx->logs[w] = *l;
+      l->op = 0;
+      l->value = NULL;
+      l->tree = NULL;
+    }
+    w++;
+  }
+  size_t removed = frontier - w;
+  if (removed > 0) {
+    memmove(ctx->logs + w, ctx->logs + frontier, sizeof(TreeLog) * (ctx->unused_log - frontier));
+    for (size_t i = ctx->unused_log - removed; i < ctx->unused_log; i++) {
+      ctx->logs[i].op = 0;
+      ctx->logs[i].value = NULL;
+      ctx->logs[i].tree = NULL;
+    }
+    ctx->unused_log -= removed;
+    /* choice points behind the frontier are never restored, so clamp them */
+    for (size_t f = ctx->fail_stack; f != 0; f = ctx->stacks[f].value) {
+      size_t *log = &ctx->stacks[f + 2].value;
+      *log = *log >= frontier ? *log - removed : (*log > w ? w : *log);
+    }
+    s->last_log = ctx->unused_log;
+    s->last_saved = ctx->fail_stack == 0 ? 0 : ctx->stacks[ctx->fail_stack + 2].value;
+  }
+  s->pending = w;
+}
+
+/* TEnd of a node that has already begun: finish it with events */
+int mininez_stream_end(mininez_runtime_t *r, int shift, symbol_t tag, const char *text, size_t len) {
+  mininez_stream_t *s = r->stream;
+  ParserContext *ctx = r->ctx;
+  long i;
+  if (!s->eager) {
+    return 0;
+  }
+  for (i = (long)ctx->unused_log - 1; i >= 0; i--) {
+    if (ctx->logs[i].op == OpNew || ctx->logs[i].op == OpBegun) {
+      break;
+    }
+  }
+  if (i < 0 || ctx->logs[i].op != OpBegun) {
+    return 0;
+  }
+  size_t children = (size_t)ctx->logs[i].tree;
+  symbol_t logged_tag = NULL;
+  const char *logged_text = NULL;
+  size_t logged_len = 0;
+  for (size_t j = i + 1; j < ctx->unused_log; j++) {
+    TreeLog *l = ctx->logs + j;
+    if (l->op == OpLink) {
+      stream_link(s, l);
+      children++;
+    } else if (l->op == OpTag) {
+      logged_tag = (symbol_t)l->value;
+    } else if (l->op == OpReplace) {
+      logged_text = (const char *)l->value;
+      logged_len = (size_t)l->tree;
+    }
+  }
+  if (tag == NULL) {
+    tag = logged_tag;
+  }
+  if (tag != NULL) {
+    stream_emit(s, MININEZ_EVENT_TAG, tag, NULL, 0);
+  }
+  if (children == 0) {
+    if (text == NULL && logged_text != NULL) {
+      text = logged_text;
+      len = logged_len;
+    } else if (text == NULL) {
+      const unsigned char *begin = (const unsigned char *)ctx->logs[i].value;
+      text = (const char *)begin;
+      len = (ctx->pos + shift) - begin;
+    }
+    stream_emit(s, MININEZ_EVENT_TEXT, NULL, (const unsigned char *)text, len);
+  }
+  stream_emit(s, MININEZ_EVENT_END, NULL, NULL, 0);
+  ctx->logs[i].tree = NULL;
+  ParserContext_backLog(ctx, i);
+  GCSET(ctx, ctx->left, STREAMED);
+  ctx->left = STREAMED;
+  if (s->pending > (size_t)i) {
+    s->pending = i;
+  }
+  s->last_log = (size_t)-1;
+  return 1;
+}
+
+void mininez_stream_init(mininez_stream_t *s, mininez_event_f callback, void *data) {
+  s->callback = callback;
+  s->data = data;
+  s->events = 0;
+  s->eager = 1;
+  s->loop_exit = NULL;
+  s->pending = 0;
+  s->last_log = (size_t)-1;
+  s->last_fail = 0;
+  s->last_saved = 0;
+}
+
+/* A copy of the program without tree memoization (memo entries would
+ * hand out subtrees that have already been emitted) */
+static mininez_inst_t *stream_prepare(mininez_runtime_t *r, mininez_inst_t *inst, mininez_stream_t *s) {
+  uint64_t size = mininez_code_size(r, inst);
+  mininez_inst_t *code = mininez_copy_code(r, inst);
+  mininez_inst_t *pc = code;
+  uint8_t prev = Nop, prev2 = Nop;
+  s->loop_exit = (uint8_t *) VM_MALLOC(size);
+  memset(s->loop_exit, 0, size);
+  for (uint64_t i = 0; i < mininez_code_length(code); i++) {
+    uint8_t op = *pc;
+    if (op == TLookup && pc[opcode_length(TLookup)] == Alt) {
+      /* jump over the lookup and its Alt straight into the body */
+      pc[0] = Jump;
+      *(int16_t *)(pc + 1) = opcode_length(TLookup) + opcode_length(Alt) - opcode_length(Jump);
+      /* the 5 bytes left of the pair become one (dead) instruction, so that
+       * walking the length of the code still covers the code */
+      pc[opcode_length(Jump)] = Lookup;
+    } else if (op == TMemo) {
+      pc[0] = Jump;
+      *(int16_t *)(pc + 1) = 0;
+    } else if (op == TFold || op == TPop) {
+      s->eager = 0;
+    } else if (op == Succ && prev == Jump && prev2 == Step) {
+      s->loop_exit[pc - code] = 1;
+    }
+    prev2 = prev;
+    prev = op;
+    pc += opcode_length(op);
+  }
+  return code;
+}
+
+int mininez_stream_parse(mininez_runtime_t *r, mininez_inst_t *inst, mininez_stream_t *s) {
+  ParserContext *ctx = r->ctx;
+  mininez_inst_t *code = stream_prepare(r, inst, s);
+  ParserContext_initTreeFunc(ctx, NULL, NEW, LINK, stream_gc);
+  r->stream = s;
+  ctx->unused_stack = 0;
+  ctx->pos = ctx->inputs;
+  mininez_init_vm(ctx);
+  int result = mininez_parse(r, code);
+  if (result == 1) {
+    stream_tree(s, ctx->left);
+  }
+  r->stream = NULL;
+  ParserContext_backLog(ctx, 0);
+  GCDEC(ctx, ctx->left);
+  ctx->left = NULL;
+  ParserContext_initTreeFunc(ctx, NULL, NULL, NULL, NULL);
+  VM_FREE(s->loop_exit);
+  s->loop_exit = NULL;
+  mininez_dispose_instructions(code);
+  r->threaded_code = NULL; /* another copy may get the same address */
+  return result;
+}
+
+void mininez_event_sink_init(mininez_event_sink_t *sink, FILE *fp) {
+  sink->fp = fp;
+  sink->size = 0;
+}
+
+void mininez_event_sink_flush(mininez_event_sink_t *sink) {
+  fwrite(sink->buf, 1, sink->size, sink->fp);
+  sink->size = 0;
+}
+
+static void sink_write(mininez_event_sink_t *sink, const char *p, size_t len) {
+  while (len > 0) {
+    size_t n = sizeof(sink->buf) - sink->size;
+    if (n == 0) {
+      mininez_event_sink_flush(sink);
+      continue;
+    }
+    n = n < len ? n : len;
+    memcpy(sink->buf + sink->size, p, n);
+    sink->size += n;
+    p += n;
+    len -= n;
+  }
+}
+
+static void sink_puts(mininez_event_sink_t *sink, const char *s) {
+  sink_write(sink, s, strlen(s));
+}
+
+/* keep one event per line */
+static void sink_escape(mininez_event_sink_t *sink, const unsigned char *text, size_t len) {
+  size_t start = 0;
+  for (size_t i = 0; i < len; i++) {
+    const char *esc = NULL;
+    switch (text[i]) {
+    case '\\': esc = "\\\\"; break;
+    case '\n': esc = "\\n"; break;
+    case '\r': esc = "\\r"; break;
+    case '\t': esc = "\\t"; break;
+    }
+    if (esc != NULL) {
+      sink_write(sink, (const char *)text + start, i - start);
+      sink_puts(sink, esc);
+      start = i + 1;
+    }
+  }
+  sink_write(sink, (const char *)text + start, len - start);
+}
+
+void mininez_event_sink(mininez_event_t *e, void *data) {
+  mininez_event_sink_t *sink = (mininez_event_sink_t *)data;
+  switch (e->type) {
+  case MININEZ_EVENT_BEGIN:
+    sink_puts(sink, "begin\n");
+    break;
+  case MININEZ_EVENT_TAG:
+    sink_puts(sink, "tag #");
+    sink_puts(sink, e->name);
+    sink_puts(sink, "\n");
+    break;
+  case MININEZ_EVENT_TEXT:
+    sink_puts(sink, "text '");
+    sink_escape(sink, e->text, e->len);
+    sink_puts(sink, "'\n");
+    break;
+  case MININEZ_EVENT_LABEL:
+    sink_puts(sink, "label $");
+    sink_puts(sink, e->name);
+    sink_puts(sink, "\n");
+    break;
+  case MININEZ_EVENT_END:
+    sink_puts(sink, "end\n");
+    break;
+  }
+}
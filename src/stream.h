@@ -0,0 +1,65 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include "nezvm.h"
+
+typedef enum mininez_event_type_t {
+  MININEZ_EVENT_BEGIN,
+  MININEZ_EVENT_TAG,
+  MININEZ_EVENT_TEXT,
+  MININEZ_EVENT_LABEL,
+  MININEZ_EVENT_END
+} mininez_event_type_t;
+
+/* Parse Events
+ * Every node produces BEGIN, the events of its children, TAG, TEXT (leaves
+ * only) and END. A labeled child is followed by LABEL once it has ended.
+ */
+typedef struct mininez_event_t {
+  mininez_event_type_t type;
+  const char *name;          /* TAG, LABEL */
+  const unsigned char *text; /* TEXT */
+  size_t len;
+} mininez_event_t;
+
+typedef void (*mininez_event_f)(mininez_event_t *e, void *data);
+
+typedef struct mininez_stream_t {
+  mininez_event_f callback;
+  void *data;
+  size_t events;
+  /* commit tracking */
+  int eager;
+  uint8_t *loop_exit;
+  size_t pending;
+  size_t last_log;
+  size_t last_fail;
+  size_t last_saved;
+} mininez_stream_t;
+
+/* Streaming Parse
+ * Nodes are reported as soon as no live choice point can roll them back,
+ * and their subtrees are released right after. Grammars with left folding
+ * ($ in a node) or TPop are reported once the whole parse has finished.
+ * Events already delivered are not withdrawn on a syntax error.
+ */
+void mininez_stream_init(mininez_stream_t *s, mininez_event_f callback, void *data);
+int mininez_stream_parse(mininez_runtime_t *r, mininez_inst_t *inst, mininez_stream_t *s);
+
+/* VM hooks */
+void mininez_stream_flush(mininez_runtime_t *r);
+int mininez_stream_end(mininez_runtime_t *r, int shift, symbol_t tag, const char *text, size_t len);
+
+/* Buffered Text Sink: one event per line */
+typedef struct mininez_event_sink_t {
+  FILE *fp;
+  size_t size;
+  char buf[64 * 1024];
+} mininez_event_sink_t;
+
+void mininez_event_sink_init(mininez_event_sink_t *sink, FILE *fp);
+void mininez_event_sink(mininez_event_t *e, void *data);
+void mininez_event_sink_flush(mininez_event_sink_t *sink);
+
+#endif
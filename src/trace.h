@@ -0,0 +1,38 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Static Tracepoints
+ * With MININEZ_USDT=1 (cmake turns it on where <sys/sdt.h> exists; off with
+ * -DMININEZ_USDT=OFF) these are USDT probes of the provider "mininez": one
+ * NOP each until a tracer attaches, e.g.
+ *   bpftrace -e 'usdt:./mininez:mininez:memo__miss { @[arg0] = count(); }'
+ * Positions are byte offsets into the input.
+ *   parse__start(runtime, entry pc, pos)
+ *   parse__end(runtime, result, pos)       result: MININEZ_ABORTED past a limit
+ *   production__enter(production id, pos)
+ *   production__return(production id, pos)  not fired when a failure unwinds it
+ *   memo__hit(memo point, pos, result)       result: 1 succeeded, 2 failed
+ *   memo__miss(memo point, pos)
+ *   choice__push(pos)
+ *   choice__commit(pos)
+ *   choice__fail(pos, pos resumed at)
+ *   tree__new(tag, pos, length, children)
+ */
+#ifndef MININEZ_USDT
+#define MININEZ_USDT 0
+#endif
+
+#if MININEZ_USDT
+#include <sys/sdt.h>
+#define MININEZ_TRACE1(NAME, A)          DTRACE_PROBE1(mininez, NAME, A)
+#define MININEZ_TRACE2(NAME, A, B)       DTRACE_PROBE2(mininez, NAME, A, B)
+#define MININEZ_TRACE3(NAME, A, B, C)    DTRACE_PROBE3(mininez, NAME, A, B, C)
+#define MININEZ_TRACE4(NAME, A, B, C, D) DTRACE_PROBE4(mininez, NAME, A, B, C, D)
+#else
+#define MININEZ_TRACE1(NAME, A)
+#define MININEZ_TRACE2(NAME, A, B)
+#define MININEZ_TRACE3(NAME, A, B, C)
+#define MININEZ_TRACE4(NAME, A, B, C, D)
+#endif
+
+#endif